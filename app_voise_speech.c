@@ -25,6 +25,15 @@
 
 #include "asterisk.h"
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 1 $")
 
 #include "asterisk/file.h"
@@ -35,6 +44,17 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 1 $")
 #include "asterisk/lock.h"
 #include "asterisk/app.h"
 #include "asterisk/format_cache.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/cli.h"
+#include "asterisk/utils.h"
+#include "asterisk/strings.h"
+#include "asterisk/paths.h"
+#include "asterisk/md5.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+#include "asterisk/timing.h"
+#include "asterisk/dsp.h"
+#include "asterisk/speech.h"
 
 #include <voise_client.h>
 
@@ -52,8 +72,498 @@ static const char *VOISE_DEF_HOST = "127.0.0.1";
 static const char *VOISE_DEF_LANG = "pt-BR";
 static const char *VOISE_DEF_VERBOSE = "0"; /* disabled */
 
+static const char *VOISE_DEF_TTS_CACHE_MAX_BYTES = "67108864"; /* 64 MB */
+static const char *VOISE_DEF_TTS_VOICE_VERSION = "1";
+static const char *VOISE_DEF_TTS_DISK_MAX_BYTES = "1073741824"; /* 1 GB */
+static const char *VOISE_DEF_TTS_DISK_SLOTS = "65536";
+static const char *VOISE_DEF_TTS_CATALOG_CONCURRENCY = "4";
+static const char *VOISE_DEF_TTS_CATALOG_FORMATS = "ulaw";
+static const char *VOISE_DEF_TTS_RENDER_WORKERS = "4";
+static const char *VOISE_DEF_TTS_PREFETCH_MS = "1000";
+static const char *VOISE_DEF_TTS_UNDERRUN_FILL = "silence";
+static const char *VOISE_DEF_TTS_SEGMENT_MAX_CHARS = "250";
+static const char *VOISE_DEF_TTS_LOOKAHEAD = "2";
+static const char *VOISE_DEF_TTS_POOL_SIZE = "8";
+static const char *VOISE_DEF_TTS_READ_MS = "100";
+static const char *VOISE_DEF_TTS_CROSSFADE_MS = "10";
+static const char *VOISE_DEF_TTS_BARGE_THRESHOLD = "256";
+static const char *VOISE_DEF_TTS_BARGE_MIN_MS = "200";
+static const char *VOISE_DEF_TTS_LEAD_IN_MS = "0";
+static const char *VOISE_DEF_TTS_TRIM_THRESHOLD = "128";
+static const char *VOISE_DEF_TTS_TRIM_GUARD_MS = "50";
+
 static const int MAX_WAIT_TIME = 1000; /*ms*/
 
+/* VoiseAsk: speech engine and name of a grammar file, inbound audio kept
+ * during the prompt for a barge-in (8 kHz slin), and the longest gap without
+ * inbound audio before the recognizer is fed silence */
+static const char *VOISE_ASK_ENGINE = "voise";
+static const char *VOISE_ASK_GRAMMAR = "voiseask";
+#define VOISE_ASK_PREROLL_MS 400
+static const int VOISE_ASK_GAP_MS = 100;
+
+static const int VOISE_TTS_CACHE_BUCKETS = 1021;
+
+static const uint32_t VOISE_TTS_DISK_MAGIC = 0x564f4953; /* "VOIS" */
+static const uint32_t VOISE_TTS_DISK_VERSION = 1;
+
+/* Compact the disk segment when this percentage of it is evicted audio */
+static const int VOISE_TTS_DISK_COMPACT_DEAD_PCT = 25;
+
+/* Evict from the disk index above this percentage of used slots */
+static const int VOISE_TTS_DISK_MAX_LOAD_PCT = 75;
+
+/* Prompts that do not fit in a full segment wait in memory for the next
+ * compaction, up to this percentage of the segment size */
+static const int VOISE_TTS_DISK_PENDING_PCT = 5;
+
+/* Synthesized audio kept in the TTS cache */
+struct voise_tts_entry
+{
+    /* Normalized text, language, format, rate and voice version */
+    char *key;
+
+    /* Audio in the format given in the key */
+    unsigned char *audio;
+    size_t len;
+
+    /* LRU list, most recently used first */
+    struct voise_tts_entry *lru_prev;
+    struct voise_tts_entry *lru_next;
+};
+
+/* In-memory LRU cache of synthesized audio, keyed by voise_tts_entry.key.
+ * The table and the LRU list are protected by voise_tts_cache_lock */
+static struct ao2_container *voise_tts_cache;
+static struct voise_tts_entry *voise_tts_lru_head;
+static struct voise_tts_entry *voise_tts_lru_tail;
+AST_MUTEX_DEFINE_STATIC(voise_tts_cache_lock);
+
+static struct
+{
+    int enabled;
+
+    /* Byte budget */
+    size_t max_bytes;
+
+    /* Server voice version, part of the key so a new voice is not served stale audio */
+    char voice_version[32];
+
+    /* Counters */
+    size_t bytes;
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+    unsigned int coalesced;
+    unsigned int derived;
+
+    /* Prompts are synthesized once, as signed linear 16 kHz, and the other
+     * formats are derived from it */
+    int master;
+} voise_tts_cache_info;
+
+/* Cached audio being played: a memory entry or a region of the disk segment */
+struct voise_tts_audio
+{
+    const unsigned char *data;
+    size_t len;
+
+    /* ao2 object that keeps data valid (entry or disk map) */
+    void *owner;
+};
+
+/* Header of the disk index file */
+struct voise_tts_disk_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t used_slots;
+
+    /* Bytes appended to the segment */
+    uint64_t seg_len;
+
+    /* Bytes of the segment held by evicted entries */
+    uint64_t dead_bytes;
+};
+
+enum voise_tts_disk_slot_state
+{
+    VOISE_TTS_DISK_SLOT_EMPTY = 0,
+    VOISE_TTS_DISK_SLOT_USED,
+    VOISE_TTS_DISK_SLOT_DELETED,
+};
+
+/* Slot of the disk index (open addressing, linear probing) */
+struct voise_tts_disk_slot
+{
+    /* MD5 of the cache key */
+    unsigned char digest[16];
+
+    /* Audio position in the segment */
+    uint64_t offset;
+    uint32_t len;
+
+    uint32_t state;
+
+    /* Last lookup (seconds), for eviction */
+    uint64_t last_used;
+};
+
+/* Index and segment files, memory-mapped. Replaced as a whole by compaction;
+ * playbacks keep a reference to the map they read from */
+struct voise_tts_disk_map
+{
+    int idx_fd;
+    int seg_fd;
+
+    struct voise_tts_disk_header *header;
+    struct voise_tts_disk_slot *slots;
+    size_t idx_size;
+
+    unsigned char *seg;
+    size_t seg_size;
+};
+
+/* Prompt waiting for compaction to make room in the segment */
+struct voise_tts_disk_pending
+{
+    AST_LIST_ENTRY(voise_tts_disk_pending) list;
+
+    unsigned char digest[16];
+    size_t len;
+    unsigned char audio[0];
+};
+
+/* Disk tier of the TTS cache. voise_tts_disk_lock protects the current map
+ * and the prompts waiting for compaction */
+static struct voise_tts_disk_map *voise_tts_disk;
+static AST_LIST_HEAD_NOLOCK_STATIC(voise_tts_disk_pending_list, voise_tts_disk_pending);
+static size_t voise_tts_disk_pending_bytes;
+AST_RWLOCK_DEFINE_STATIC(voise_tts_disk_lock);
+
+static struct
+{
+    int enabled;
+
+    char dir[PATH_MAX];
+    size_t max_bytes;
+    unsigned int num_slots;
+
+    /* Counters */
+    int hits;
+    int misses;
+    int evictions;
+    int compactions;
+} voise_tts_disk_info;
+
+/* Prompt of a TTS job, in one format */
+struct voise_tts_job_item
+{
+    char *text;
+    char *lang;
+    struct ast_format *format;
+
+    /* Sound file, for a render job */
+    char *path;
+
+    /* Result, for the render manifest */
+    int done;
+    size_t len;
+    char md5[33];
+};
+
+/* Background job over the prompts of a list file, run by workers in parallel:
+ * the catalog pre-synthesis and the rendering to sound files. Only one of
+ * each runs at a time */
+struct voise_tts_job
+{
+    /* Name in logs, and what is done to an item that was not cached */
+    const char *name;
+    const char *verb;
+
+    /* Lines start with a file name */
+    int named;
+
+    /* Set up the item of a line in a format. Returns -1 to skip it */
+    int (*add)(struct voise_tts_job_item *item, const char *name, const char *format_name);
+
+    /* Process an item. Returns < 0 on failure, 0 when it was cached, > 0 otherwise */
+    int (*process)(struct voise_tts_job *job, struct voise_tts_job_item *item);
+
+    /* Called once the workers are done, or NULL */
+    void (*done)(struct voise_tts_job *job);
+
+    ast_mutex_t *lock;
+    pthread_t thread;
+
+    char file[PATH_MAX];
+    char serverip[256];
+    int workers;
+
+    struct voise_tts_job_item *items;
+    int num_items;
+
+    /* Next item to take */
+    int next;
+
+    /* Progress */
+    int processed;
+    int cached;
+    int failed;
+    struct timeval start;
+    struct timeval end;
+
+    int running;
+    int stop;
+};
+
+/* Filling of a frame the prefetch worker did not deliver in time */
+enum voise_tts_underrun_fill
+{
+    VOISE_TTS_FILL_NONE = 0,  /* skip the frame */
+    VOISE_TTS_FILL_SILENCE,
+    VOISE_TTS_FILL_NOISE,     /* low level comfort noise */
+};
+
+/* Segment of a prompt (a sentence or clause), synthesized or found in the cache
+ * ahead of its playback */
+struct voise_tts_segment
+{
+    char *text;
+    char *key;
+
+    /* Cache hit */
+    struct voise_tts_audio cached;
+    int is_cached;
+
+    /* Synthesis in flight the audio is copied from, and its conversion when
+     * it is the master of the segment's format */
+    struct voise_tts_inflight *inflight;
+    struct voise_tts_transcoder *transcoder;
+
+    /* Synthesized audio, appended as it arrives */
+    unsigned char *audio;
+    size_t len;
+    size_t size;
+
+    /* Synthesis ended, and whether it got to the end */
+    int done;
+    int complete;
+};
+
+/* Synthesis settings of a VoiseSay playback */
+struct voise_tts_synth_options
+{
+    /* Texts longer than this are split in sentences (0 keeps them whole) */
+    int segment_max_chars;
+
+    /* Segments synthesized ahead of the one playing */
+    int lookahead;
+
+    /* The text is a template: static fragments with {variable} parts */
+    int template;
+
+    /* Crossfade between the pieces of a template */
+    int crossfade_ms;
+
+    /* The text is streamed: more is appended while the prompt plays */
+    int stream;
+};
+
+/* Runtime counters */
+enum voise_stat
+{
+    /* Gauges */
+    VOISE_STAT_PLAYBACKS,
+    VOISE_STAT_CONNS_OPEN,
+    VOISE_STAT_CONNS_POOLED,
+
+    /* Syntheses started */
+    VOISE_STAT_SYNTHS,
+
+    /* Text and audio sent, audio and results received */
+    VOISE_STAT_BYTES_SENT,
+    VOISE_STAT_BYTES_RECEIVED,
+
+    VOISE_STAT_MAX
+};
+
+/* Phases of a synthesis with a latency histogram */
+enum voise_hist
+{
+    /* Connection to the server */
+    VOISE_HIST_CONNECT,
+
+    /* voise_start_synth() until the server accepts */
+    VOISE_HIST_SYNTH_START,
+
+    /* voise_start_synth() until the first audio is read */
+    VOISE_HIST_FIRST_BYTE,
+
+    /* Each voise_read_synth() */
+    VOISE_HIST_CHUNK_READ,
+
+    VOISE_HIST_MAX
+};
+
+static const char *voise_hist_names[VOISE_HIST_MAX] = {
+    [VOISE_HIST_CONNECT] = "Connect",
+    [VOISE_HIST_SYNTH_START] = "Synth start",
+    [VOISE_HIST_FIRST_BYTE] = "First byte",
+    [VOISE_HIST_CHUNK_READ] = "Chunk read",
+};
+
+#include "voise_stats.h"
+
+/* Counters that belong to no server (playbacks) */
+static struct voise_stats voise_stats_module;
+
+/* Idle connection to the TTS server, kept for the next synthesis */
+struct voise_tts_conn
+{
+    voise_client_t client;
+    char serverip[256];
+
+    /* Counters of the server */
+    struct voise_stats *stats;
+
+    /* Start of the synthesis, until its first audio is read */
+    struct timeval synth_start;
+
+    AST_LIST_ENTRY(voise_tts_conn) list;
+};
+
+/* Pool of idle TTS connections */
+static AST_LIST_HEAD_STATIC(voise_tts_pool, voise_tts_conn);
+static int voise_tts_pool_count;
+static int voise_tts_pool_max;
+
+/* Audio asked of the server per read, in ms */
+static int voise_tts_read_ms;
+
+/* Synthesis in flight, shared by the playbacks of the same segment (same text,
+ * language, format and rate), so an announcement played on many channels at
+ * once is synthesized once. A reader thread appends the audio as it arrives,
+ * and every playback copies it from there at its own pace */
+struct voise_tts_inflight
+{
+    /* Cache key, or NULL when the synthesis is not shared */
+    char *key;
+    struct ast_format *format;
+    struct voise_tts_conn *conn;
+
+    /* Protected by lock */
+    unsigned char *audio;
+    size_t len;
+    size_t size;
+    int done;
+    int complete;
+    int subscribers;
+
+    ast_mutex_t lock;
+    ast_cond_t cond;
+
+    AST_LIST_ENTRY(voise_tts_inflight) list;
+};
+
+/* Syntheses in flight */
+static AST_LIST_HEAD_STATIC(voise_tts_inflight_list, voise_tts_inflight);
+
+/* Wake up of a playback waiting for audio in flight, to notice it was stopped */
+static const int VOISE_TTS_INFLIGHT_POLL_MS = 100;
+
+/* Playback of a VoiseSay prompt. The text is split in segments: a synthesis
+ * worker synthesizes them in order, up to lookahead segments ahead of the one
+ * playing, and a prefetch worker reads them ahead into a bounded ring. The
+ * channel thread only dequeues frames from it. A cached prompt is dequeued
+ * straight from the cache */
+struct voise_tts_playback
+{
+    struct ast_format *format;
+    size_t frame_len;
+    int verbose;
+
+    /* Cached audio, or NULL when synthesizing */
+    struct voise_tts_audio *cached;
+    size_t cached_offset;
+    size_t cached_end;
+
+    char *serverip;
+    char *lang;
+
+    /* Segments, protected by lock */
+    struct voise_tts_segment *segments;
+    int num_segments;
+    int lookahead;
+
+    /* Streamed text: more segments may be appended (up to segments_size),
+     * from the text pending until a sentence is complete */
+    int open;
+    int segments_size;
+    int segment_max_chars;
+    char *pending;
+
+    /* Segment being fed to the ring */
+    int feed_index;
+
+    /* Tail of the last segment fed, held back to crossfade it into the next */
+    unsigned char *xfade;
+    size_t xfade_len;
+    size_t xfade_held;
+
+    /* Ring of prefetched audio, protected by lock. The frame being
+     * written is kept in the ring until the next one is dequeued */
+    unsigned char *ring;
+    size_t ring_size;
+    size_t ring_head;
+    size_t ring_count;
+    size_t ring_pending;
+
+    /* Frame buffer, with headroom for the channel drivers */
+    unsigned char *frame_buf;
+
+    ast_mutex_t lock;
+    ast_cond_t cond;
+    pthread_t thread;
+    pthread_t synth_thread;
+
+    /* Worker state */
+    int eof;
+    int error;
+    int stop;
+
+    /* Silence played before the prompt */
+    size_t lead_in;
+
+    /* Silence trimmed from the start (and, when it is cached, the end) of the
+     * prompt: samples up to trim_threshold, but for trim_guard bytes next to
+     * the speech */
+    int trim_threshold;
+    size_t trim_guard;
+    int trim_lead;
+    size_t trimmed;
+
+    /* First audio dequeued: waiting for it is not an underrun */
+    int started;
+
+    /* Time from the creation of the playback to its first synthesized audio
+     * played (in milliseconds), -1 until then */
+    struct timeval created;
+    int first_audio_ms;
+
+    enum voise_tts_underrun_fill fill;
+    unsigned int noise_seed;
+    int underruns;
+};
+
+/* Compaction thread */
+static pthread_t voise_tts_compact_thread = AST_PTHREADT_NULL;
+static ast_mutex_t voise_tts_compact_lock;
+static ast_cond_t voise_tts_compact_cond;
+static int voise_tts_compact_pending;
+static int voise_tts_compact_stop;
+
 /*
 * Application info
 */
@@ -66,9 +576,126 @@ static char *voise_say_descrip =
 "- options     : v (verbosity on)\n"
 "                b (beep before prompt)\n"
 "                n (do not hangup on Voise error)\n"
+"                t (text is a template: {variable} parts are synthesized\n"
+"                   every time, the static fragments are cached)\n"
+"                e(digits) (interrupt on one of the digits)\n"
+"                s([ms]) (interrupt when the caller speaks for ms)\n"
+"On interruption, VOISE_INTERRUPT_CAUSE is set to DTMF, SPEECH or HANGUP\n"
+"(NONE when the prompt played to the end), VOISE_INTERRUPT_DIGIT to the\n"
+"digit and VOISE_INTERRUPT_OFFSET to the ms of the prompt played.\n"
+"VOISE_TTS_TRIMMED_MS is set to the ms of silence trimmed from the prompt,\n"
+"and VOISE_TTS_FIRST_AUDIO_MS to the ms from the start of the synthesis to\n"
+"its first audio played (also in the CDR with [general] cdr_latency).\n"
 "\n";
 static char *voise_say_app = "VoiseSay";
 
+/* VoiseBackground */
+static char *voise_background_descrip =
+"VoiseBackground(text[,lang][,options])\n"
+"Start playing a text synthesized by Voise TTS engine, and return at once.\n"
+"The prompt plays while the dialplan goes on, like music on hold: it is\n"
+"driven by the channel media, and stops when something else is played.\n"
+"- text        : text to synth\n"
+"- lang        : tts language\n"
+"- options     : v (verbosity on)\n"
+"                t (text is a template, see VoiseSay)\n"
+"                m (streamed text: text is only the start, maybe empty)\n"
+"Use the function VOISE_BACKGROUND(action[,timeout]) to follow it:\n"
+"- status      : PLAYING, DONE (played to the end), STOPPED or NONE\n"
+"- position    : ms of the prompt played\n"
+"- trimmed     : ms of silence trimmed from the prompt so far\n"
+"- wait        : wait until the prompt ends (at most timeout seconds),\n"
+"                and return its status\n"
+"- stop        : stop the prompt, and return its status\n"
+"The text of a streamed prompt is written to the function, e.g. from AGI:\n"
+"- append      : Set(VOISE_BACKGROUND(append)=text) adds text. Each\n"
+"                sentence is synthesized as soon as it is complete\n"
+"- end         : Set(VOISE_BACKGROUND(end)=text) adds the last text\n"
+"\n";
+static char *voise_background_app = "VoiseBackground";
+
+/* VoiseAsk */
+static char *voise_ask_descrip =
+"VoiseAsk(text,grammar[,options][,lang])\n"
+"Play a prompt synthesized by Voise TTS engine and recognize the answer with\n"
+"the Voise speech engine (res_speech_voise), whose [general] settings apply.\n"
+"The recognition stream is opened while the prompt is synthesized. Audio is\n"
+"sent to it from the caller's speech that interrupts the prompt (from the\n"
+"start of that speech), or from the end of the prompt.\n"
+"- text        : text to synth\n"
+"- grammar     : model name, or path of a grammar file\n"
+"- options     : v (verbosity on)\n"
+"                t (text is a template, see VoiseSay)\n"
+"                s(ms) (speech needed to interrupt the prompt)\n"
+"                x (no barge-in: listen after the prompt)\n"
+"- lang        : language\n"
+"Sets VOISE_ASK_STATUS (OK, NOINPUT, ERROR or HANGUP), VOISE_ASK_TEXT,\n"
+"VOISE_ASK_INTENT, VOISE_ASK_SCORE, VOISE_ASK_BARGEIN and VOISE_TTS_TRIMMED_MS\n"
+"(ms of silence trimmed from the prompt, as with VoiseSay), and the latencies\n"
+"of the call in ms (also in the CDR with [general] cdr_latency):\n"
+"VOISE_CONNECT_MS, VOISE_START_MS, VOISE_SPEECH_ONSET_MS (from the start of\n"
+"the prompt with barge-in, of listening otherwise), VOISE_ENDPOINT_MS,\n"
+"VOISE_RESULT_MS and VOISE_TTS_FIRST_AUDIO_MS, and VOISE_END_REASON (initsil,\n"
+"maxsil, abs_timeout, error or hangup).\n"
+"\n";
+static char *voise_ask_app = "VoiseAsk";
+
+/* VoiseRender */
+static char *voise_render_descrip =
+"VoiseRender(file,text[,lang])\n"
+"Synthesize a text into a sound file, to be played with Playback.\n"
+"- file        : file name, relative to the sounds directory (no '..').\n"
+"                Its extension gives the format: ulaw (default), alaw, sln\n"
+"                or sln16\n"
+"- text        : text to synth\n"
+"- lang        : tts language\n"
+"Sets VOISE_RENDER_STATUS (OK or ERROR), VOISE_RENDER_DURATION (ms) and\n"
+"VOISE_RENDER_MD5. See also the CLI command 'voise tts render'.\n"
+"\n";
+static char *voise_render_app = "VoiseRender";
+
+enum voise_say_option_flags
+{
+    VOISE_SAY_OPT_VERBOSE = (1 << 0),
+    VOISE_SAY_OPT_BEEP = (1 << 1),
+    VOISE_SAY_OPT_NO_HANGUP = (1 << 2),
+    VOISE_SAY_OPT_TEMPLATE = (1 << 3),
+    VOISE_SAY_OPT_ESCAPE = (1 << 4),
+    VOISE_SAY_OPT_BARGE = (1 << 5),
+    VOISE_SAY_OPT_NO_BARGE = (1 << 6),
+    VOISE_SAY_OPT_STREAM = (1 << 7),
+};
+
+enum voise_say_option_args
+{
+    VOISE_SAY_OPT_ARG_ESCAPE = 0,
+    VOISE_SAY_OPT_ARG_BARGE,
+    /* This MUST be the last value in this enum! */
+    VOISE_SAY_OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(voise_say_options, BEGIN_OPTIONS
+    AST_APP_OPTION('v', VOISE_SAY_OPT_VERBOSE),
+    AST_APP_OPTION('b', VOISE_SAY_OPT_BEEP),
+    AST_APP_OPTION('n', VOISE_SAY_OPT_NO_HANGUP),
+    AST_APP_OPTION('t', VOISE_SAY_OPT_TEMPLATE),
+    AST_APP_OPTION_ARG('e', VOISE_SAY_OPT_ESCAPE, VOISE_SAY_OPT_ARG_ESCAPE),
+    AST_APP_OPTION_ARG('s', VOISE_SAY_OPT_BARGE, VOISE_SAY_OPT_ARG_BARGE),
+END_OPTIONS );
+
+AST_APP_OPTIONS(voise_background_options, BEGIN_OPTIONS
+    AST_APP_OPTION('v', VOISE_SAY_OPT_VERBOSE),
+    AST_APP_OPTION('t', VOISE_SAY_OPT_TEMPLATE),
+    AST_APP_OPTION('m', VOISE_SAY_OPT_STREAM),
+END_OPTIONS );
+
+AST_APP_OPTIONS(voise_ask_options, BEGIN_OPTIONS
+    AST_APP_OPTION('v', VOISE_SAY_OPT_VERBOSE),
+    AST_APP_OPTION('t', VOISE_SAY_OPT_TEMPLATE),
+    AST_APP_OPTION_ARG('s', VOISE_SAY_OPT_BARGE, VOISE_SAY_OPT_ARG_BARGE),
+    AST_APP_OPTION('x', VOISE_SAY_OPT_NO_BARGE),
+END_OPTIONS );
+
 /*! \brief Helper function. Read config file*/
 static struct ast_config* voise_load_asterisk_config(void)
 {
@@ -78,87 +705,5145 @@ static struct ast_config* voise_load_asterisk_config(void)
     return ast_config_load(VOISE_CFG, config_flags);
 }
 
-static void __voise_capture_error_cb(const char* fmt, ...)
-{
-    char msg[1000];
-    va_list va;
+static void __voise_capture_error_cb(const char* fmt, ...)
+{
+    char msg[1000];
+    va_list va;
+
+    va_start(va, fmt);
+
+    vsnprintf(msg, 1000, fmt, va);
+    ast_log(LOG_ERROR, "libvoise.so -> %s", msg);
+
+    va_end(va);
+}
+
+static struct ast_format* ast_channel_get_speechwriteformat(struct ast_channel *chan)
+{
+    TRACE_FUNCTION();
+
+    struct ast_format *raw_format = ast_channel_rawreadformat(chan);
+
+    if (raw_format == ast_format_ulaw || raw_format == ast_format_alaw)
+        return raw_format;
+
+    int sample_rate = ast_format_get_sample_rate(raw_format);
+
+    return ast_format_cache_get_slin_by_rate(sample_rate);
+}
+
+static int voise_get_bytes_per_sample(struct ast_format *format)
+{
+    if (format == ast_format_ulaw || format == ast_format_alaw)
+        return 1;
+
+    /* linear */
+    return 2;
+}
+
+/*! \brief Helper function. Set a per-call variable, and the CDR variable of
+ * the same name when asked */
+static void __voise_set_call_var(struct ast_channel *chan, const char *name, const char *value, int cdr)
+{
+    pbx_builtin_setvar_helper(chan, name, value);
+
+    if (cdr && !ast_strlen_zero(value))
+    {
+        char cdr_name[64];
+        snprintf(cdr_name, sizeof(cdr_name), "CDR(%s)", name);
+
+        ast_func_write(chan, cdr_name, value);
+    }
+}
+
+/*! \brief Helper function. Set a per-call latency, empty when it was not measured */
+static void __voise_set_call_latency(struct ast_channel *chan, const char *name, int ms, int cdr)
+{
+    char value[16] = "";
+
+    if (ms >= 0)
+        snprintf(value, sizeof(value), "%d", ms);
+
+    __voise_set_call_var(chan, name, value, cdr);
+}
+
+/*! \brief Helper function. Export the latencies of a call to the CDR ([general] cdr_latency) */
+static int __voise_cdr_latency(struct ast_config *vcfg)
+{
+    const char *vcdr = ast_variable_retrieve(vcfg, "general", "cdr_latency");
+
+    return vcdr ? ast_true(vcdr) : 0;
+}
+
+/* ********************************* */
+/* *********** TTS cache *********** */
+/* ********************************* */
+
+static void __voise_tts_entry_destructor(void *obj)
+{
+    struct voise_tts_entry *entry = obj;
+
+    ast_free(entry->key);
+    ast_free(entry->audio);
+}
+
+static int __voise_tts_entry_hash_fn(const void *obj, int flags)
+{
+    const struct voise_tts_entry *entry;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK)
+    {
+    case OBJ_SEARCH_KEY:
+        key = obj;
+        break;
+    case OBJ_SEARCH_OBJECT:
+        entry = obj;
+        key = entry->key;
+        break;
+    default:
+        ast_assert(0);
+        return 0;
+    }
+
+    return ast_str_hash(key);
+}
+
+static int __voise_tts_entry_cmp_fn(void *obj, void *arg, int flags)
+{
+    const struct voise_tts_entry *left = obj;
+    const struct voise_tts_entry *right = arg;
+    const char *right_key = arg;
+
+    switch (flags & OBJ_SEARCH_MASK)
+    {
+    case OBJ_SEARCH_OBJECT:
+        right_key = right->key;
+        /* Fall through */
+    case OBJ_SEARCH_KEY:
+        return strcmp(left->key, right_key) ? 0 : CMP_MATCH;
+    default:
+        return 0;
+    }
+}
+
+/*! \brief Helper function. Build the cache key of a prompt. Whitespace of the text is normalized.
+ * Fields are length-prefixed, so a '|' in the text cannot make two prompts share a key */
+static char* __voise_tts_cache_key(const char *text, const char *lang, struct ast_format *format)
+{
+    struct ast_str *norm = ast_str_create(strlen(text) + 1);
+    struct ast_str *key = ast_str_create(strlen(text) + 64);
+
+    if (norm == NULL || key == NULL)
+    {
+        ast_free(norm);
+        ast_free(key);
+        return NULL;
+    }
+
+    int pending_space = 0;
+
+    for (text = ast_skip_blanks(text); *text; ++text)
+    {
+        if (isspace((unsigned char)*text))
+        {
+            pending_space = 1;
+            continue;
+        }
+
+        if (pending_space)
+            ast_str_append(&norm, 0, " ");
+
+        ast_str_append(&norm, 0, "%c", *text);
+        pending_space = 0;
+    }
+
+    const char *format_name = ast_format_get_name(format);
+
+    ast_str_set(&key, 0, "%zu:%s|%zu:%s|%zu:%s|%u|%zu:%s",
+        ast_str_strlen(norm), ast_str_buffer(norm), strlen(lang), lang, strlen(format_name), format_name,
+        ast_format_get_sample_rate(format), strlen(voise_tts_cache_info.voice_version), voise_tts_cache_info.voice_version);
+
+    char *result = ast_strdup(ast_str_buffer(key));
+
+    ast_free(norm);
+    ast_free(key);
+
+    return result;
+}
+
+/*! \brief Helper function. Unlink an entry from the LRU list. Cache must be locked */
+static void __voise_tts_lru_unlink(struct voise_tts_entry *entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        voise_tts_lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        voise_tts_lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+/*! \brief Helper function. Put an entry at the head of the LRU list. Cache must be locked */
+static void __voise_tts_lru_push(struct voise_tts_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = voise_tts_lru_head;
+
+    if (voise_tts_lru_head != NULL)
+        voise_tts_lru_head->lru_prev = entry;
+    else
+        voise_tts_lru_tail = entry;
+
+    voise_tts_lru_head = entry;
+}
+
+/*! \brief Helper function. Remove an entry from the cache. Cache must be locked */
+static void __voise_tts_cache_remove(struct voise_tts_entry *entry)
+{
+    __voise_tts_lru_unlink(entry);
+
+    voise_tts_cache_info.bytes -= entry->len;
+
+    ao2_unlink_flags(voise_tts_cache, entry, OBJ_NOLOCK);
+}
+
+/*! \brief Helper function. Find a prompt in the cache. Returns a new reference or NULL.
+ * Lookups that do not come from a playback do not count as hits or misses */
+static struct voise_tts_entry* __voise_tts_cache_find(const char *key, int count)
+{
+    if (!voise_tts_cache_info.enabled)
+        return NULL;
+
+    ast_mutex_lock(&voise_tts_cache_lock);
+
+    struct voise_tts_entry *entry = ao2_find(voise_tts_cache, key, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+
+    if (entry != NULL)
+    {
+        if (count)
+            voise_tts_cache_info.hits++;
+
+        __voise_tts_lru_unlink(entry);
+        __voise_tts_lru_push(entry);
+    }
+    else if (count)
+    {
+        voise_tts_cache_info.misses++;
+    }
+
+    ast_mutex_unlock(&voise_tts_cache_lock);
+
+    return entry;
+}
+
+/*! \brief Helper function. Add a synthesized prompt to the cache. Takes ownership of audio */
+static void __voise_tts_cache_add(const char *key, unsigned char *audio, size_t len)
+{
+    if (!voise_tts_cache_info.enabled || len == 0 || len > voise_tts_cache_info.max_bytes)
+    {
+        ast_free(audio);
+        return;
+    }
+
+    struct voise_tts_entry *entry = ao2_alloc(sizeof(struct voise_tts_entry), __voise_tts_entry_destructor);
+
+    if (entry == NULL || !(entry->key = ast_strdup(key)))
+    {
+        ao2_cleanup(entry);
+        ast_free(audio);
+        return;
+    }
+
+    entry->audio = audio;
+    entry->len = len;
+
+    ast_mutex_lock(&voise_tts_cache_lock);
+
+    /* Someone else synthesized the same prompt meanwhile */
+    struct voise_tts_entry *old = ao2_find(voise_tts_cache, key, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+
+    if (old != NULL)
+    {
+        __voise_tts_cache_remove(old);
+        ao2_ref(old, -1);
+    }
+
+    while (voise_tts_cache_info.bytes + len > voise_tts_cache_info.max_bytes && voise_tts_lru_tail != NULL)
+    {
+        __voise_tts_cache_remove(voise_tts_lru_tail);
+        voise_tts_cache_info.evictions++;
+    }
+
+    ao2_link_flags(voise_tts_cache, entry, OBJ_NOLOCK);
+    __voise_tts_lru_push(entry);
+
+    voise_tts_cache_info.bytes += len;
+
+    ast_mutex_unlock(&voise_tts_cache_lock);
+
+    ao2_ref(entry, -1);
+}
+
+/* ********************************* */
+/* ******** TTS disk cache ********* */
+/* ********************************* */
+
+static void __voise_tts_disk_map_destructor(void *obj)
+{
+    struct voise_tts_disk_map *map = obj;
+
+    if (map->header != NULL && map->header != MAP_FAILED)
+        munmap(map->header, map->idx_size);
+
+    if (map->seg != NULL && map->seg != MAP_FAILED)
+        munmap(map->seg, map->seg_size);
+
+    if (map->idx_fd >= 0)
+        close(map->idx_fd);
+
+    if (map->seg_fd >= 0)
+        close(map->seg_fd);
+}
+
+/*! \brief Helper function. Whether the audio of a slot is within the segment */
+static int __voise_tts_disk_slot_valid(struct voise_tts_disk_map *map, struct voise_tts_disk_slot *slot)
+{
+    uint64_t seg_len = map->header->seg_len;
+
+    return slot->offset <= seg_len && slot->len <= seg_len - slot->offset;
+}
+
+/*! \brief Helper function. Open (or create) and map the index and segment files */
+static struct voise_tts_disk_map* __voise_tts_disk_map_open(const char *idx_path, const char *seg_path, int reset)
+{
+    struct voise_tts_disk_map *map = ao2_alloc(sizeof(struct voise_tts_disk_map), __voise_tts_disk_map_destructor);
+
+    if (map == NULL)
+        return NULL;
+
+    map->idx_fd = map->seg_fd = -1;
+    map->idx_size = sizeof(struct voise_tts_disk_header) + voise_tts_disk_info.num_slots * sizeof(struct voise_tts_disk_slot);
+    map->seg_size = voise_tts_disk_info.max_bytes;
+
+    int flags = O_RDWR | O_CREAT | (reset ? O_TRUNC : 0);
+
+    map->idx_fd = open(idx_path, flags, 0644);
+    map->seg_fd = open(seg_path, flags, 0644);
+
+    /* The files are sparse: only written pages use disk */
+    if (map->idx_fd < 0 || map->seg_fd < 0
+        || ftruncate(map->idx_fd, map->idx_size) < 0 || ftruncate(map->seg_fd, map->seg_size) < 0)
+    {
+        ast_log(LOG_ERROR, "Could not open TTS disk cache %s: %s\n", idx_path, strerror(errno));
+        ao2_ref(map, -1);
+        return NULL;
+    }
+
+    map->header = mmap(NULL, map->idx_size, PROT_READ | PROT_WRITE, MAP_SHARED, map->idx_fd, 0);
+    map->seg = mmap(NULL, map->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, map->seg_fd, 0);
+
+    if (map->header == MAP_FAILED || map->seg == MAP_FAILED)
+    {
+        ast_log(LOG_ERROR, "Could not map TTS disk cache %s: %s\n", idx_path, strerror(errno));
+        ao2_ref(map, -1);
+        return NULL;
+    }
+
+    map->slots = (struct voise_tts_disk_slot *)(map->header + 1);
+
+    /* New file, other version or other size: start empty */
+    if (map->header->magic != VOISE_TTS_DISK_MAGIC || map->header->version != VOISE_TTS_DISK_VERSION
+        || map->header->num_slots != voise_tts_disk_info.num_slots || map->header->seg_len > map->seg_size)
+    {
+        memset(map->header, 0, map->idx_size);
+
+        map->header->magic = VOISE_TTS_DISK_MAGIC;
+        map->header->version = VOISE_TTS_DISK_VERSION;
+        map->header->num_slots = voise_tts_disk_info.num_slots;
+    }
+
+    /* The index may be torn by a crash: slots out of the segment are freed */
+    uint32_t i;
+    uint32_t used = 0;
+    uint32_t dropped = 0;
+
+    for (i = 0; i < map->header->num_slots; ++i)
+    {
+        struct voise_tts_disk_slot *slot = &map->slots[i];
+
+        if (slot->state != VOISE_TTS_DISK_SLOT_USED)
+            continue;
+
+        if (__voise_tts_disk_slot_valid(map, slot))
+        {
+            used++;
+            continue;
+        }
+
+        slot->state = VOISE_TTS_DISK_SLOT_DELETED;
+        dropped++;
+    }
+
+    map->header->used_slots = used;
+
+    if (dropped > 0)
+        ast_log(LOG_WARNING, "TTS disk cache %s: %u entries out of the segment dropped\n", idx_path, dropped);
+
+    return map;
+}
+
+static void __voise_tts_disk_digest(const char *key, unsigned char digest[16])
+{
+    struct MD5Context md5;
+
+    MD5Init(&md5);
+    MD5Update(&md5, (const unsigned char *)key, strlen(key));
+    MD5Final(digest, &md5);
+}
+
+/*! \brief Helper function. Find the slot of a digest, or the slot where it would be added */
+static struct voise_tts_disk_slot* __voise_tts_disk_probe(struct voise_tts_disk_map *map, const unsigned char digest[16], int for_add)
+{
+    uint64_t hash;
+    memcpy(&hash, digest, sizeof(hash));
+
+    uint32_t num_slots = map->header->num_slots;
+    uint32_t i = hash % num_slots;
+    uint32_t n;
+
+    struct voise_tts_disk_slot *free_slot = NULL;
+
+    for (n = 0; n < num_slots; ++n, i = (i + 1) % num_slots)
+    {
+        struct voise_tts_disk_slot *slot = &map->slots[i];
+
+        if (slot->state == VOISE_TTS_DISK_SLOT_EMPTY)
+            return for_add ? (free_slot ? free_slot : slot) : NULL;
+
+        if (slot->state == VOISE_TTS_DISK_SLOT_DELETED)
+        {
+            if (free_slot == NULL)
+                free_slot = slot;
+            continue;
+        }
+
+        if (!memcmp(slot->digest, digest, 16))
+            return slot;
+    }
+
+    return for_add ? free_slot : NULL;
+}
+
+/*! \brief Helper function. Find a prompt in the disk cache */
+static int __voise_tts_disk_find(const char *key, struct voise_tts_audio *audio, int count)
+{
+    if (!voise_tts_disk_info.enabled)
+        return -1;
+
+    unsigned char digest[16];
+    __voise_tts_disk_digest(key, digest);
+
+    int found = 0;
+
+    ast_rwlock_rdlock(&voise_tts_disk_lock);
+
+    if (voise_tts_disk != NULL)
+    {
+        struct voise_tts_disk_slot *slot = __voise_tts_disk_probe(voise_tts_disk, digest, 0);
+
+        /* Never read past the mapping, whatever the index says */
+        if (slot != NULL && __voise_tts_disk_slot_valid(voise_tts_disk, slot))
+        {
+            /* Lookups hold the lock for reading only and race on it: any of
+             * the values is good, but the store must not tear */
+            __atomic_store_n(&slot->last_used, (uint64_t)time(NULL), __ATOMIC_RELAXED);
+
+            audio->data = voise_tts_disk->seg + slot->offset;
+            audio->len = slot->len;
+            audio->owner = voise_tts_disk;
+
+            ao2_ref(voise_tts_disk, +1);
+
+            found = 1;
+        }
+    }
+
+    ast_rwlock_unlock(&voise_tts_disk_lock);
+
+    if (count)
+        ast_atomic_fetchadd_int(found ? &voise_tts_disk_info.hits : &voise_tts_disk_info.misses, 1);
+
+    return found ? 0 : -1;
+}
+
+/*! \brief Helper function. Evict the least recently used entry. Disk lock must be held for writing */
+static int __voise_tts_disk_evict_one(struct voise_tts_disk_map *map)
+{
+    struct voise_tts_disk_slot *lru = NULL;
+    uint32_t i;
+
+    for (i = 0; i < map->header->num_slots; ++i)
+    {
+        struct voise_tts_disk_slot *slot = &map->slots[i];
+
+        if (slot->state == VOISE_TTS_DISK_SLOT_USED && (lru == NULL || slot->last_used < lru->last_used))
+            lru = slot;
+    }
+
+    if (lru == NULL)
+        return -1;
+
+    lru->state = VOISE_TTS_DISK_SLOT_DELETED;
+
+    map->header->used_slots--;
+    map->header->dead_bytes += lru->len;
+
+    voise_tts_disk_info.evictions++;
+
+    return 0;
+}
+
+/*! \brief Helper function. Wake up the compaction thread */
+static void __voise_tts_disk_request_compaction(void)
+{
+    ast_mutex_lock(&voise_tts_compact_lock);
+    voise_tts_compact_pending = 1;
+    ast_cond_signal(&voise_tts_compact_cond);
+    ast_mutex_unlock(&voise_tts_compact_lock);
+}
+
+/*! \brief Helper function. Append audio to the segment and point a free slot to it.
+ * The disk lock must be held for writing, unless lookups do not see the map yet */
+static int __voise_tts_disk_put(struct voise_tts_disk_map *map, const unsigned char digest[16],
+    const unsigned char *audio, size_t len, uint64_t last_used)
+{
+    struct voise_tts_disk_header *header = map->header;
+    struct voise_tts_disk_slot *slot = __voise_tts_disk_probe(map, digest, 1);
+
+    if (slot == NULL || slot->state == VOISE_TTS_DISK_SLOT_USED || header->seg_len + len > map->seg_size)
+        return -1;
+
+    /* Audio first, then the slot that points to it */
+    memcpy(map->seg + header->seg_len, audio, len);
+
+    memcpy(slot->digest, digest, 16);
+    slot->offset = header->seg_len;
+    slot->len = len;
+    slot->last_used = last_used;
+    slot->state = VOISE_TTS_DISK_SLOT_USED;
+
+    header->seg_len += len;
+    header->used_slots++;
+
+    return 0;
+}
+
+/*! \brief Helper function. Keep a prompt that does not fit in the segment until
+ * compaction makes room. Disk lock must be held for writing */
+static void __voise_tts_disk_defer(const unsigned char digest[16], const unsigned char *audio, size_t len)
+{
+    struct voise_tts_disk_pending *pending;
+
+    /* Past the limit, prompts are synthesized again on next use */
+    if ((voise_tts_disk_pending_bytes + len) * 100 > voise_tts_disk_info.max_bytes * VOISE_TTS_DISK_PENDING_PCT)
+        return;
+
+    AST_LIST_TRAVERSE(&voise_tts_disk_pending_list, pending, list)
+    {
+        if (!memcmp(pending->digest, digest, 16))
+            return;
+    }
+
+    if ( !(pending = ast_malloc(sizeof(*pending) + len)) )
+        return;
+
+    memcpy(pending->digest, digest, 16);
+    memcpy(pending->audio, audio, len);
+    pending->len = len;
+
+    AST_LIST_INSERT_TAIL(&voise_tts_disk_pending_list, pending, list);
+    voise_tts_disk_pending_bytes += len;
+}
+
+/*! \brief Helper function. Free the prompts waiting for compaction. Disk lock must be held for writing */
+static void __voise_tts_disk_free_pending(void)
+{
+    struct voise_tts_disk_pending *pending;
+
+    while ((pending = AST_LIST_REMOVE_HEAD(&voise_tts_disk_pending_list, list)))
+        ast_free(pending);
+
+    voise_tts_disk_pending_bytes = 0;
+}
+
+/*! \brief Helper function. Append a synthesized prompt to the disk cache */
+static void __voise_tts_disk_add(const char *key, const unsigned char *audio, size_t len)
+{
+    if (!voise_tts_disk_info.enabled || len == 0 || len > voise_tts_disk_info.max_bytes / 2)
+        return;
+
+    unsigned char digest[16];
+    __voise_tts_disk_digest(key, digest);
+
+    int compact = 0;
+
+    ast_rwlock_wrlock(&voise_tts_disk_lock);
+
+    struct voise_tts_disk_map *map = voise_tts_disk;
+
+    if (map != NULL)
+    {
+        struct voise_tts_disk_header *header = map->header;
+
+        while (header->used_slots * 100 >= header->num_slots * VOISE_TTS_DISK_MAX_LOAD_PCT)
+        {
+            if (__voise_tts_disk_evict_one(map) < 0)
+                break;
+        }
+
+        /* The segment is append-only: space of evicted entries comes back on compaction */
+        while (header->seg_len + len > map->seg_size && header->dead_bytes < header->seg_len / 2)
+        {
+            if (__voise_tts_disk_evict_one(map) < 0)
+                break;
+        }
+
+        /* A full segment does not refuse the prompt: compaction adds it */
+        if (__voise_tts_disk_probe(map, digest, 0) == NULL
+            && __voise_tts_disk_put(map, digest, audio, len, time(NULL)) < 0)
+        {
+            __voise_tts_disk_defer(digest, audio, len);
+        }
+
+        compact = (header->dead_bytes * 100 >= map->seg_size * VOISE_TTS_DISK_COMPACT_DEAD_PCT)
+            || !AST_LIST_EMPTY(&voise_tts_disk_pending_list);
+    }
+
+    ast_rwlock_unlock(&voise_tts_disk_lock);
+
+    if (compact)
+        __voise_tts_disk_request_compaction();
+}
+
+/*! \brief Helper function. Copy the live entries to new files and switch to them */
+static void __voise_tts_disk_compact(void)
+{
+    char idx_path[PATH_MAX];
+    char seg_path[PATH_MAX];
+    char new_idx_path[PATH_MAX];
+    char new_seg_path[PATH_MAX];
+    uint32_t i;
+
+    snprintf(idx_path, sizeof(idx_path), "%s/tts.idx", voise_tts_disk_info.dir);
+    snprintf(seg_path, sizeof(seg_path), "%s/tts.seg", voise_tts_disk_info.dir);
+    snprintf(new_idx_path, sizeof(new_idx_path), "%s/tts.idx.new", voise_tts_disk_info.dir);
+    snprintf(new_seg_path, sizeof(new_seg_path), "%s/tts.seg.new", voise_tts_disk_info.dir);
+
+    struct voise_tts_disk_map *new_map = __voise_tts_disk_map_open(new_idx_path, new_seg_path, 1);
+
+    if (new_map == NULL)
+        return;
+
+    /* Only the live slots are taken under the lock. The segment is append-only,
+     * so their audio stays in place while it is copied without the lock */
+    ast_rwlock_rdlock(&voise_tts_disk_lock);
+
+    struct voise_tts_disk_map *map = ao2_bump(voise_tts_disk);
+    struct voise_tts_disk_slot *live = NULL;
+    uint32_t num_live = 0;
+    uint64_t copied_len = 0;
+
+    if (map != NULL && (live = ast_malloc(MAX(1, map->header->used_slots) * sizeof(*live))))
+    {
+        copied_len = map->header->seg_len;
+
+        for (i = 0; i < map->header->num_slots && num_live < map->header->used_slots; ++i)
+        {
+            struct voise_tts_disk_slot *slot = &map->slots[i];
+
+            if (slot->state != VOISE_TTS_DISK_SLOT_USED || !__voise_tts_disk_slot_valid(map, slot))
+                continue;
+
+            live[num_live] = *slot;
+            live[num_live].last_used = __atomic_load_n(&slot->last_used, __ATOMIC_RELAXED);
+            num_live++;
+        }
+    }
+
+    ast_rwlock_unlock(&voise_tts_disk_lock);
+
+    if (live == NULL)
+    {
+        ao2_cleanup(map);
+        ao2_ref(new_map, -1);
+        return;
+    }
+
+    for (i = 0; i < num_live; ++i)
+        __voise_tts_disk_put(new_map, live[i].digest, map->seg + live[i].offset, live[i].len, live[i].last_used);
+
+    ast_rwlock_wrlock(&voise_tts_disk_lock);
+
+    if (voise_tts_disk != map || rename(new_seg_path, seg_path) < 0 || rename(new_idx_path, idx_path) < 0)
+    {
+        if (voise_tts_disk == map)
+            ast_log(LOG_ERROR, "Could not replace TTS disk cache: %s\n", strerror(errno));
+
+        ast_rwlock_unlock(&voise_tts_disk_lock);
+        ast_free(live);
+        ao2_ref(map, -1);
+        ao2_ref(new_map, -1);
+        return;
+    }
+
+    /* Merge what changed during the copy. Entries evicted (or evicted and added
+     * again) meanwhile go, the others keep their last lookup */
+    for (i = 0; i < num_live; ++i)
+    {
+        struct voise_tts_disk_slot *slot = __voise_tts_disk_probe(map, live[i].digest, 0);
+        struct voise_tts_disk_slot *new_slot = __voise_tts_disk_probe(new_map, live[i].digest, 0);
+
+        if (new_slot == NULL)
+            continue;
+
+        if (slot == NULL || slot->offset != live[i].offset)
+        {
+            new_slot->state = VOISE_TTS_DISK_SLOT_DELETED;
+            new_map->header->used_slots--;
+            new_map->header->dead_bytes += new_slot->len;
+        }
+        else
+        {
+            new_slot->last_used = slot->last_used;
+        }
+    }
+
+    /* Entries added during the copy, past the copied part of the segment */
+    for (i = 0; i < map->header->num_slots; ++i)
+    {
+        struct voise_tts_disk_slot *slot = &map->slots[i];
+
+        if (slot->state == VOISE_TTS_DISK_SLOT_USED && slot->offset >= copied_len && __voise_tts_disk_slot_valid(map, slot))
+            __voise_tts_disk_put(new_map, slot->digest, map->seg + slot->offset, slot->len, slot->last_used);
+    }
+
+    /* Prompts that did not fit in the old segment */
+    struct voise_tts_disk_pending *pending;
+
+    AST_LIST_TRAVERSE(&voise_tts_disk_pending_list, pending, list)
+        __voise_tts_disk_put(new_map, pending->digest, pending->audio, pending->len, time(NULL));
+
+    __voise_tts_disk_free_pending();
+
+    /* Playbacks still reading the old map keep it alive */
+    voise_tts_disk = new_map;
+
+    voise_tts_disk_info.compactions++;
+
+    ast_rwlock_unlock(&voise_tts_disk_lock);
+
+    ast_free(live);
+
+    /* Our reference, and the one of voise_tts_disk */
+    ao2_ref(map, -1);
+    ao2_ref(map, -1);
+
+    ast_log(LOG_NOTICE, "TTS disk cache compacted: %llu bytes in %u entries\n",
+        (unsigned long long)new_map->header->seg_len, new_map->header->used_slots);
+}
+
+static void* __voise_tts_compact_thread(void *data)
+{
+    ast_mutex_lock(&voise_tts_compact_lock);
+
+    while (!voise_tts_compact_stop)
+    {
+        if (!voise_tts_compact_pending)
+        {
+            ast_cond_wait(&voise_tts_compact_cond, &voise_tts_compact_lock);
+            continue;
+        }
+
+        voise_tts_compact_pending = 0;
+
+        ast_mutex_unlock(&voise_tts_compact_lock);
+
+        __voise_tts_disk_compact();
+
+        ast_mutex_lock(&voise_tts_compact_lock);
+    }
+
+    ast_mutex_unlock(&voise_tts_compact_lock);
+
+    return NULL;
+}
+
+/*! \brief Helper function. Open the disk cache and start the compaction thread */
+static void __voise_tts_disk_start(void)
+{
+    char idx_path[PATH_MAX];
+    char seg_path[PATH_MAX];
+
+    if (!voise_tts_disk_info.enabled)
+        return;
+
+    if (ast_mkdir(voise_tts_disk_info.dir, 0755) < 0)
+    {
+        ast_log(LOG_ERROR, "Could not create %s: %s\n", voise_tts_disk_info.dir, strerror(errno));
+        voise_tts_disk_info.enabled = 0;
+        return;
+    }
+
+    snprintf(idx_path, sizeof(idx_path), "%s/tts.idx", voise_tts_disk_info.dir);
+    snprintf(seg_path, sizeof(seg_path), "%s/tts.seg", voise_tts_disk_info.dir);
+
+    voise_tts_disk = __voise_tts_disk_map_open(idx_path, seg_path, 0);
+
+    if (voise_tts_disk == NULL)
+    {
+        voise_tts_disk_info.enabled = 0;
+        return;
+    }
+
+    ast_mutex_init(&voise_tts_compact_lock);
+    ast_cond_init(&voise_tts_compact_cond, NULL);
+
+    voise_tts_compact_stop = 0;
+    voise_tts_compact_pending = 0;
+
+    if (ast_pthread_create_background(&voise_tts_compact_thread, NULL, __voise_tts_compact_thread, NULL))
+    {
+        ast_log(LOG_WARNING, "Could not start TTS disk cache compaction\n");
+        voise_tts_compact_thread = AST_PTHREADT_NULL;
+    }
+}
+
+static void __voise_tts_disk_stop(void)
+{
+    if (voise_tts_compact_thread != AST_PTHREADT_NULL)
+    {
+        ast_mutex_lock(&voise_tts_compact_lock);
+        voise_tts_compact_stop = 1;
+        ast_cond_signal(&voise_tts_compact_cond);
+        ast_mutex_unlock(&voise_tts_compact_lock);
+
+        pthread_join(voise_tts_compact_thread, NULL);
+        voise_tts_compact_thread = AST_PTHREADT_NULL;
+
+        ast_mutex_destroy(&voise_tts_compact_lock);
+        ast_cond_destroy(&voise_tts_compact_cond);
+    }
+
+    ast_rwlock_wrlock(&voise_tts_disk_lock);
+
+    ao2_cleanup(voise_tts_disk);
+    voise_tts_disk = NULL;
+
+    __voise_tts_disk_free_pending();
+
+    ast_rwlock_unlock(&voise_tts_disk_lock);
+}
+
+static char* handle_cli_voise_show_tts_disk(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show tts disk";
+        e->usage =
+            "Usage: voise show tts disk\n"
+            "       Show fill level and counters of the TTS disk cache.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_cli(a->fd, "Enabled:     %s\n", voise_tts_disk_info.enabled ? "yes" : "no");
+
+    ast_rwlock_rdlock(&voise_tts_disk_lock);
+
+    if (voise_tts_disk != NULL)
+    {
+        struct voise_tts_disk_header *header = voise_tts_disk->header;
+
+        ast_cli(a->fd, "Directory:   %s\n", voise_tts_disk_info.dir);
+        ast_cli(a->fd, "Entries:     %u / %u slots (%.1f%%)\n", header->used_slots, header->num_slots,
+            100.0 * header->used_slots / header->num_slots);
+        ast_cli(a->fd, "Segment:     %llu / %zu bytes (%.1f%%)\n", (unsigned long long)header->seg_len,
+            voise_tts_disk->seg_size, 100.0 * header->seg_len / voise_tts_disk->seg_size);
+        ast_cli(a->fd, "Evicted:     %llu bytes\n", (unsigned long long)header->dead_bytes);
+    }
+
+    ast_rwlock_unlock(&voise_tts_disk_lock);
+
+    int lookups = voise_tts_disk_info.hits + voise_tts_disk_info.misses;
+
+    ast_cli(a->fd, "Hits:        %d\n", voise_tts_disk_info.hits);
+    ast_cli(a->fd, "Misses:      %d\n", voise_tts_disk_info.misses);
+    ast_cli(a->fd, "Hit ratio:   %.1f%%\n", lookups ? 100.0 * voise_tts_disk_info.hits / lookups : 0.0);
+    ast_cli(a->fd, "Evictions:   %d\n", voise_tts_disk_info.evictions);
+    ast_cli(a->fd, "Compactions: %d\n", voise_tts_disk_info.compactions);
+
+    return CLI_SUCCESS;
+}
+
+/*! \brief Helper function. Find a prompt in memory, then on disk */
+static int __voise_tts_lookup(const char *key, struct voise_tts_audio *audio, int count)
+{
+    struct voise_tts_entry *entry = __voise_tts_cache_find(key, count);
+
+    if (entry != NULL)
+    {
+        audio->data = entry->audio;
+        audio->len = entry->len;
+        audio->owner = entry;
+
+        return 0;
+    }
+
+    return __voise_tts_disk_find(key, audio, count);
+}
+
+/*! \brief Helper function. Keep a synthesized prompt in both cache tiers. Takes ownership of audio */
+static void __voise_tts_store(const char *key, unsigned char *audio, size_t len)
+{
+    __voise_tts_disk_add(key, audio, len);
+    __voise_tts_cache_add(key, audio, len);
+}
+
+/*! \brief Helper function. Append audio to a growing buffer */
+static int __voise_buffer_append(unsigned char **buffer, size_t *len, size_t *size, const unsigned char *data, size_t data_len)
+{
+    if (*len + data_len > *size)
+    {
+        size_t new_size = *size ? *size : 8192;
+
+        while (new_size < *len + data_len)
+            new_size *= 2;
+
+        unsigned char *new_buffer = ast_realloc(*buffer, new_size);
+
+        if (new_buffer == NULL)
+            return -1;
+
+        *buffer = new_buffer;
+        *size = new_size;
+    }
+
+    memcpy(*buffer + *len, data, data_len);
+    *len += data_len;
+
+    return 0;
+}
+
+/*! \brief Helper function. Take an idle connection to the server from the pool, or open one.
+ * \param pooled set when the connection came from the pool (and may have gone stale) */
+static struct voise_tts_conn* __voise_tts_conn_get(const char *serverip, int *pooled)
+{
+    struct voise_tts_conn *conn;
+
+    AST_LIST_LOCK(&voise_tts_pool);
+    AST_LIST_TRAVERSE_SAFE_BEGIN(&voise_tts_pool, conn, list)
+    {
+        if (!strcmp(conn->serverip, serverip))
+        {
+            AST_LIST_REMOVE_CURRENT(list);
+            voise_tts_pool_count--;
+            __voise_stats_add(conn->stats, VOISE_STAT_CONNS_POOLED, -1);
+            break;
+        }
+    }
+    AST_LIST_TRAVERSE_SAFE_END;
+    AST_LIST_UNLOCK(&voise_tts_pool);
+
+    *pooled = (conn != NULL);
+
+    if (conn != NULL)
+        return conn;
+
+    if ( !(conn = ast_calloc(1, sizeof(*conn))) )
+        return NULL;
+
+    struct timeval start = ast_tvnow();
+
+    if (voise_init(&conn->client, serverip, 8102, 1, __voise_capture_error_cb) < 0)
+    {
+        ast_log(LOG_ERROR, "Could not connect to Voise server (%s).\n", serverip);
+        ast_free(conn);
+        return NULL;
+    }
+
+    __voise_hist_since(VOISE_HIST_CONNECT, start);
+
+    ast_copy_string(conn->serverip, serverip, sizeof(conn->serverip));
+
+    conn->stats = __voise_stats_server(serverip);
+    __voise_stats_add(conn->stats, VOISE_STAT_CONNS_OPEN, 1);
+
+    return conn;
+}
+
+/*! \brief Helper function. Give a connection back to the pool. A connection
+ * left in the middle of a synthesis is not reusable and is closed */
+static void __voise_tts_conn_put(struct voise_tts_conn *conn, int reusable)
+{
+    if (conn == NULL)
+        return;
+
+    if (reusable)
+    {
+        AST_LIST_LOCK(&voise_tts_pool);
+
+        if (voise_tts_pool_count < voise_tts_pool_max)
+        {
+            AST_LIST_INSERT_HEAD(&voise_tts_pool, conn, list);
+            voise_tts_pool_count++;
+            __voise_stats_add(conn->stats, VOISE_STAT_CONNS_POOLED, 1);
+            conn = NULL;
+        }
+
+        AST_LIST_UNLOCK(&voise_tts_pool);
+
+        if (conn == NULL)
+            return;
+    }
+
+    voise_close(&conn->client);
+    __voise_stats_add(conn->stats, VOISE_STAT_CONNS_OPEN, -1);
+    ast_free(conn);
+}
+
+/*! \brief Helper function. Close the idle connections */
+static void __voise_tts_pool_drain(void)
+{
+    struct voise_tts_conn *conn;
+
+    AST_LIST_LOCK(&voise_tts_pool);
+
+    while ((conn = AST_LIST_REMOVE_HEAD(&voise_tts_pool, list)))
+    {
+        voise_close(&conn->client);
+        __voise_stats_add(conn->stats, VOISE_STAT_CONNS_OPEN, -1);
+        __voise_stats_add(conn->stats, VOISE_STAT_CONNS_POOLED, -1);
+        ast_free(conn);
+    }
+
+    voise_tts_pool_count = 0;
+
+    AST_LIST_UNLOCK(&voise_tts_pool);
+}
+
+/*! \brief Helper function. Bytes of a server read: read_ms of audio, in whole
+ * packetization units and within VOISE_MAX_FRAME_LEN. A shorter read ends the
+ * synthesis
+ * \param read_ms set to the ms asked of the server, if not NULL */
+static size_t __voise_tts_read_len(struct ast_format *format, int *read_ms)
+{
+    int min_ms = ast_format_get_minimum_ms(format);
+    int min_bytes = ast_format_get_minimum_bytes(format);
+    int ms = MAX(voise_tts_read_ms, (int)ast_format_get_default_ms(format)) / min_ms * min_ms;
+
+    while (ms > min_ms && (size_t)(ms / min_ms * min_bytes) > VOISE_MAX_FRAME_LEN)
+        ms -= min_ms;
+
+    if (read_ms != NULL)
+        *read_ms = ms;
+
+    return (size_t)(ms / min_ms * min_bytes);
+}
+
+/*! \brief Helper function. Read audio of the synthesis started on a connection */
+static int __voise_tts_read_synth(struct voise_tts_conn *conn, unsigned char *audio_data, size_t *audio_len)
+{
+    struct timeval start = ast_tvnow();
+
+    int ret = voise_read_synth(&conn->client, audio_data, audio_len);
+
+    __voise_hist_since(VOISE_HIST_CHUNK_READ, start);
+
+    if (ret < 0)
+        return ret;
+
+    __voise_stats_add(conn->stats, VOISE_STAT_BYTES_RECEIVED, *audio_len);
+
+    if (!ast_tvzero(conn->synth_start))
+    {
+        __voise_hist_since(VOISE_HIST_FIRST_BYTE, conn->synth_start);
+        conn->synth_start = ast_tv(0, 0);
+    }
+
+    return ret;
+}
+
+/*! \brief Helper function. Start a synthesis on a pooled connection. A stale
+ * pooled connection is replaced by a new one */
+static struct voise_tts_conn* __voise_tts_start_synth(const char *serverip, const char *text, const char *lang,
+    struct ast_format *format)
+{
+    int attempt;
+    int read_ms;
+
+    /* The server sends bigger chunks than a frame: fewer reads per prompt */
+    __voise_tts_read_len(format, &read_ms);
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        int pooled;
+        struct voise_tts_conn *conn = __voise_tts_conn_get(serverip, &pooled);
+
+        if (conn == NULL)
+            return NULL;
+
+        conn->synth_start = ast_tvnow();
+
+        voise_response_t response;
+        int ret = voise_start_synth(&conn->client, &response, text, ast_format_get_name(format),
+            ast_format_get_sample_rate(format), lang, read_ms);
+
+        // 201 = Accepted
+        if (ret >= 0 && response.result_code == 201)
+        {
+            __voise_hist_since(VOISE_HIST_SYNTH_START, conn->synth_start);
+            __voise_stats_add(conn->stats, VOISE_STAT_SYNTHS, 1);
+            __voise_stats_add(conn->stats, VOISE_STAT_BYTES_SENT, strlen(text));
+
+            return conn;
+        }
+
+        __voise_tts_conn_put(conn, 0);
+
+        if (!pooled || attempt > 0)
+        {
+            ast_log(LOG_ERROR, "Synthesis not started: %s\n", ret < 0 ? "connection error" : response.result_message);
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static void __voise_tts_inflight_destructor(void *obj)
+{
+    struct voise_tts_inflight *inflight = obj;
+
+    ast_free(inflight->key);
+    ast_free(inflight->audio);
+
+    ast_mutex_destroy(&inflight->lock);
+    ast_cond_destroy(&inflight->cond);
+}
+
+/*! \brief Synthesis reader: reads a synthesis in flight for its subscribers,
+ * and gives up as soon as they are all gone */
+static void* __voise_tts_inflight_thread(void *data)
+{
+    TRACE_FUNCTION();
+
+    struct voise_tts_inflight *inflight = data;
+    size_t read_len = __voise_tts_read_len(inflight->format, NULL);
+    unsigned char audio_data[VOISE_MAX_FRAME_LEN];
+    int done = 0;
+
+    while (!done)
+    {
+        size_t audio_len = 0;
+        int ret = __voise_tts_read_synth(inflight->conn, audio_data, &audio_len);
+
+        if (ret < 0)
+            ast_log(LOG_ERROR, "Read synth error: %d\n", ret);
+
+        ast_mutex_lock(&inflight->lock);
+
+        if (ret >= 0 && audio_len > 0 &&
+            __voise_buffer_append(&inflight->audio, &inflight->len, &inflight->size, audio_data, audio_len) < 0)
+        {
+            ast_log(LOG_ERROR, "Could not keep synthesized audio\n");
+            ret = -1;
+        }
+
+        /* The synthesis ends with a short read */
+        if (ret >= 0 && audio_len < read_len)
+            inflight->complete = 1;
+
+        inflight->done = done = (ret < 0 || inflight->complete || inflight->subscribers == 0);
+
+        ast_cond_broadcast(&inflight->cond);
+        ast_mutex_unlock(&inflight->lock);
+    }
+
+    /* Only this thread writes the audio */
+    __voise_tts_conn_put(inflight->conn, inflight->complete);
+    inflight->conn = NULL;
+
+    /* Cached before it leaves the list, so the next playback finds it in either */
+    if (inflight->complete && inflight->key != NULL && inflight->len > 0)
+    {
+        unsigned char *audio = ast_malloc(inflight->len);
+
+        if (audio != NULL)
+        {
+            memcpy(audio, inflight->audio, inflight->len);
+            __voise_tts_store(inflight->key, audio, inflight->len);
+        }
+    }
+
+    AST_LIST_LOCK(&voise_tts_inflight_list);
+    AST_LIST_REMOVE(&voise_tts_inflight_list, inflight, list);
+    AST_LIST_UNLOCK(&voise_tts_inflight_list);
+
+    ao2_ref(inflight, -1);
+    ast_module_unref(ast_module_info->self);
+
+    return NULL;
+}
+
+/*! \brief Helper function. Subscribe to the synthesis of a text: join the one in
+ * flight with the same key, or start it. A NULL key is never shared.
+ * \return a reference, to give back with __voise_tts_inflight_leave(), or NULL */
+static struct voise_tts_inflight* __voise_tts_inflight_join(const char *serverip, const char *key, const char *text,
+    const char *lang, struct ast_format *format)
+{
+    struct voise_tts_inflight *inflight = NULL;
+
+    AST_LIST_LOCK(&voise_tts_inflight_list);
+
+    if (key != NULL)
+    {
+        AST_LIST_TRAVERSE(&voise_tts_inflight_list, inflight, list)
+        {
+            if (inflight->key == NULL || strcmp(inflight->key, key))
+                continue;
+
+            ast_mutex_lock(&inflight->lock);
+
+            /* A failed synthesis is not joined */
+            int joined = !(inflight->done && !inflight->complete);
+
+            if (joined)
+                inflight->subscribers++;
+
+            ast_mutex_unlock(&inflight->lock);
+
+            if (joined)
+                break;
+        }
+    }
+
+    if (inflight != NULL)
+    {
+        ao2_ref(inflight, +1);
+        AST_LIST_UNLOCK(&voise_tts_inflight_list);
+
+        ast_mutex_lock(&voise_tts_cache_lock);
+        voise_tts_cache_info.coalesced++;
+        ast_mutex_unlock(&voise_tts_cache_lock);
+
+        return inflight;
+    }
+
+    /* Listed while it starts, so the next playbacks of the text join it */
+    if ( !(inflight = ao2_alloc(sizeof(*inflight), __voise_tts_inflight_destructor)) )
+    {
+        AST_LIST_UNLOCK(&voise_tts_inflight_list);
+        return NULL;
+    }
+
+    inflight->key = key ? ast_strdup(key) : NULL;
+    inflight->format = format;
+    inflight->subscribers = 1;
+
+    ast_mutex_init(&inflight->lock);
+    ast_cond_init(&inflight->cond, NULL);
+
+    AST_LIST_INSERT_TAIL(&voise_tts_inflight_list, inflight, list);
+    AST_LIST_UNLOCK(&voise_tts_inflight_list);
+
+    inflight->conn = __voise_tts_start_synth(serverip, text, lang, format);
+
+    if (inflight->conn != NULL)
+    {
+        pthread_t thread;
+
+        /* Released by the reader */
+        ao2_ref(inflight, +1);
+        ast_module_ref(ast_module_info->self);
+
+        if (ast_pthread_create_detached_background(&thread, NULL, __voise_tts_inflight_thread, inflight))
+        {
+            ast_log(LOG_ERROR, "Failed to start the synthesis reader\n");
+
+            ao2_ref(inflight, -1);
+            ast_module_unref(ast_module_info->self);
+
+            __voise_tts_conn_put(inflight->conn, 0);
+            inflight->conn = NULL;
+        }
+    }
+
+    if (inflight->conn == NULL)
+    {
+        /* Fails the playbacks that joined meanwhile too */
+        ast_mutex_lock(&inflight->lock);
+        inflight->done = 1;
+        ast_cond_broadcast(&inflight->cond);
+        ast_mutex_unlock(&inflight->lock);
+
+        AST_LIST_LOCK(&voise_tts_inflight_list);
+        AST_LIST_REMOVE(&voise_tts_inflight_list, inflight, list);
+        AST_LIST_UNLOCK(&voise_tts_inflight_list);
+
+        ao2_ref(inflight, -1);
+        return NULL;
+    }
+
+    return inflight;
+}
+
+/*! \brief Helper function. Unsubscribe from a synthesis in flight. It is
+ * abandoned when the last subscriber leaves */
+static void __voise_tts_inflight_leave(struct voise_tts_inflight *inflight)
+{
+    if (inflight == NULL)
+        return;
+
+    ast_mutex_lock(&inflight->lock);
+    inflight->subscribers--;
+    ast_mutex_unlock(&inflight->lock);
+
+    ao2_ref(inflight, -1);
+}
+
+/*! \brief Helper function. Wait for the syntheses in flight to end */
+static void __voise_tts_inflight_wait(void)
+{
+    for (;;)
+    {
+        AST_LIST_LOCK(&voise_tts_inflight_list);
+        int empty = AST_LIST_EMPTY(&voise_tts_inflight_list);
+        AST_LIST_UNLOCK(&voise_tts_inflight_list);
+
+        if (empty)
+            break;
+
+        usleep(10000);
+    }
+}
+
+/*! \brief Helper function. Synthesize a whole prompt into memory */
+static int __voise_synth_to_buffer(const char *serverip, const char *text, const char *lang, struct ast_format *format,
+    unsigned char **audio, size_t *len)
+{
+    TRACE_FUNCTION();
+
+    size_t read_len = __voise_tts_read_len(format, NULL);
+
+    struct voise_tts_conn *conn = __voise_tts_start_synth(serverip, text, lang, format);
+
+    if (conn == NULL)
+        return -1;
+
+    unsigned char audio_data[VOISE_MAX_FRAME_LEN];
+    size_t size = 0;
+    int ret;
+
+    *audio = NULL;
+    *len = 0;
+
+    /* The synthesis ends with a short read */
+    size_t audio_len;
+    do
+    {
+        audio_len = 0;
+        ret = __voise_tts_read_synth(conn, audio_data, &audio_len);
+
+        if (ret >= 0 && audio_len > 0)
+            ret = __voise_buffer_append(audio, len, &size, audio_data, audio_len);
+    } while (ret >= 0 && audio_len >= read_len);
+
+    __voise_tts_conn_put(conn, ret >= 0);
+
+    if (ret < 0)
+    {
+        ast_free(*audio);
+        *audio = NULL;
+        *len = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ********************************* */
+/* ********* TTS transcoding ******* */
+/* ********************************* */
+
+/* Input samples spanned by the resampling filter, per output phase */
+#define VOISE_RESAMPLER_TAPS 64
+
+/* Streaming conversion of the master audio (signed linear at the master rate)
+ * to another format and rate. The rate is changed by a polyphase FIR: up/down
+ * is the ratio of the rates, and only the phase of each output sample is
+ * computed */
+struct voise_tts_transcoder
+{
+    struct ast_format *format;
+
+    int up;
+    int down;
+
+    /* Phase-major: coefs[p * VOISE_RESAMPLER_TAPS + k] */
+    float *coefs;
+
+    /* Last input samples (VOISE_RESAMPLER_TAPS - 1), then the input being converted */
+    short *work;
+    size_t work_size;
+
+    /* Upsampled position of the next output, from the first sample of the input */
+    int64_t next;
+    uint64_t samples_in;
+    uint64_t samples_out;
+
+    /* Output */
+    short *out;
+    unsigned char *encoded;
+    size_t out_size;
+
+    /* A master sample split between two chunks */
+    unsigned char odd_byte;
+    int has_odd_byte;
+};
+
+static int __voise_gcd(int a, int b)
+{
+    while (b != 0)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/*! \brief Helper function. Format the audio of format is derived from, or format
+ * itself when it is synthesized as it is. Rates above the master's are not
+ * derived, not to lose their bandwidth */
+static struct ast_format* __voise_tts_master_format(struct ast_format *format)
+{
+    if (!voise_tts_cache_info.master || format == ast_format_slin16)
+        return format;
+
+    if (format == ast_format_ulaw || format == ast_format_alaw ||
+        (ast_format_cache_is_slinear(format) && ast_format_get_sample_rate(format) <= 16000))
+        return ast_format_slin16;
+
+    return format;
+}
+
+static void __voise_tts_transcoder_free(struct voise_tts_transcoder *transcoder)
+{
+    if (transcoder == NULL)
+        return;
+
+    ast_free(transcoder->coefs);
+    ast_free(transcoder->work);
+    ast_free(transcoder->out);
+    ast_free(transcoder->encoded);
+    ast_free(transcoder);
+}
+
+/*! \brief Helper function. Create a transcoder from the master format to format */
+static struct voise_tts_transcoder* __voise_tts_transcoder_alloc(struct ast_format *format)
+{
+    struct voise_tts_transcoder *transcoder = ast_calloc(1, sizeof(*transcoder));
+
+    if (transcoder == NULL)
+        return NULL;
+
+    int in_rate = ast_format_get_sample_rate(ast_format_slin16);
+    int out_rate = ast_format_get_sample_rate(format);
+    int gcd = __voise_gcd(in_rate, out_rate);
+
+    transcoder->format = format;
+    transcoder->up = out_rate / gcd;
+    transcoder->down = in_rate / gcd;
+
+    if (transcoder->up == transcoder->down)
+        return transcoder;
+
+    /* Windowed sinc low-pass at the upsampled rate, cut below the lower Nyquist.
+     * Odd length (the last coefficient stays 0), so the delay is whole */
+    int num_coefs = VOISE_RESAMPLER_TAPS * transcoder->up;
+    int length = num_coefs - 1;
+    double cutoff = 0.45 / MAX(transcoder->up, transcoder->down);
+    int center = (length - 1) / 2;
+    int n;
+
+    transcoder->coefs = ast_calloc(num_coefs, sizeof(float));
+    transcoder->work_size = 4096;
+    transcoder->work = ast_calloc(transcoder->work_size, sizeof(short));
+
+    if (transcoder->coefs == NULL || transcoder->work == NULL)
+    {
+        __voise_tts_transcoder_free(transcoder);
+        return NULL;
+    }
+
+    for (n = 0; n < length; n++)
+    {
+        double x = 2.0 * cutoff * (n - center);
+        double sinc = (x == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        double window = 0.42 - 0.5 * cos(2.0 * M_PI * n / (length - 1)) + 0.08 * cos(4.0 * M_PI * n / (length - 1));
+        int phase = n % transcoder->up;
+        int tap = n / transcoder->up;
+
+        transcoder->coefs[phase * VOISE_RESAMPLER_TAPS + tap] = (float)(transcoder->up * 2.0 * cutoff * sinc * window);
+    }
+
+    /* Skip the delay of the filter, so the output lines up with the input */
+    transcoder->next = center;
+
+    return transcoder;
+}
+
+/*! \brief Helper function. Resample input samples
+ * \return number of samples out */
+static size_t __voise_tts_resample(struct voise_tts_transcoder *transcoder, const short *in, size_t n, short *out)
+{
+    const size_t history = VOISE_RESAMPLER_TAPS - 1;
+    size_t count = 0;
+
+    if (history + n > transcoder->work_size)
+    {
+        size_t work_size = (history + n) * 2;
+        short *work = ast_realloc(transcoder->work, work_size * sizeof(short));
+
+        if (work == NULL)
+            return 0;
+
+        transcoder->work = work;
+        transcoder->work_size = work_size;
+    }
+
+    memcpy(transcoder->work + history, in, n * sizeof(short));
+
+    for (;;)
+    {
+        int64_t i = transcoder->next / transcoder->up;
+
+        if (i >= (int64_t)n)
+            break;
+
+        const float *coefs = transcoder->coefs + (transcoder->next % transcoder->up) * VOISE_RESAMPLER_TAPS;
+        const short *x = transcoder->work + history + i;
+        float acc = 0;
+        int k;
+
+        for (k = 0; k < VOISE_RESAMPLER_TAPS; k++)
+            acc += coefs[k] * x[-k];
+
+        out[count++] = (short)MAX(-32768.0f, MIN(32767.0f, acc));
+        transcoder->next += transcoder->down;
+    }
+
+    transcoder->next -= (int64_t)n * transcoder->up;
+    memmove(transcoder->work, transcoder->work + n, history * sizeof(short));
+
+    return count;
+}
+
+/*! \brief Helper function. Encode linear samples. The format is tested once per
+ * block, so the loops are plain table lookups the compiler can unroll */
+static void __voise_encode_samples(struct ast_format *format, const short *in, size_t n, unsigned char *out)
+{
+    size_t i;
+
+    if (format == ast_format_ulaw)
+    {
+        for (i = 0; i < n; i++)
+            out[i] = AST_LIN2MU(in[i]);
+    }
+    else if (format == ast_format_alaw)
+    {
+        for (i = 0; i < n; i++)
+            out[i] = AST_LIN2A(in[i]);
+    }
+    else
+    {
+        memcpy(out, in, n * sizeof(short));
+    }
+}
+
+/*! \brief Helper function. Convert a chunk of master audio. The last chunk
+ * flushes the filter
+ * \param out set to the converted audio, valid until the next call
+ * \return bytes out, or -1 on error */
+static ssize_t __voise_tts_transcode_chunk(struct voise_tts_transcoder *transcoder, const unsigned char *data, size_t len,
+    int last, const unsigned char **out)
+{
+    size_t n = (len + transcoder->has_odd_byte) / sizeof(short);
+    size_t flush = (transcoder->coefs != NULL && last) ? VOISE_RESAMPLER_TAPS : 0;
+    size_t max_out = MAX((n + flush) * transcoder->up / transcoder->down + 2, n);
+
+    if (max_out > transcoder->out_size)
+    {
+        short *out_samples = ast_realloc(transcoder->out, max_out * 2 * sizeof(short));
+        if (out_samples == NULL)
+            return -1;
+        transcoder->out = out_samples;
+
+        unsigned char *encoded = ast_realloc(transcoder->encoded, max_out * 2 * sizeof(short));
+        if (encoded == NULL)
+            return -1;
+        transcoder->encoded = encoded;
+
+        transcoder->out_size = max_out * 2;
+    }
+
+    /* The input samples, aligned. The encoded buffer is free until the end */
+    short *in = (short *)transcoder->encoded;
+    size_t count = 0;
+
+    if (n > 0)
+    {
+        unsigned char *bytes = (unsigned char *)in;
+        size_t pos = 0;
+
+        if (transcoder->has_odd_byte)
+            bytes[pos++] = transcoder->odd_byte;
+
+        size_t consumed = n * sizeof(short) - pos;
+
+        memcpy(bytes + pos, data, consumed);
+
+        transcoder->has_odd_byte = (consumed < len);
+    }
+    else if (len > 0)
+    {
+        transcoder->has_odd_byte = 1;
+    }
+
+    if (transcoder->has_odd_byte && len > 0)
+        transcoder->odd_byte = data[len - 1];
+
+    if (transcoder->coefs == NULL)
+    {
+        memcpy(transcoder->out, in, n * sizeof(short));
+        count = n;
+    }
+    else
+    {
+        transcoder->samples_in += n;
+        count = __voise_tts_resample(transcoder, in, n, transcoder->out);
+
+        /* Push the tail out of the filter, up to the length of the input */
+        if (flush)
+        {
+            short zeros[VOISE_RESAMPLER_TAPS] = { 0 };
+            uint64_t expected = transcoder->samples_in * transcoder->up / transcoder->down;
+
+            count += __voise_tts_resample(transcoder, zeros, flush, transcoder->out + count);
+
+            if (transcoder->samples_out + count > expected)
+                count = (size_t)(expected - MIN(expected, transcoder->samples_out));
+        }
+
+        transcoder->samples_out += count;
+    }
+
+    __voise_encode_samples(transcoder->format, transcoder->out, count, transcoder->encoded);
+
+    *out = transcoder->encoded;
+
+    return (ssize_t)(count * voise_get_bytes_per_sample(transcoder->format));
+}
+
+/*! \brief Helper function. Convert a whole master prompt to format */
+static int __voise_tts_transcode(const unsigned char *master, size_t len, struct ast_format *format,
+    unsigned char **audio, size_t *audio_len)
+{
+    struct voise_tts_transcoder *transcoder = __voise_tts_transcoder_alloc(format);
+    const unsigned char *out;
+
+    if (transcoder == NULL)
+        return -1;
+
+    ssize_t out_len = __voise_tts_transcode_chunk(transcoder, master, len, 1, &out);
+
+    *audio = (out_len > 0) ? ast_malloc(out_len) : NULL;
+
+    if (*audio != NULL)
+    {
+        memcpy(*audio, out, out_len);
+        *audio_len = out_len;
+    }
+
+    __voise_tts_transcoder_free(transcoder);
+
+    return *audio ? 0 : -1;
+}
+
+/*! \brief Helper function. Look up a prompt in both cache tiers. When only its
+ * master is cached, the variant is derived from it and cached on the way */
+static int __voise_tts_lookup_prompt(const char *key, const char *text, const char *lang, struct ast_format *format,
+    struct voise_tts_audio *audio, int count)
+{
+    if (__voise_tts_lookup(key, audio, count) == 0)
+        return 0;
+
+    struct ast_format *master_format = __voise_tts_master_format(format);
+
+    if (master_format == format)
+        return -1;
+
+    char *master_key = __voise_tts_cache_key(text, lang, master_format);
+    struct voise_tts_audio master;
+    unsigned char *variant;
+    size_t len;
+    int ret = -1;
+
+    if (master_key != NULL && __voise_tts_lookup(master_key, &master, 0) == 0)
+    {
+        if (__voise_tts_transcode(master.data, master.len, format, &variant, &len) == 0)
+        {
+            __voise_tts_store(key, variant, len);
+
+            ast_mutex_lock(&voise_tts_cache_lock);
+            voise_tts_cache_info.derived++;
+            ast_mutex_unlock(&voise_tts_cache_lock);
+
+            ret = __voise_tts_lookup(key, audio, 0);
+        }
+
+        ao2_ref(master.owner, -1);
+    }
+
+    ast_free(master_key);
+
+    return ret;
+}
+
+/*! \brief Helper function. Synthesize a prompt into the cache, as its master
+ * when it has one
+ * \retval 1 synthesized
+ * \retval 0 cached already
+ * \retval -1 error */
+static int __voise_tts_cache_prompt(const char *serverip, const char *text, const char *lang, struct ast_format *format)
+{
+    struct ast_format *master_format = __voise_tts_master_format(format);
+    char *key = __voise_tts_cache_key(text, lang, format);
+    char *master_key = (master_format != format) ? __voise_tts_cache_key(text, lang, master_format) : NULL;
+    struct voise_tts_audio cached;
+    unsigned char *audio;
+    size_t len;
+    int result = -1;
+
+    if (key == NULL || (master_format != format && master_key == NULL))
+    {
+        /* Out of memory */
+    }
+    else if (__voise_tts_lookup_prompt(key, text, lang, format, &cached, 0) == 0)
+    {
+        ao2_ref(cached.owner, -1);
+        result = 0;
+    }
+    else if (__voise_synth_to_buffer(serverip, text, lang, master_format, &audio, &len) == 0)
+    {
+        __voise_tts_store(master_key ? master_key : key, audio, len);
+        result = 1;
+    }
+
+    ast_free(key);
+    ast_free(master_key);
+
+    return result;
+}
+
+/* ********************************* */
+/* ********** TTS jobs ************* */
+/* ********************************* */
+
+static void __voise_tts_job_free_items(struct voise_tts_job *job)
+{
+    int i;
+
+    for (i = 0; i < job->num_items; ++i)
+    {
+        ast_free(job->items[i].text);
+        ast_free(job->items[i].lang);
+        ast_free(job->items[i].path);
+        ao2_cleanup(job->items[i].format);
+    }
+
+    ast_free(job->items);
+    job->items = NULL;
+    job->num_items = 0;
+}
+
+/*! \brief Helper function. Read the list file of a job. Lines are
+ * [name|]lang|format[,format...]|text, one item per format */
+static int __voise_tts_job_read(struct voise_tts_job *job, const char *file, const char *def_lang, const char *def_formats)
+{
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL)
+    {
+        ast_log(LOG_ERROR, "Could not open %s %s: %s\n", job->name, file, strerror(errno));
+        return -1;
+    }
+
+    char line[4096];
+    int size = 0;
+
+    __voise_tts_job_free_items(job);
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *parse = ast_strip(line);
+
+        if (ast_strlen_zero(parse) || *parse == '#' || *parse == ';')
+            continue;
+
+        char *name = job->named ? ast_strip(strsep(&parse, "|")) : NULL;
+        char *lang = parse ? ast_strip(strsep(&parse, "|")) : NULL;
+        char *formats = parse ? ast_strip(strsep(&parse, "|")) : NULL;
+        char *text = parse ? ast_strip(parse) : NULL;
+
+        if ((job->named && ast_strlen_zero(name)) || ast_strlen_zero(text))
+        {
+            ast_log(LOG_WARNING, "Invalid %s line: %s\n", job->name, line);
+            continue;
+        }
+
+        if (ast_strlen_zero(lang))
+            lang = (char *)def_lang;
+
+        char formats_buf[256];
+        ast_copy_string(formats_buf, ast_strlen_zero(formats) ? def_formats : formats, sizeof(formats_buf));
+        formats = formats_buf;
+
+        char *format_name;
+        while ((format_name = strsep(&formats, ",")))
+        {
+            if (job->num_items == size)
+            {
+                size = size ? size * 2 : 256;
+
+                struct voise_tts_job_item *items = ast_realloc(job->items, size * sizeof(*items));
+
+                if (items == NULL)
+                {
+                    fclose(fp);
+                    return -1;
+                }
+
+                job->items = items;
+            }
+
+            struct voise_tts_job_item *item = &job->items[job->num_items];
+
+            memset(item, 0, sizeof(*item));
+
+            if (job->add(item, name, ast_strip(format_name)) < 0)
+                continue;
+
+            item->text = ast_strdup(text);
+            item->lang = ast_strdup(lang);
+
+            job->num_items++;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/*! \brief Job worker: processes the next items of the list */
+static void* __voise_tts_job_worker(void *data)
+{
+    struct voise_tts_job *job = data;
+
+    for (;;)
+    {
+        ast_mutex_lock(job->lock);
+
+        if (job->stop || job->next >= job->num_items)
+        {
+            ast_mutex_unlock(job->lock);
+            break;
+        }
+
+        struct voise_tts_job_item *item = &job->items[job->next++];
+
+        ast_mutex_unlock(job->lock);
+
+        int result = (item->text && item->lang) ? job->process(job, item) : -1;
+
+        ast_mutex_lock(job->lock);
+
+        item->done = (result >= 0);
+
+        if (result < 0)
+            job->failed++;
+        else if (result > 0)
+            job->processed++;
+        else
+            job->cached++;
+
+        ast_mutex_unlock(job->lock);
+    }
+
+    return NULL;
+}
+
+/*! \brief Job thread: runs the workers and reports */
+static void* __voise_tts_job_thread(void *data)
+{
+    struct voise_tts_job *job = data;
+    int num_threads = MAX(1, job->workers);
+    pthread_t *workers = ast_calloc(num_threads, sizeof(pthread_t));
+    int num_workers = 0;
+    int i;
+
+    for (i = 0; workers != NULL && i < num_threads; ++i)
+    {
+        if (!ast_pthread_create_background(&workers[num_workers], NULL, __voise_tts_job_worker, job))
+            num_workers++;
+    }
+
+    for (i = 0; i < num_workers; ++i)
+        pthread_join(workers[i], NULL);
+
+    ast_free(workers);
+
+    if (job->done != NULL)
+        job->done(job);
+
+    ast_mutex_lock(job->lock);
+
+    job->end = ast_tvnow();
+    job->running = 0;
+
+    int64_t elapsed = ast_tvdiff_ms(job->end, job->start);
+
+    ast_log(LOG_NOTICE, "%s done in %lld ms: %d %s (%.1f/sec), %d already cached, %d failed\n",
+        job->name, (long long)elapsed, job->processed, job->verb,
+        elapsed ? 1000.0 * job->processed / elapsed : 0.0, job->cached, job->failed);
+
+    ast_mutex_unlock(job->lock);
+
+    return NULL;
+}
+
+/*! \brief Helper function. Start a job over a list file in the background */
+static int __voise_tts_job_start(struct voise_tts_job *job, const char *file, const char *serverip,
+    const char *def_lang, const char *def_formats, int workers)
+{
+    ast_mutex_lock(job->lock);
+
+    if (job->running)
+    {
+        ast_mutex_unlock(job->lock);
+        return -1;
+    }
+
+    /* The previous job is over */
+    if (job->thread != AST_PTHREADT_NULL)
+    {
+        pthread_join(job->thread, NULL);
+        job->thread = AST_PTHREADT_NULL;
+    }
+
+    int ret = __voise_tts_job_read(job, file, def_lang, def_formats);
+
+    if (ret == 0)
+    {
+        ast_copy_string(job->file, file, sizeof(job->file));
+        ast_copy_string(job->serverip, serverip, sizeof(job->serverip));
+
+        job->workers = workers;
+        job->next = 0;
+        job->processed = job->cached = job->failed = 0;
+        job->start = ast_tvnow();
+        job->stop = 0;
+        job->running = 1;
+
+        if (ast_pthread_create_background(&job->thread, NULL, __voise_tts_job_thread, job))
+        {
+            job->thread = AST_PTHREADT_NULL;
+            job->running = 0;
+            ret = -1;
+        }
+    }
+
+    ast_mutex_unlock(job->lock);
+
+    return ret;
+}
+
+static void __voise_tts_job_stop(struct voise_tts_job *job)
+{
+    ast_mutex_lock(job->lock);
+    job->stop = 1;
+    ast_mutex_unlock(job->lock);
+
+    if (job->thread != AST_PTHREADT_NULL)
+    {
+        pthread_join(job->thread, NULL);
+        job->thread = AST_PTHREADT_NULL;
+    }
+
+    __voise_tts_job_free_items(job);
+}
+
+/* ********************************* */
+/* ********** TTS catalog ********** */
+/* ********************************* */
+
+/*! \brief Helper function. Set up a catalog item: any format Asterisk knows */
+static int __voise_tts_catalog_add(struct voise_tts_job_item *item, const char *name, const char *format_name)
+{
+    /* The item keeps the reference */
+    if ( !(item->format = ast_format_cache_get(format_name)) )
+    {
+        ast_log(LOG_WARNING, "Unknown format '%s' in TTS catalog\n", format_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! \brief Helper function. Synthesize a catalog item into the TTS cache, unless cached */
+static int __voise_tts_catalog_process(struct voise_tts_job *job, struct voise_tts_job_item *item)
+{
+    /* Formats of the same prompt share its master */
+    return __voise_tts_cache_prompt(job->serverip, item->text, item->lang, item->format);
+}
+
+/* Pre-synthesis of the prompt catalog. Lines are lang|format[,format...]|text */
+AST_MUTEX_DEFINE_STATIC(voise_tts_catalog_lock);
+static struct voise_tts_job voise_tts_catalog = {
+    .name = "TTS catalog",
+    .verb = "synthesized",
+    .add = __voise_tts_catalog_add,
+    .process = __voise_tts_catalog_process,
+    .lock = &voise_tts_catalog_lock,
+    .thread = AST_PTHREADT_NULL,
+};
+
+/*! \brief Helper function. Start pre-synthesis of a catalog in the background */
+static int __voise_tts_catalog_start(const char *file)
+{
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    if (!vcfg)
+    {
+        ast_log(LOG_ERROR, "Error opening configuration file %s\n", VOISE_CFG);
+        return -1;
+    }
+
+    const char *vserverip;
+    if ( !(vserverip = ast_variable_retrieve(vcfg, "general", "serverip")) )
+        vserverip = VOISE_DEF_HOST;
+
+    const char *vlang;
+    if ( !(vlang = ast_variable_retrieve(vcfg, "general", "lang")))
+        vlang = VOISE_DEF_LANG;
+
+    const char *vfile = file;
+    if (vfile == NULL && !(vfile = ast_variable_retrieve(vcfg, "tts_catalog", "file")))
+    {
+        ast_config_destroy(vcfg);
+        return -1;
+    }
+
+    const char *vconcurrency;
+    if ( !(vconcurrency = ast_variable_retrieve(vcfg, "tts_catalog", "concurrency")))
+        vconcurrency = VOISE_DEF_TTS_CATALOG_CONCURRENCY;
+
+    int ret = __voise_tts_job_start(&voise_tts_catalog, vfile, vserverip, vlang, VOISE_DEF_TTS_CATALOG_FORMATS,
+        atoi(vconcurrency));
+
+    ast_config_destroy(vcfg);
+
+    return ret;
+}
+
+static char* handle_cli_voise_tts_catalog_load(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise tts catalog load";
+        e->usage =
+            "Usage: voise tts catalog load [file]\n"
+            "       Synthesize into the TTS cache the prompts of a catalog that are not\n"
+            "       cached yet. Uses the file of the [tts_catalog] section by default.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4 && a->argc != 5)
+        return CLI_SHOWUSAGE;
+
+    if (__voise_tts_catalog_start(a->argc == 5 ? a->argv[4] : NULL) < 0)
+    {
+        ast_cli(a->fd, "Could not start the catalog (already running or no file)\n");
+        return CLI_FAILURE;
+    }
+
+    ast_cli(a->fd, "Catalog started: %d prompts\n", voise_tts_catalog.num_items);
+
+    return CLI_SUCCESS;
+}
+
+static char* handle_cli_voise_show_tts_catalog(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show tts catalog";
+        e->usage =
+            "Usage: voise show tts catalog\n"
+            "       Show progress of the TTS catalog pre-synthesis.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_mutex_lock(&voise_tts_catalog_lock);
+
+    int done = voise_tts_catalog.processed + voise_tts_catalog.cached + voise_tts_catalog.failed;
+    int64_t elapsed = ast_tvdiff_ms(voise_tts_catalog.running ? ast_tvnow() : voise_tts_catalog.end, voise_tts_catalog.start);
+
+    ast_cli(a->fd, "File:        %s\n", voise_tts_catalog.file);
+    ast_cli(a->fd, "State:       %s\n", voise_tts_catalog.running ? "running" : "idle");
+    ast_cli(a->fd, "Progress:    %d / %d\n", done, voise_tts_catalog.num_items);
+    ast_cli(a->fd, "Synthesized: %d\n", voise_tts_catalog.processed);
+    ast_cli(a->fd, "Cached:      %d\n", voise_tts_catalog.cached);
+    ast_cli(a->fd, "Failed:      %d\n", voise_tts_catalog.failed);
+    ast_cli(a->fd, "Throughput:  %.1f prompts/sec\n", elapsed > 0 ? 1000.0 * voise_tts_catalog.processed / elapsed : 0.0);
+
+    ast_mutex_unlock(&voise_tts_catalog_lock);
+
+    return CLI_SUCCESS;
+}
+
+/* ********************************* */
+/* *********** TTS render ********** */
+/* ********************************* */
+
+/* Sound file extensions Asterisk plays, and the format rendered for each */
+static const struct
+{
+    const char *ext;
+    const char *format;
+} voise_tts_render_formats[] = {
+    { "ulaw", "ulaw" },
+    { "alaw", "alaw" },
+    { "sln", "slin" },
+    { "sln16", "slin16" },
+};
+
+/*! \brief Helper function. Format of a sound file extension. Returns a new reference or NULL */
+static struct ast_format* __voise_tts_render_format(const char *ext)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(voise_tts_render_formats); i++)
+    {
+        if (!strcasecmp(ext, voise_tts_render_formats[i].ext))
+            return ast_format_cache_get(voise_tts_render_formats[i].format);
+    }
+
+    return NULL;
+}
+
+/*! \brief Helper function. Sound file extension of a format, or NULL when it cannot be rendered */
+static const char* __voise_tts_render_ext(const char *format_name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(voise_tts_render_formats); i++)
+    {
+        if (!strcasecmp(format_name, voise_tts_render_formats[i].format))
+            return voise_tts_render_formats[i].ext;
+    }
+
+    return NULL;
+}
+
+/*! \brief Helper function. Path of a sound file. Names are relative to the sounds
+ * directory and cannot leave it: absolute names and '..' are refused */
+static int __voise_tts_render_path(const char *name, const char *ext, char *path, size_t size)
+{
+    const char *component = name;
+
+    if (ast_strlen_zero(name) || *name == '/')
+        return -1;
+
+    while (component != NULL)
+    {
+        if (!strncmp(component, "..", 2) && (component[2] == '/' || component[2] == '\0'))
+            return -1;
+
+        if ((component = strchr(component, '/')) != NULL)
+            component++;
+    }
+
+    if (snprintf(path, size, "%s/sounds/%s.%s", ast_config_AST_DATA_DIR, name, ext) >= (int)size)
+        return -1;
+
+    return 0;
+}
+
+/*! \brief Helper function. Write a sound file, through a temporary file so that
+ * Playback never finds it half written, and checksum it */
+static int __voise_tts_render_write(const char *path, const unsigned char *audio, size_t len, char md5[33])
+{
+    char tmp_path[PATH_MAX + 8];
+    char *dir = ast_strdupa(path);
+    char *slash = strrchr(dir, '/');
+
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        ast_mkdir(dir, 0755);
+    }
+
+    /* A unique name in the same directory, so concurrent renders of a file
+     * do not share it and the rename stays atomic */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp_path);
+
+    if (fd < 0)
+    {
+        ast_log(LOG_ERROR, "Could not create a temporary file for %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* mkstemp() makes it private: readable as any other sound file */
+    fchmod(fd, 0644);
+
+    FILE *fp = fdopen(fd, "wb");
+
+    if (fp == NULL)
+    {
+        ast_log(LOG_ERROR, "Could not create %s: %s\n", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    int ret = (len == 0 || fwrite(audio, len, 1, fp) == 1) ? 0 : -1;
+
+    if (fclose(fp) != 0)
+        ret = -1;
+
+    if (ret == 0 && rename(tmp_path, path) < 0)
+        ret = -1;
+
+    if (ret < 0)
+    {
+        ast_log(LOG_ERROR, "Could not write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    struct MD5Context md5_ctx;
+    unsigned char digest[16];
+    int i;
+
+    MD5Init(&md5_ctx);
+    MD5Update(&md5_ctx, audio, len);
+    MD5Final(digest, &md5_ctx);
+
+    for (i = 0; i < 16; i++)
+        sprintf(md5 + 2 * i, "%02x", digest[i]);
+
+    return 0;
+}
+
+/*! \brief Helper function. Render a prompt into a sound file. A prompt in the
+ * TTS cache is not synthesized again
+ * \param len set to the bytes of audio written */
+static int __voise_tts_render_file(const char *serverip, const char *text, const char *lang, struct ast_format *format,
+    const char *path, size_t *len, char md5[33])
+{
+    char *key = __voise_tts_cache_key(text, lang, format);
+    struct voise_tts_audio cached;
+    unsigned char *audio = NULL;
+    int ret;
+
+    if (key != NULL && __voise_tts_lookup_prompt(key, text, lang, format, &cached, 0) == 0)
+    {
+        *len = cached.len;
+        ret = __voise_tts_render_write(path, cached.data, cached.len, md5);
+
+        ao2_ref(cached.owner, -1);
+    }
+    else if (__voise_synth_to_buffer(serverip, text, lang, format, &audio, len) == 0)
+    {
+        ret = __voise_tts_render_write(path, audio, *len, md5);
+
+        ast_free(audio);
+    }
+    else
+    {
+        ret = -1;
+    }
+
+    ast_free(key);
+
+    return ret;
+}
+
+/*! \brief Helper function. Set up a render item: a format that can be rendered,
+ * and the path of its sound file */
+static int __voise_tts_render_add(struct voise_tts_job_item *item, const char *name, const char *format_name)
+{
+    const char *ext = __voise_tts_render_ext(format_name);
+    char path[PATH_MAX];
+
+    /* The item keeps the reference */
+    if (ext == NULL || !(item->format = ast_format_cache_get(format_name)))
+    {
+        ast_log(LOG_WARNING, "Format '%s' cannot be rendered (ulaw, alaw, slin or slin16)\n", format_name);
+        return -1;
+    }
+
+    if (__voise_tts_render_path(name, ext, path, sizeof(path)) < 0)
+    {
+        ast_log(LOG_WARNING, "Invalid TTS render file '%s': names are relative to the sounds directory\n", name);
+        ao2_ref(item->format, -1);
+        item->format = NULL;
+        return -1;
+    }
+
+    item->path = ast_strdup(path);
+
+    return 0;
+}
+
+/*! \brief Helper function. Render an item into its sound file */
+static int __voise_tts_render_process(struct voise_tts_job *job, struct voise_tts_job_item *item)
+{
+    if (item->path == NULL)
+        return -1;
+
+    return __voise_tts_render_file(job->serverip, item->text, item->lang, item->format, item->path,
+        &item->len, item->md5) < 0 ? -1 : 1;
+}
+
+/*! \brief Helper function. Write the manifest of a render job: one line per
+ * file rendered, with its duration and checksum */
+static void __voise_tts_render_manifest(struct voise_tts_job *job)
+{
+    char path[PATH_MAX + 16];
+    int i;
+
+    snprintf(path, sizeof(path), "%s.manifest", job->file);
+
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+    {
+        ast_log(LOG_ERROR, "Could not create TTS render manifest %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "; file|duration_ms|bytes|md5\n");
+
+    for (i = 0; i < job->num_items; ++i)
+    {
+        struct voise_tts_job_item *item = &job->items[i];
+
+        if (!item->done)
+            continue;
+
+        unsigned int rate = ast_format_get_sample_rate(item->format);
+        size_t samples = item->len / voise_get_bytes_per_sample(item->format);
+
+        fprintf(fp, "%s|%llu|%zu|%s\n", item->path, (unsigned long long)samples * 1000 / rate, item->len, item->md5);
+    }
+
+    fclose(fp);
+}
+
+/* Rendering of a list of prompts into sound files. Lines are
+ * name|lang|format[,format...]|text */
+AST_MUTEX_DEFINE_STATIC(voise_tts_render_lock);
+static struct voise_tts_job voise_tts_render = {
+    .name = "TTS render",
+    .verb = "rendered",
+    .named = 1,
+    .add = __voise_tts_render_add,
+    .process = __voise_tts_render_process,
+    .done = __voise_tts_render_manifest,
+    .lock = &voise_tts_render_lock,
+    .thread = AST_PTHREADT_NULL,
+};
+
+/*! \brief Helper function. Start rendering a list file in the background */
+static int __voise_tts_render_start(const char *file, int num_workers)
+{
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    if (!vcfg)
+    {
+        ast_log(LOG_ERROR, "Error opening configuration file %s\n", VOISE_CFG);
+        return -1;
+    }
+
+    const char *vserverip;
+    if ( !(vserverip = ast_variable_retrieve(vcfg, "general", "serverip")) )
+        vserverip = VOISE_DEF_HOST;
+
+    const char *vlang;
+    if ( !(vlang = ast_variable_retrieve(vcfg, "general", "lang")))
+        vlang = VOISE_DEF_LANG;
+
+    const char *vworkers;
+    if ( !(vworkers = ast_variable_retrieve(vcfg, "tts_render", "workers")))
+        vworkers = VOISE_DEF_TTS_RENDER_WORKERS;
+
+    int ret = __voise_tts_job_start(&voise_tts_render, file, vserverip, vlang, "ulaw",
+        num_workers > 0 ? num_workers : atoi(vworkers));
+
+    ast_config_destroy(vcfg);
+
+    return ret;
+}
+
+static char* handle_cli_voise_tts_render(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise tts render";
+        e->usage =
+            "Usage: voise tts render <file> [workers]\n"
+            "       Render the prompts of a list file into sound files, with workers\n"
+            "       in parallel. Lines are name|lang|format[,format...]|text, names\n"
+            "       relative to the sounds directory, formats ulaw, alaw, slin or slin16.\n"
+            "       A manifest of the files is written to <file>.manifest.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4 && a->argc != 5)
+        return CLI_SHOWUSAGE;
+
+    if (__voise_tts_render_start(a->argv[3], a->argc == 5 ? atoi(a->argv[4]) : 0) < 0)
+    {
+        ast_cli(a->fd, "Could not start rendering (already running or no file)\n");
+        return CLI_FAILURE;
+    }
+
+    ast_cli(a->fd, "Rendering started: %d files, %d workers\n", voise_tts_render.num_items, voise_tts_render.workers);
+
+    return CLI_SUCCESS;
+}
+
+static char* handle_cli_voise_show_tts_render(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show tts render";
+        e->usage =
+            "Usage: voise show tts render\n"
+            "       Show progress of the TTS rendering to sound files.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_mutex_lock(&voise_tts_render_lock);
+
+    int done = voise_tts_render.processed + voise_tts_render.failed;
+    int64_t elapsed = ast_tvdiff_ms(voise_tts_render.running ? ast_tvnow() : voise_tts_render.end, voise_tts_render.start);
+
+    ast_cli(a->fd, "File:       %s\n", voise_tts_render.file);
+    ast_cli(a->fd, "State:      %s\n", voise_tts_render.running ? "running" : "idle");
+    ast_cli(a->fd, "Workers:    %d\n", voise_tts_render.workers);
+    ast_cli(a->fd, "Progress:   %d / %d\n", done, voise_tts_render.num_items);
+    ast_cli(a->fd, "Rendered:   %d\n", voise_tts_render.processed);
+    ast_cli(a->fd, "Failed:     %d\n", voise_tts_render.failed);
+    ast_cli(a->fd, "Throughput: %.1f files/sec\n", elapsed > 0 ? 1000.0 * voise_tts_render.processed / elapsed : 0.0);
+
+    ast_mutex_unlock(&voise_tts_render_lock);
+
+    return CLI_SUCCESS;
+}
+
+/*! \brief Helper function. Load the TTS cache settings */
+static void __voise_tts_cache_load_config(void)
+{
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    const char *venabled = NULL;
+    const char *vmaxbytes = NULL;
+    const char *vvoiceversion = NULL;
+    const char *vdisk = NULL;
+    const char *vdiskdir = NULL;
+    const char *vdiskmaxbytes = NULL;
+    const char *vdiskslots = NULL;
+    const char *vmaster = NULL;
+
+    if (vcfg)
+    {
+        venabled = ast_variable_retrieve(vcfg, "tts_cache", "enabled");
+        vmaxbytes = ast_variable_retrieve(vcfg, "tts_cache", "max_bytes");
+        vvoiceversion = ast_variable_retrieve(vcfg, "tts_cache", "voice_version");
+        vdisk = ast_variable_retrieve(vcfg, "tts_cache", "disk");
+        vdiskdir = ast_variable_retrieve(vcfg, "tts_cache", "disk_dir");
+        vdiskmaxbytes = ast_variable_retrieve(vcfg, "tts_cache", "disk_max_bytes");
+        vdiskslots = ast_variable_retrieve(vcfg, "tts_cache", "disk_slots");
+        vmaster = ast_variable_retrieve(vcfg, "tts_cache", "master");
+    }
+
+    voise_tts_disk_info.enabled = vdisk ? ast_true(vdisk) : 0;
+    voise_tts_disk_info.max_bytes = strtoull(vdiskmaxbytes ? vdiskmaxbytes : VOISE_DEF_TTS_DISK_MAX_BYTES, NULL, 10);
+    voise_tts_disk_info.num_slots = strtoul(vdiskslots ? vdiskslots : VOISE_DEF_TTS_DISK_SLOTS, NULL, 10);
+
+    if (voise_tts_disk_info.num_slots == 0 || voise_tts_disk_info.max_bytes == 0)
+        voise_tts_disk_info.enabled = 0;
+
+    if (vdiskdir)
+        ast_copy_string(voise_tts_disk_info.dir, vdiskdir, sizeof(voise_tts_disk_info.dir));
+    else
+        snprintf(voise_tts_disk_info.dir, sizeof(voise_tts_disk_info.dir), "%s/voise", ast_config_AST_DATA_DIR);
+
+    voise_tts_cache_info.enabled = venabled ? ast_true(venabled) : 1;
+    voise_tts_cache_info.master = vmaster ? ast_true(vmaster) : 1;
+    voise_tts_cache_info.max_bytes = strtoull(vmaxbytes ? vmaxbytes : VOISE_DEF_TTS_CACHE_MAX_BYTES, NULL, 10);
+    ast_copy_string(voise_tts_cache_info.voice_version, vvoiceversion ? vvoiceversion : VOISE_DEF_TTS_VOICE_VERSION,
+        sizeof(voise_tts_cache_info.voice_version));
+
+    if (vcfg)
+        ast_config_destroy(vcfg);
+}
+
+static char* handle_cli_voise_show_tts_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show tts cache";
+        e->usage =
+            "Usage: voise show tts cache\n"
+            "       Show usage and counters of the TTS cache.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_mutex_lock(&voise_tts_cache_lock);
+
+    unsigned int lookups = voise_tts_cache_info.hits + voise_tts_cache_info.misses;
+
+    ast_cli(a->fd, "Enabled:    %s\n", voise_tts_cache_info.enabled ? "yes" : "no");
+    ast_cli(a->fd, "Entries:    %d\n", ao2_container_count(voise_tts_cache));
+    ast_cli(a->fd, "Bytes used: %zu / %zu\n", voise_tts_cache_info.bytes, voise_tts_cache_info.max_bytes);
+    ast_cli(a->fd, "Hits:       %u\n", voise_tts_cache_info.hits);
+    ast_cli(a->fd, "Misses:     %u\n", voise_tts_cache_info.misses);
+    ast_cli(a->fd, "Evictions:  %u\n", voise_tts_cache_info.evictions);
+    ast_cli(a->fd, "Coalesced:  %u\n", voise_tts_cache_info.coalesced);
+    ast_cli(a->fd, "Derived:    %u\n", voise_tts_cache_info.derived);
+    ast_cli(a->fd, "Hit ratio:  %.1f%%\n", lookups ? 100.0 * voise_tts_cache_info.hits / lookups : 0.0);
+
+    ast_mutex_unlock(&voise_tts_cache_lock);
+
+    return CLI_SUCCESS;
+}
+
+/* ********************************* */
+/* ********** TTS playback ********* */
+/* ********************************* */
+
+/* Segments shorter than this are merged with the next one */
+static const size_t VOISE_TTS_SEGMENT_MIN_CHARS = 20;
+
+/* Segments of a streamed text. They are not reallocated while the workers run */
+static const int VOISE_TTS_STREAM_MAX_SEGMENTS = 256;
+
+/*! \brief Helper function. Split a text in sentences, and sentences longer than
+ * max_chars in clauses. max_chars 0 keeps the text whole */
+static int __voise_tts_split_text(const char *text, size_t max_chars, char ***segments)
+{
+    int num_segments = 0;
+    int size = 0;
+
+    *segments = NULL;
+
+    const char *p = text;
+
+    while (*p)
+    {
+        while (isspace((unsigned char)*p))
+            p++;
+
+        if (*p == '\0')
+            break;
+
+        size_t len = strlen(p);
+        size_t cut = len;
+
+        if (max_chars > 0)
+        {
+            size_t clause = 0;
+            size_t word = 0;
+            size_t i;
+
+            cut = 0;
+
+            for (i = 0; p[i] != '\0'; i++)
+            {
+                int boundary = (p[i + 1] == '\0' || isspace((unsigned char)p[i + 1]));
+
+                if (boundary && strchr(".!?", p[i]) && i + 1 >= VOISE_TTS_SEGMENT_MIN_CHARS)
+                {
+                    cut = i + 1;
+                    break;
+                }
+
+                if (boundary && strchr(",;:", p[i]))
+                    clause = i + 1;
+                else if (isspace((unsigned char)p[i]))
+                    word = i;
+
+                if (i + 1 >= max_chars)
+                {
+                    /* No sentence end: cut at the last clause, or word */
+                    cut = clause ? clause : word ? word : i + 1;
+
+                    /* Not in the middle of an UTF-8 character */
+                    while (cut > 1 && ((unsigned char)p[cut] & 0xc0) == 0x80)
+                        cut--;
+                    break;
+                }
+            }
+
+            if (cut == 0)
+                cut = len;
+        }
+
+        if (num_segments == size)
+        {
+            size = size ? size * 2 : 8;
+
+            char **new_segments = ast_realloc(*segments, size * sizeof(char *));
+
+            if (new_segments == NULL)
+                goto error;
+
+            *segments = new_segments;
+        }
+
+        if ( !((*segments)[num_segments] = ast_strndup(p, cut)) )
+            goto error;
+
+        num_segments++;
+        p += cut;
+    }
+
+    return num_segments;
+
+error:
+    while (num_segments > 0)
+        ast_free((*segments)[--num_segments]);
+
+    ast_free(*segments);
+    *segments = NULL;
+
+    return -1;
+}
+
+/*! \brief Helper function. Append a trimmed piece of text to a list of segments.
+ * Pieces without words (punctuation only) are dropped */
+static int __voise_tts_add_piece(const char *start, const char *end, int slot, char ***segments, int **slots,
+    int *num_segments, int *size)
+{
+    const char *p;
+
+    while (start < end && isspace((unsigned char)*start))
+        start++;
+    while (end > start && isspace((unsigned char)end[-1]))
+        end--;
+
+    for (p = start; p < end; p++)
+    {
+        if (isalnum((unsigned char)*p) || (unsigned char)*p >= 0x80)
+            break;
+    }
+
+    if (p == end)
+        return 0;
+
+    if (*num_segments == *size)
+    {
+        int new_size = *size ? *size * 2 : 8;
+
+        char **new_segments = ast_realloc(*segments, new_size * sizeof(char *));
+        if (new_segments == NULL)
+            return -1;
+        *segments = new_segments;
+
+        int *new_slots = ast_realloc(*slots, new_size * sizeof(int));
+        if (new_slots == NULL)
+            return -1;
+        *slots = new_slots;
+
+        *size = new_size;
+    }
+
+    if ( !((*segments)[*num_segments] = ast_strndup(start, end - start)) )
+        return -1;
+
+    (*slots)[*num_segments] = slot;
+    (*num_segments)++;
+
+    return 0;
+}
+
+/*! \brief Helper function. Split a template in its static fragments and {variable}
+ * parts, e.g. "Your balance is {${AMOUNT}} reais". slots is set for the variable parts */
+static int __voise_tts_split_template(const char *text, char ***segments, int **slots)
+{
+    int num_segments = 0;
+    int size = 0;
+
+    *segments = NULL;
+    *slots = NULL;
+
+    const char *p = text;
+
+    while (*p)
+    {
+        const char *open = strchr(p, '{');
+        const char *close = open ? strchr(open + 1, '}') : NULL;
+
+        /* An unterminated slot is static text */
+        if (close == NULL)
+        {
+            if (__voise_tts_add_piece(p, p + strlen(p), 0, segments, slots, &num_segments, &size) < 0)
+                goto error;
+            break;
+        }
+
+        if (__voise_tts_add_piece(p, open, 0, segments, slots, &num_segments, &size) < 0 ||
+            __voise_tts_add_piece(open + 1, close, 1, segments, slots, &num_segments, &size) < 0)
+            goto error;
+
+        p = close + 1;
+    }
+
+    return num_segments;
+
+error:
+    while (num_segments > 0)
+        ast_free((*segments)[--num_segments]);
+
+    ast_free(*segments);
+    ast_free(*slots);
+    *segments = NULL;
+    *slots = NULL;
+
+    return -1;
+}
+
+/*! \brief Helper function. Length of the start of a streamed text that is ready
+ * to be synthesized: up to its last sentence end or, for the first segment, its
+ * last clause end, so the prompt starts as soon as possible. Without one, a
+ * text longer than max_chars is cut at a word */
+static size_t __voise_tts_stream_ready(const char *text, size_t max_chars, int first)
+{
+    size_t sentence = 0;
+    size_t clause = 0;
+    size_t word = 0;
+    size_t i;
+
+    /* The end of the text is not a boundary: the word may go on */
+    for (i = 0; text[i] != '\0'; i++)
+    {
+        if (!isspace((unsigned char)text[i + 1]))
+            continue;
+
+        if (strchr(".!?", text[i]))
+            sentence = i + 1;
+        else if (strchr(",;:", text[i]))
+            clause = i + 1;
+
+        word = i + 1;
+    }
+
+    if (sentence > 0)
+        return sentence;
+
+    if (first && clause >= VOISE_TTS_SEGMENT_MIN_CHARS)
+        return clause;
+
+    if (max_chars > 0 && i >= max_chars)
+        return word ? word : i;
+
+    return 0;
+}
+
+/*! \brief Helper function. Append text to a streamed prompt. The complete
+ * sentences are split in segments for the synthesis worker, the rest waits for
+ * more text. The last text ends the prompt */
+static int __voise_tts_playback_append(struct voise_tts_playback *playback, const char *text, int last)
+{
+    char **texts = NULL;
+    int num_texts = 0;
+    int ret = 0;
+    int i;
+
+    ast_mutex_lock(&playback->lock);
+
+    if (!playback->open || playback->stop)
+    {
+        ast_mutex_unlock(&playback->lock);
+        return -1;
+    }
+
+    size_t pending_len = playback->pending ? strlen(playback->pending) : 0;
+    char *pending = ast_realloc(playback->pending, pending_len + strlen(text) + 1);
+
+    if (pending == NULL)
+    {
+        ast_mutex_unlock(&playback->lock);
+        return -1;
+    }
+
+    strcpy(pending + pending_len, text);
+    playback->pending = pending;
+
+    size_t ready = last ? strlen(pending) :
+        __voise_tts_stream_ready(pending, playback->segment_max_chars, playback->num_segments == 0);
+
+    if (ready > 0)
+    {
+        char *piece = ast_strndup(pending, ready);
+
+        num_texts = piece ? __voise_tts_split_text(piece, playback->segment_max_chars, &texts) : -1;
+        ast_free(piece);
+
+        memmove(pending, pending + ready, strlen(pending + ready) + 1);
+    }
+
+    if (num_texts < 0)
+    {
+        num_texts = 0;
+        ret = -1;
+    }
+
+    for (i = 0; i < num_texts; i++)
+    {
+        if (playback->num_segments == playback->segments_size)
+        {
+            ast_log(LOG_WARNING, "Streamed prompt longer than %d segments, text dropped\n", playback->segments_size);
+
+            ast_free(texts[i]);
+            ret = -1;
+            continue;
+        }
+
+        struct voise_tts_segment *segment = &playback->segments[playback->num_segments++];
+
+        segment->text = texts[i];
+        segment->key = __voise_tts_cache_key(texts[i], playback->lang, playback->format);
+    }
+
+    ast_free(texts);
+
+    if (last)
+        playback->open = 0;
+
+    if (playback->verbose && num_texts > 0)
+        ast_log(LOG_DEBUG, "Streamed text: %d segments queued\n", num_texts);
+
+    ast_cond_broadcast(&playback->cond);
+    ast_mutex_unlock(&playback->lock);
+
+    return ret;
+}
+
+/*! \brief Helper function. Find a segment in the cache, or join its synthesis
+ * (started by this playback or another).
+ * \retval 1 found in the cache
+ * \retval 0 synthesis in flight in segment->inflight
+ * \retval -1 error */
+static int __voise_tts_segment_begin(struct voise_tts_playback *playback, struct voise_tts_segment *segment)
+{
+    struct voise_tts_audio cached;
+
+    if (segment->key != NULL &&
+        __voise_tts_lookup_prompt(segment->key, segment->text, playback->lang, playback->format, &cached, 1) == 0)
+    {
+        ast_mutex_lock(&playback->lock);
+        segment->cached = cached;
+        segment->is_cached = 1;
+        segment->done = segment->complete = 1;
+        ast_cond_broadcast(&playback->cond);
+        ast_mutex_unlock(&playback->lock);
+
+        return 1;
+    }
+
+    /* The master is synthesized, shared by the playbacks of every format, and
+     * converted on the way. The variant is cached when the segment is played */
+    struct ast_format *format = segment->key ? __voise_tts_master_format(playback->format) : playback->format;
+    char *master_key = NULL;
+
+    if (format != playback->format &&
+        (!(master_key = __voise_tts_cache_key(segment->text, playback->lang, format)) ||
+        !(segment->transcoder = __voise_tts_transcoder_alloc(playback->format))))
+    {
+        ast_free(master_key);
+        master_key = NULL;
+        format = playback->format;
+    }
+
+    segment->inflight = __voise_tts_inflight_join(playback->serverip, master_key ? master_key : segment->key,
+        segment->text, playback->lang, format);
+
+    ast_free(master_key);
+
+    return segment->inflight ? 0 : -1;
+}
+
+/*! \brief Helper function. Copy the audio of a segment from its synthesis in
+ * flight as it arrives, until it ends. A playback that joined late catches up
+ * at once */
+static void __voise_tts_segment_read(struct voise_tts_playback *playback, struct voise_tts_segment *segment)
+{
+    struct voise_tts_inflight *inflight = segment->inflight;
+    unsigned char audio_data[VOISE_MAX_FRAME_LEN];
+    size_t offset = 0;
+    int done = 0;
+    int stop = 0;
+    int ret = 0;
+
+    while (!done && !stop && ret >= 0)
+    {
+        ast_mutex_lock(&inflight->lock);
+
+        if (offset >= inflight->len && !inflight->done)
+        {
+            struct timeval wait = ast_tvadd(ast_tvnow(), ast_samp2tv(VOISE_TTS_INFLIGHT_POLL_MS, 1000));
+            struct timespec ts = { .tv_sec = wait.tv_sec, .tv_nsec = wait.tv_usec * 1000 };
+
+            ast_cond_timedwait(&inflight->cond, &inflight->lock, &ts);
+        }
+
+        size_t audio_len = MIN(inflight->len - offset, sizeof(audio_data));
+
+        if (audio_len > 0)
+            memcpy(audio_data, inflight->audio + offset, audio_len);
+
+        offset += audio_len;
+        done = inflight->done && offset >= inflight->len;
+
+        int complete = done && inflight->complete;
+
+        ast_mutex_unlock(&inflight->lock);
+
+        const unsigned char *audio = audio_data;
+        ssize_t len = audio_len;
+
+        if (segment->transcoder != NULL && (audio_len > 0 || done))
+            len = __voise_tts_transcode_chunk(segment->transcoder, audio_data, audio_len, done, &audio);
+
+        ast_mutex_lock(&playback->lock);
+
+        if (len < 0 || (len > 0 && __voise_buffer_append(&segment->audio, &segment->len, &segment->size, audio, len) < 0))
+        {
+            ast_log(LOG_ERROR, "Could not keep synthesized audio\n");
+            ret = -1;
+        }
+
+        segment->complete = complete && ret >= 0;
+        stop = playback->stop;
+
+        if (len > 0)
+            ast_cond_broadcast(&playback->cond);
+
+        ast_mutex_unlock(&playback->lock);
+    }
+
+    ast_mutex_lock(&playback->lock);
+    segment->done = 1;
+    ast_cond_broadcast(&playback->cond);
+    ast_mutex_unlock(&playback->lock);
+
+    segment->inflight = NULL;
+    __voise_tts_inflight_leave(inflight);
+}
+
+/*! \brief Synthesis worker: synthesizes the segments in order, up to lookahead
+ * segments ahead of the one playing */
+static void* __voise_tts_synth_thread(void *data)
+{
+    TRACE_FUNCTION();
+
+    struct voise_tts_playback *playback = data;
+    int i;
+
+    for (i = 0; ; i++)
+    {
+        struct voise_tts_segment *segment = &playback->segments[i];
+
+        ast_mutex_lock(&playback->lock);
+
+        /* Wait for room in the lookahead, and for the text of a stream */
+        while (!playback->stop && (i - playback->feed_index > playback->lookahead ||
+            (i >= playback->num_segments && playback->open)))
+            ast_cond_wait(&playback->cond, &playback->lock);
+
+        int stop = playback->stop || i >= playback->num_segments;
+        int done = stop || segment->done;
+        int num_segments = playback->num_segments;
+
+        ast_mutex_unlock(&playback->lock);
+
+        if (stop)
+            break;
+
+        /* The first segment may have been found in the cache already */
+        if (done)
+            continue;
+
+        /* The first segment was started with the playback */
+        if (segment->inflight == NULL)
+        {
+            int res = __voise_tts_segment_begin(playback, segment);
+
+            if (res > 0)
+                continue;
+
+            if (res < 0)
+            {
+                ast_mutex_lock(&playback->lock);
+                segment->done = 1;
+                ast_cond_broadcast(&playback->cond);
+                ast_mutex_unlock(&playback->lock);
+                continue;
+            }
+        }
+
+        if (playback->verbose)
+            ast_log(LOG_DEBUG, "Synthesizing segment %d/%d\n", i + 1, num_segments);
+
+        __voise_tts_segment_read(playback, segment);
+    }
+
+    return NULL;
+}
+
+/*! \brief Helper function. Free the audio of a played segment. A segment
+ * synthesized to the end was cached by its synthesis in flight already, but a
+ * variant converted from its master is cached here */
+static void __voise_tts_segment_release(struct voise_tts_segment *segment)
+{
+    if (segment->is_cached)
+    {
+        ao2_ref(segment->cached.owner, -1);
+        segment->is_cached = 0;
+    }
+    else if (segment->transcoder != NULL && segment->complete && segment->audio != NULL && segment->key != NULL)
+    {
+        __voise_tts_store(segment->key, segment->audio, segment->len);
+        segment->audio = NULL;
+    }
+
+    __voise_tts_transcoder_free(segment->transcoder);
+    segment->transcoder = NULL;
+
+    ast_free(segment->audio);
+    segment->audio = NULL;
+    segment->len = segment->size = 0;
+}
+
+/*! \brief Helper function. Decode a sample to linear */
+static short __voise_sample_decode(struct ast_format *format, const unsigned char *data)
+{
+    short sample;
+
+    if (format == ast_format_ulaw)
+        return AST_MULAW(*data);
+    if (format == ast_format_alaw)
+        return AST_ALAW(*data);
+
+    memcpy(&sample, data, sizeof(sample));
+    return sample;
+}
+
+/*! \brief Helper function. Encode a linear sample */
+static void __voise_sample_encode(struct ast_format *format, unsigned char *data, short sample)
+{
+    if (format == ast_format_ulaw)
+        *data = AST_LIN2MU(sample);
+    else if (format == ast_format_alaw)
+        *data = AST_LIN2A(sample);
+    else
+        memcpy(data, &sample, sizeof(sample));
+}
+
+/*! \brief Helper function. Offset of the first sample louder than threshold,
+ * or len when there is none */
+static size_t __voise_tts_speech_start(struct ast_format *format, const unsigned char *data, size_t len, int threshold)
+{
+    int bytes_per_sample = voise_get_bytes_per_sample(format);
+    size_t i;
+
+    for (i = 0; i + bytes_per_sample <= len; i += bytes_per_sample)
+    {
+        if (abs(__voise_sample_decode(format, data + i)) > threshold)
+            return i;
+    }
+
+    return len;
+}
+
+/*! \brief Helper function. Offset just past the last sample louder than
+ * threshold, or 0 when there is none */
+static size_t __voise_tts_speech_end(struct ast_format *format, const unsigned char *data, size_t len, int threshold)
+{
+    int bytes_per_sample = voise_get_bytes_per_sample(format);
+    size_t i;
+
+    for (i = len / bytes_per_sample * bytes_per_sample; i > 0; i -= bytes_per_sample)
+    {
+        if (abs(__voise_sample_decode(format, data + i - bytes_per_sample)) > threshold)
+            return i;
+    }
+
+    return 0;
+}
+
+/*! \brief Helper function. Copy as much audio as fits into the ring. Playback must be locked
+ * \return number of bytes copied */
+static size_t __voise_tts_ring_write(struct voise_tts_playback *playback, const unsigned char *data, size_t len)
+{
+    size_t chunk = MIN(len, playback->ring_size - playback->ring_count);
+    size_t tail = (playback->ring_head + playback->ring_count) % playback->ring_size;
+    size_t first = MIN(chunk, playback->ring_size - tail);
+
+    memcpy(playback->ring + tail, data, first);
+    memcpy(playback->ring, data + first, chunk - first);
+
+    playback->ring_count += chunk;
+
+    if (chunk > 0)
+        ast_cond_broadcast(&playback->cond);
+
+    return chunk;
+}
+
+/*! \brief Helper function. Crossfade the held tail of the previous segment into
+ * the head of this one, and queue it. Playback must be locked
+ * \return bytes of the segment consumed, or -1 when stopped */
+static int __voise_tts_crossfade(struct voise_tts_playback *playback, struct voise_tts_segment *segment)
+{
+    size_t held = playback->xfade_held;
+    size_t len;
+
+    /* Wait for the head of the segment */
+    for (;;)
+    {
+        len = segment->is_cached ? segment->cached.len : segment->len;
+
+        if (playback->stop)
+            return -1;
+
+        if (len >= held || segment->done)
+            break;
+
+        ast_cond_wait(&playback->cond, &playback->lock);
+    }
+
+    const unsigned char *audio = segment->is_cached ? segment->cached.data : segment->audio;
+    int bytes_per_sample = voise_get_bytes_per_sample(playback->format);
+    size_t samples = held / bytes_per_sample;
+    size_t head = MIN(len, held) / bytes_per_sample;
+    size_t i;
+
+    /* Linear fade; past the end of a short segment, the tail only fades out */
+    for (i = 0; i < samples; i++)
+    {
+        unsigned char *out = playback->xfade + i * bytes_per_sample;
+        int mixed = __voise_sample_decode(playback->format, out) * (int)(samples - i) / (int)samples;
+
+        if (i < head)
+            mixed += __voise_sample_decode(playback->format, audio + i * bytes_per_sample) * (int)i / (int)samples;
+
+        __voise_sample_encode(playback->format, out, (short)MAX(-32768, MIN(32767, mixed)));
+    }
+
+    size_t offset = 0;
+
+    while (offset < held)
+    {
+        if (playback->stop)
+            return -1;
+
+        size_t chunk = __voise_tts_ring_write(playback, playback->xfade + offset, held - offset);
+
+        if (chunk == 0)
+            ast_cond_wait(&playback->cond, &playback->lock);
+
+        offset += chunk;
+    }
+
+    playback->xfade_held = 0;
+
+    return (int)(head * bytes_per_sample);
+}
+
+/*! \brief Prefetch worker: feeds the segments, in order, into the ring */
+static void* __voise_tts_prefetch_thread(void *data)
+{
+    TRACE_FUNCTION();
+
+    struct voise_tts_playback *playback = data;
+
+    ast_mutex_lock(&playback->lock);
+
+    for (;;)
+    {
+        /* The text of a stream may not be there yet */
+        while (!playback->stop && playback->feed_index >= playback->num_segments && playback->open)
+            ast_cond_wait(&playback->cond, &playback->lock);
+
+        if (playback->stop || playback->feed_index >= playback->num_segments)
+            break;
+
+        struct voise_tts_segment *segment = &playback->segments[playback->feed_index];
+        size_t offset = 0;
+        size_t scan = 0;
+
+        /* The tail of all but the last segment is held back for the crossfade */
+        size_t hold = (playback->feed_index + 1 < playback->num_segments) ? playback->xfade_len : 0;
+
+        /* The trailing silence of the prompt is only known when its last segment is cached */
+        size_t tail = 0;
+
+        if (playback->trim_threshold > 0 && segment->is_cached && !playback->open &&
+            playback->feed_index + 1 == playback->num_segments)
+        {
+            size_t end = __voise_tts_speech_end(playback->format, segment->cached.data, segment->cached.len,
+                playback->trim_threshold);
+
+            tail = segment->cached.len - MIN(segment->cached.len, end + playback->trim_guard);
+        }
+
+        if (playback->xfade_held > 0)
+        {
+            int consumed = __voise_tts_crossfade(playback, segment);
+
+            if (consumed < 0)
+                break;
+
+            offset = consumed;
+        }
+
+        for (;;)
+        {
+            const unsigned char *audio = segment->is_cached ? segment->cached.data : segment->audio;
+            size_t len = segment->is_cached ? segment->cached.len : segment->len;
+            size_t limit = MAX(offset, len > hold + tail ? len - hold - tail : 0);
+
+            if (playback->stop || (offset >= limit && segment->done))
+                break;
+
+            /* The leading silence is dropped as it arrives, but for the guard */
+            if (playback->trim_lead && offset < limit)
+            {
+                int bytes_per_sample = voise_get_bytes_per_sample(playback->format);
+                size_t speech = scan + __voise_tts_speech_start(playback->format, audio + scan, limit - scan,
+                    playback->trim_threshold);
+
+                if (speech < limit)
+                {
+                    size_t start = MAX(offset, speech > playback->trim_guard ? speech - playback->trim_guard : 0);
+
+                    start = start / bytes_per_sample * bytes_per_sample;
+                    playback->trimmed += start - offset;
+                    playback->trim_lead = 0;
+                    offset = start;
+                }
+                else if (segment->done)
+                {
+                    /* A silent segment is dropped whole */
+                    playback->trimmed += limit - offset;
+                    offset = scan = limit;
+                    continue;
+                }
+                else
+                {
+                    scan += (limit - scan) / bytes_per_sample * bytes_per_sample;
+                    ast_cond_wait(&playback->cond, &playback->lock);
+                    continue;
+                }
+            }
+
+            size_t chunk = (offset < limit) ? __voise_tts_ring_write(playback, audio + offset, limit - offset) : 0;
+
+            if (chunk == 0)
+                ast_cond_wait(&playback->cond, &playback->lock);
+
+            offset += chunk;
+        }
+
+        if (playback->stop)
+            break;
+
+        playback->trimmed += tail;
+
+        if (hold > 0)
+        {
+            const unsigned char *audio = segment->is_cached ? segment->cached.data : segment->audio;
+            size_t len = segment->is_cached ? segment->cached.len : segment->len;
+
+            playback->xfade_held = len - offset;
+            memcpy(playback->xfade, audio + offset, playback->xfade_held);
+        }
+
+        if (!segment->complete)
+            playback->error = 1;
+
+        /* Done with by the synthesis worker */
+        ast_mutex_unlock(&playback->lock);
+        __voise_tts_segment_release(segment);
+        ast_mutex_lock(&playback->lock);
+
+        playback->feed_index++;
+        ast_cond_broadcast(&playback->cond);
+    }
+
+    playback->eof = 1;
+    ast_cond_broadcast(&playback->cond);
+
+    ast_mutex_unlock(&playback->lock);
+
+    return NULL;
+}
+
+/*! \brief Helper function. Create the playback of a prompt.
+ * \param cached cached audio, or NULL to synthesize. The playback takes over its reference */
+static struct voise_tts_playback* __voise_tts_playback_alloc(struct ast_format *format, struct voise_tts_audio *cached,
+    int prefetch_ms, enum voise_tts_underrun_fill fill, int verbose)
+{
+    int frame_ms = ast_format_get_default_ms(format);
+    size_t frame_len = frame_ms / ast_format_get_minimum_ms(format) * ast_format_get_minimum_bytes(format);
+
+    /* The cached audio and the frame buffer are allocated with the playback */
+    struct voise_tts_playback *playback = ast_calloc(1, sizeof(*playback) + sizeof(struct voise_tts_audio) +
+        AST_FRIENDLY_OFFSET + frame_len);
+
+    if (playback == NULL)
+        return NULL;
+
+    playback->format = format;
+    playback->frame_len = frame_len;
+    playback->frame_buf = (unsigned char *)(playback + 1) + sizeof(struct voise_tts_audio);
+    playback->verbose = verbose;
+    playback->fill = fill;
+    playback->noise_seed = (unsigned int)(uintptr_t)playback;
+    playback->thread = AST_PTHREADT_NULL;
+    playback->synth_thread = AST_PTHREADT_NULL;
+    playback->created = ast_tvnow();
+    playback->first_audio_ms = -1;
+
+    ast_mutex_init(&playback->lock);
+    ast_cond_init(&playback->cond, NULL);
+
+    if (cached != NULL)
+    {
+        playback->cached = (struct voise_tts_audio *)(playback + 1);
+        *playback->cached = *cached;
+        playback->cached_end = cached->len;
+
+        __voise_stats_add(&voise_stats_module, VOISE_STAT_PLAYBACKS, 1);
+
+        return playback;
+    }
+
+    /* At least two frames (a whole server read, plus the one being played) */
+    size_t bytes_per_ms = playback->frame_len / frame_ms;
+    playback->ring_size = MAX((size_t)prefetch_ms * bytes_per_ms, 2 * (size_t)VOISE_MAX_FRAME_LEN);
+    playback->ring = ast_malloc(playback->ring_size);
+
+    if (playback->ring == NULL)
+    {
+        ast_mutex_destroy(&playback->lock);
+        ast_cond_destroy(&playback->cond);
+        ast_free(playback);
+        return NULL;
+    }
+
+    __voise_stats_add(&voise_stats_module, VOISE_STAT_PLAYBACKS, 1);
+
+    return playback;
+}
+
+/*! \brief Helper function. Split the text, start the synthesis of the first
+ * segment and the workers. The first segment is started here, so a server
+ * error fails the application as before. A streamed text is appended to with
+ * __voise_tts_playback_append() */
+static int __voise_tts_playback_start(struct voise_tts_playback *playback, const char *serverip, const char *text,
+    const char *lang, const struct voise_tts_synth_options *options)
+{
+    TRACE_FUNCTION();
+
+    char **texts;
+    int *slots = NULL;
+    int i;
+
+    playback->serverip = ast_strdup(serverip);
+    playback->lang = ast_strdup(lang);
+    playback->lookahead = MAX(options->lookahead, 1);
+
+    if (!playback->serverip || !playback->lang)
+        return -1;
+
+    /* A stream is started with the text there is, maybe none */
+    if (options->stream)
+    {
+        playback->segments_size = VOISE_TTS_STREAM_MAX_SEGMENTS;
+        playback->segment_max_chars = MAX(options->segment_max_chars, 0);
+        playback->open = 1;
+
+        if ( !(playback->segments = ast_calloc(playback->segments_size, sizeof(*playback->segments))) )
+            return -1;
+
+        if (!ast_strlen_zero(text) && __voise_tts_playback_append(playback, text, 0) < 0)
+            return -1;
+
+        goto workers;
+    }
+
+    if (options->template)
+        playback->num_segments = __voise_tts_split_template(text, &texts, &slots);
+    else
+        playback->num_segments = __voise_tts_split_text(text, MAX(options->segment_max_chars, 0), &texts);
+
+    if (playback->num_segments <= 0)
+    {
+        playback->num_segments = 0;
+        ast_free(slots);
+        return -1;
+    }
+
+    if ( !(playback->segments = ast_calloc(playback->num_segments, sizeof(*playback->segments))) )
+    {
+        for (i = 0; i < playback->num_segments; i++)
+            ast_free(texts[i]);
+        ast_free(texts);
+        ast_free(slots);
+
+        playback->num_segments = 0;
+        return -1;
+    }
+
+    /* Every segment is cached on its own, but the variable parts of a template */
+    for (i = 0; i < playback->num_segments; i++)
+    {
+        playback->segments[i].text = texts[i];
+
+        if (!slots || !slots[i])
+            playback->segments[i].key = __voise_tts_cache_key(texts[i], lang, playback->format);
+    }
+
+    ast_free(texts);
+    ast_free(slots);
+
+    /* The pieces of a template are spliced with a crossfade */
+    if (options->template && options->crossfade_ms > 0 && playback->num_segments > 1)
+    {
+        int bytes_per_sample = voise_get_bytes_per_sample(playback->format);
+        size_t bytes_per_ms = playback->frame_len / ast_format_get_default_ms(playback->format);
+        size_t xfade_len = MIN((size_t)options->crossfade_ms * bytes_per_ms, playback->ring_size / 2);
+
+        playback->xfade_len = xfade_len / bytes_per_sample * bytes_per_sample;
+
+        if ( !(playback->xfade = ast_malloc(playback->xfade_len)) )
+            playback->xfade_len = 0;
+    }
+
+    if (playback->verbose)
+        ast_log(LOG_DEBUG, "Text split in %d segments\n", playback->num_segments);
+
+workers:
+    if (playback->num_segments > 0 &&
+        __voise_tts_segment_begin(playback, &playback->segments[0]) < 0)
+        return -1;
+
+    if (ast_pthread_create_background(&playback->synth_thread, NULL, __voise_tts_synth_thread, playback))
+    {
+        ast_log(LOG_ERROR, "Failed to start the synthesis thread\n");
+
+        playback->synth_thread = AST_PTHREADT_NULL;
+        return -1;
+    }
+
+    if (ast_pthread_create_background(&playback->thread, NULL, __voise_tts_prefetch_thread, playback))
+    {
+        ast_log(LOG_ERROR, "Failed to start the prefetch thread\n");
+
+        playback->thread = AST_PTHREADT_NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! \brief Helper function. Fill a frame the prefetch worker did not deliver in time */
+static size_t __voise_tts_playback_fill(struct voise_tts_playback *playback, unsigned char *buffer,
+    enum voise_tts_underrun_fill fill)
+{
+    size_t i;
+
+    if (fill == VOISE_TTS_FILL_NONE)
+        return 0;
+
+    int bytes_per_sample = voise_get_bytes_per_sample(playback->format);
+
+    for (i = 0; i + bytes_per_sample <= playback->frame_len; i += bytes_per_sample)
+    {
+        short sample = 0;
+
+        /* About -60 dBFS */
+        if (fill == VOISE_TTS_FILL_NOISE)
+        {
+            playback->noise_seed = playback->noise_seed * 1103515245 + 12345;
+            sample = (short)((int)((playback->noise_seed >> 16) & 0x3f) - 32);
+        }
+
+        __voise_sample_encode(playback->format, buffer + i, sample);
+    }
+
+    return i;
+}
+
+/*! \brief Helper function. Build a whole frame from the last audio of a prompt,
+ * completed with silence, so every frame is a whole packetization unit
+ * \return frame length */
+static size_t __voise_tts_playback_pad(struct voise_tts_playback *playback, unsigned char *buffer,
+    const unsigned char *audio, size_t len)
+{
+    int bytes_per_sample = voise_get_bytes_per_sample(playback->format);
+    size_t i;
+
+    if (audio != buffer)
+        memcpy(buffer, audio, len);
+
+    for (i = len / bytes_per_sample * bytes_per_sample; i + bytes_per_sample <= playback->frame_len; i += bytes_per_sample)
+        __voise_sample_encode(playback->format, buffer + i, 0);
+
+    return i;
+}
+
+/*! \brief Helper function. Give the ring space of the last frame back to the
+ * prefetch worker. Playback must be locked */
+static void __voise_tts_ring_release(struct voise_tts_playback *playback)
+{
+    if (playback->ring_pending == 0)
+        return;
+
+    playback->ring_head = (playback->ring_head + playback->ring_pending) % playback->ring_size;
+    playback->ring_count -= playback->ring_pending;
+    playback->ring_pending = 0;
+
+    ast_cond_broadcast(&playback->cond);
+}
+
+/*! \brief Helper function. Set up the next outbound frame of the prompt.
+ * The frame points straight into the cached audio or the ring when it can
+ * (it stays valid until the next call); only a frame that wraps around the
+ * ring, and filler, are built in the frame buffer
+ * \retval number of bytes, up to a frame (0 skips the frame)
+ * \retval -1 at the end of the prompt */
+static int __voise_tts_playback_next_frame(struct voise_tts_playback *playback, struct ast_frame *frame)
+{
+    unsigned char *buffer = playback->frame_buf + AST_FRIENDLY_OFFSET;
+    unsigned char *data = buffer;
+    size_t len;
+
+    if (playback->lead_in > 0)
+    {
+        len = __voise_tts_playback_fill(playback, buffer, VOISE_TTS_FILL_SILENCE);
+        playback->lead_in -= MIN(len, playback->lead_in);
+    }
+    else if (playback->cached != NULL)
+    {
+        struct voise_tts_audio *cached = playback->cached;
+
+        if (playback->cached_offset >= playback->cached_end)
+            return -1;
+
+        if (playback->first_audio_ms < 0)
+            playback->first_audio_ms = (int)ast_tvdiff_ms(ast_tvnow(), playback->created);
+
+        len = MIN(playback->frame_len, playback->cached_end - playback->cached_offset);
+
+        /* The cache entry is referenced for the whole playback */
+        if (len == playback->frame_len)
+            data = (unsigned char *)cached->data + playback->cached_offset;
+        else
+            len = __voise_tts_playback_pad(playback, buffer, cached->data + playback->cached_offset, len);
+
+        playback->cached_offset += MIN(playback->frame_len, playback->cached_end - playback->cached_offset);
+    }
+    else
+    {
+        ast_mutex_lock(&playback->lock);
+
+        __voise_tts_ring_release(playback);
+
+        /* Whole frames only, but for the end of the prompt */
+        if (playback->ring_count == 0 || (playback->ring_count < playback->frame_len && !playback->eof))
+        {
+            int eof = playback->eof;
+            int waiting_text = (playback->feed_index >= playback->num_segments && playback->open);
+
+            ast_mutex_unlock(&playback->lock);
+
+            if (eof)
+                return -1;
+
+            /* Playback starts with the first synthesized audio */
+            if (!playback->started)
+                return 0;
+
+            /* A stream waiting for its text is not late */
+            if (waiting_text)
+            {
+                len = __voise_tts_playback_fill(playback, buffer, VOISE_TTS_FILL_SILENCE);
+                goto frame;
+            }
+
+            /* Underrun: the synthesis is late, keep the prompt going */
+            playback->underruns++;
+
+            if (playback->verbose)
+                ast_log(LOG_DEBUG, "TTS underrun\n");
+
+            len = __voise_tts_playback_fill(playback, buffer, playback->fill);
+        }
+        else
+        {
+            playback->started = 1;
+
+            if (playback->first_audio_ms < 0)
+                playback->first_audio_ms = (int)ast_tvdiff_ms(ast_tvnow(), playback->created);
+
+            len = MIN(playback->frame_len, playback->ring_count);
+            size_t first = MIN(len, playback->ring_size - playback->ring_head);
+
+            if (first == len && len == playback->frame_len)
+            {
+                /* Released on the next frame, after it was written */
+                data = playback->ring + playback->ring_head;
+                playback->ring_pending = len;
+            }
+            else
+            {
+                memcpy(buffer, playback->ring + playback->ring_head, first);
+                memcpy(buffer + first, playback->ring, len - first);
+
+                playback->ring_head = (playback->ring_head + len) % playback->ring_size;
+                playback->ring_count -= len;
+
+                ast_cond_broadcast(&playback->cond);
+
+                /* The last frame is completed with silence */
+                len = __voise_tts_playback_pad(playback, buffer, buffer, len);
+            }
+
+            ast_mutex_unlock(&playback->lock);
+        }
+    }
+
+frame:
+    frame->data.ptr = data;
+    frame->offset = (data == buffer) ? AST_FRIENDLY_OFFSET : 0;
+    frame->datalen = (int)len;
+    frame->samples = (int)len / voise_get_bytes_per_sample(playback->format);
+
+    return (int)len;
+}
+
+/*! \brief Helper function. Cancel the synthesis of an interrupted prompt at once:
+ * the workers stop, and a synthesis no other playback shares is abandoned (its
+ * server connection is closed rather than given back to the pool) */
+static void __voise_tts_playback_cancel(struct voise_tts_playback *playback)
+{
+    ast_mutex_lock(&playback->lock);
+    playback->stop = 1;
+    ast_cond_broadcast(&playback->cond);
+    ast_mutex_unlock(&playback->lock);
+}
+
+/*! \brief Helper function. Stop the workers and free the playback. Segments
+ * synthesized to the end, played or not, go to the cache */
+static void __voise_tts_playback_destroy(struct voise_tts_playback *playback)
+{
+    int i;
+
+    __voise_tts_playback_cancel(playback);
+
+    if (playback->thread != AST_PTHREADT_NULL)
+        pthread_join(playback->thread, NULL);
+
+    if (playback->synth_thread != AST_PTHREADT_NULL)
+        pthread_join(playback->synth_thread, NULL);
+
+    for (i = 0; i < playback->num_segments; i++)
+    {
+        /* Joined, but the synthesis worker never got to it */
+        __voise_tts_inflight_leave(playback->segments[i].inflight);
+
+        __voise_tts_segment_release(&playback->segments[i]);
+
+        ast_free(playback->segments[i].text);
+        ast_free(playback->segments[i].key);
+    }
+
+    if (playback->cached != NULL)
+        ao2_ref(playback->cached->owner, -1);
+
+    ast_mutex_destroy(&playback->lock);
+    ast_cond_destroy(&playback->cond);
+
+    ast_free(playback->segments);
+    ast_free(playback->pending);
+    ast_free(playback->serverip);
+    ast_free(playback->lang);
+    ast_free(playback->ring);
+    ast_free(playback->xfade);
+    ast_free(playback);
+
+    __voise_stats_add(&voise_stats_module, VOISE_STAT_PLAYBACKS, -1);
+}
+
+/*! \brief Helper function. Milliseconds of silence trimmed from a prompt so far */
+static size_t __voise_tts_playback_trimmed_ms(struct voise_tts_playback *playback)
+{
+    ast_mutex_lock(&playback->lock);
+    size_t trimmed = playback->trimmed;
+    ast_mutex_unlock(&playback->lock);
+
+    return trimmed / (playback->frame_len / ast_format_get_default_ms(playback->format));
+}
+
+/*! \brief Helper function. Parse the underrun_fill setting */
+static enum voise_tts_underrun_fill __voise_tts_parse_fill(const char *value)
+{
+    if (!strcasecmp(value, "none"))
+        return VOISE_TTS_FILL_NONE;
+    if (!strcasecmp(value, "noise"))
+        return VOISE_TTS_FILL_NOISE;
+
+    return VOISE_TTS_FILL_SILENCE;
+}
+
+/*! \brief Helper function. Create the playback of a prompt with the settings of
+ * voise.conf, and start its synthesis (unless it is cached) */
+static struct voise_tts_playback* __voise_tts_playback_create(struct ast_config *vcfg, struct ast_format *format,
+    const char *text, const char *lang, int template, int stream, int verbose)
+{
+    /* Server IP */
+    const char *vserverip;
+    if ( !(vserverip = ast_variable_retrieve(vcfg, "general", "serverip")) )
+        vserverip = VOISE_DEF_HOST;
+
+    /* A cached prompt is played straight from memory (or the disk mapping),
+     * without a server connection. A template or a stream is only cached by
+     * segments */
+    char *cache_key = (template || stream) ? NULL : __voise_tts_cache_key(text, lang, format);
+
+    struct voise_tts_audio cached_audio;
+    struct voise_tts_audio *cached = NULL;
+
+    if (cache_key != NULL && __voise_tts_lookup_prompt(cache_key, text, lang, format, &cached_audio, 1) == 0)
+        cached = &cached_audio;
+
+    if (verbose)
+        ast_log(LOG_DEBUG, "TTS cache %s\n", cached ? "hit" : "miss");
+
+    ast_free(cache_key);
+
+    /* Read-ahead of the synthesis */
+    const char *vprefetch;
+    if ( !(vprefetch = ast_variable_retrieve(vcfg, "tts", "prefetch_ms")) )
+        vprefetch = VOISE_DEF_TTS_PREFETCH_MS;
+
+    const char *vfill;
+    if ( !(vfill = ast_variable_retrieve(vcfg, "tts", "underrun_fill")) )
+        vfill = VOISE_DEF_TTS_UNDERRUN_FILL;
+
+    /* Long texts are synthesized sentence by sentence */
+    const char *vsegmentmax;
+    if ( !(vsegmentmax = ast_variable_retrieve(vcfg, "tts", "segment_max_chars")) )
+        vsegmentmax = VOISE_DEF_TTS_SEGMENT_MAX_CHARS;
+
+    const char *vlookahead;
+    if ( !(vlookahead = ast_variable_retrieve(vcfg, "tts", "lookahead")) )
+        vlookahead = VOISE_DEF_TTS_LOOKAHEAD;
+
+    const char *vcrossfade;
+    if ( !(vcrossfade = ast_variable_retrieve(vcfg, "tts", "crossfade_ms")) )
+        vcrossfade = VOISE_DEF_TTS_CROSSFADE_MS;
+
+    const char *vleadin;
+    if ( !(vleadin = ast_variable_retrieve(vcfg, "tts", "lead_in_ms")) )
+        vleadin = VOISE_DEF_TTS_LEAD_IN_MS;
+
+    /* Silence around the speech */
+    const char *vtrimthreshold;
+    if ( !(vtrimthreshold = ast_variable_retrieve(vcfg, "tts", "trim_threshold")) )
+        vtrimthreshold = VOISE_DEF_TTS_TRIM_THRESHOLD;
+
+    const char *vtrimguard;
+    if ( !(vtrimguard = ast_variable_retrieve(vcfg, "tts", "trim_guard_ms")) )
+        vtrimguard = VOISE_DEF_TTS_TRIM_GUARD_MS;
+
+    struct voise_tts_synth_options synth_options = {
+        .segment_max_chars = atoi(vsegmentmax),
+        .lookahead = atoi(vlookahead),
+        .template = template && !stream,
+        .crossfade_ms = atoi(vcrossfade),
+        .stream = stream,
+    };
+
+    struct voise_tts_playback *playback = __voise_tts_playback_alloc(format, cached,
+        atoi(vprefetch), __voise_tts_parse_fill(vfill), verbose);
+
+    if (playback == NULL)
+    {
+        if (cached != NULL)
+            ao2_ref(cached->owner, -1);
+
+        return NULL;
+    }
+
+    size_t bytes_per_ms = playback->frame_len / ast_format_get_default_ms(format);
+
+    /* Optional silence before the prompt, for channels that clip its start */
+    playback->lead_in = (size_t)MAX(atoi(vleadin), 0) * bytes_per_ms;
+
+    playback->trim_threshold = MAX(atoi(vtrimthreshold), 0);
+    playback->trim_guard = (size_t)MAX(atoi(vtrimguard), 0) * bytes_per_ms;
+    playback->trim_lead = (playback->trim_threshold > 0);
+
+    /* A cached prompt is trimmed at both ends at once */
+    if (cached != NULL && playback->trim_threshold > 0)
+    {
+        const unsigned char *data = playback->cached->data;
+        size_t len = playback->cached->len;
+        size_t start = __voise_tts_speech_start(format, data, len, playback->trim_threshold);
+        size_t end = __voise_tts_speech_end(format, data, len, playback->trim_threshold);
+
+        if (end > start)
+        {
+            int bytes_per_sample = voise_get_bytes_per_sample(format);
+
+            playback->cached_offset = (start > playback->trim_guard ? start - playback->trim_guard : 0) / bytes_per_sample * bytes_per_sample;
+            playback->cached_end = MIN(len, end + playback->trim_guard);
+            playback->trimmed = playback->cached_offset + (len - playback->cached_end);
+        }
+    }
+
+    if (cached == NULL && __voise_tts_playback_start(playback, vserverip, text, lang, &synth_options) < 0)
+    {
+        __voise_tts_playback_destroy(playback);
+        return NULL;
+    }
+
+    return playback;
+}
+
+
+/*! \brief Helper function. Time the dequeue of a frame on many playbacks at once.
+ * With from_ring, every frame also goes through the ring, as the prefetch worker does */
+static int64_t __voise_tts_bench(int num_playbacks, int num_frames, int from_ring, struct voise_tts_entry *entry)
+{
+    struct voise_tts_playback **playbacks = ast_calloc(num_playbacks, sizeof(*playbacks));
+    struct ast_frame frame = { .frametype = AST_FRAME_VOICE, };
+    int64_t elapsed = -1;
+    int i;
+    int n;
+
+    if (playbacks == NULL)
+        return -1;
+
+    for (i = 0; i < num_playbacks; i++)
+    {
+        struct voise_tts_audio audio = { entry->audio, entry->len, entry };
+
+        if (!from_ring)
+            ao2_ref(entry, +1);
+
+        if ( !(playbacks[i] = __voise_tts_playback_alloc(ast_format_ulaw, from_ring ? NULL : &audio,
+            0, VOISE_TTS_FILL_SILENCE, 0)) )
+        {
+            if (!from_ring)
+                ao2_ref(entry, -1);
+            goto cleanup;
+        }
+    }
+
+    struct timeval start = ast_tvnow();
+
+    for (n = 0; n < num_frames; n++)
+    {
+        for (i = 0; i < num_playbacks; i++)
+        {
+            struct voise_tts_playback *playback = playbacks[i];
+
+            if (from_ring)
+            {
+                ast_mutex_lock(&playback->lock);
+                __voise_tts_ring_write(playback, entry->audio + n * playback->frame_len, playback->frame_len);
+                ast_mutex_unlock(&playback->lock);
+            }
+
+            __voise_tts_playback_next_frame(playback, &frame);
+        }
+    }
+
+    elapsed = ast_tvdiff_us(ast_tvnow(), start);
+
+cleanup:
+    for (i = 0; i < num_playbacks && playbacks[i]; i++)
+        __voise_tts_playback_destroy(playbacks[i]);
+
+    ast_free(playbacks);
+
+    return elapsed;
+}
+
+static char* handle_cli_voise_bench_tts(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise bench tts";
+        e->usage =
+            "Usage: voise bench tts [playbacks [frames]]\n"
+            "       Measure the cost of producing a VoiseSay frame with many concurrent\n"
+            "       playbacks (default 1000 playbacks of 500 ulaw frames), from the\n"
+            "       cache and through the prefetch ring. No channel or server is used.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc > 5)
+        return CLI_SHOWUSAGE;
+
+    int num_playbacks = (a->argc > 3) ? atoi(a->argv[3]) : 1000;
+    int num_frames = (a->argc > 4) ? atoi(a->argv[4]) : 500;
+
+    if (num_playbacks <= 0 || num_frames <= 0)
+        return CLI_SHOWUSAGE;
+
+    /* Prompt of num_frames 20 ms ulaw frames */
+    struct voise_tts_entry *entry = ao2_alloc(sizeof(*entry), __voise_tts_entry_destructor);
+
+    if (entry == NULL)
+        return CLI_FAILURE;
+
+    entry->len = (size_t)num_frames * 160;
+
+    if ( !(entry->audio = ast_malloc(entry->len)) )
+    {
+        ao2_ref(entry, -1);
+        return CLI_FAILURE;
+    }
+
+    memset(entry->audio, AST_LIN2MU(0), entry->len);
+
+    ast_cli(a->fd, "%d playbacks x %d frames (%d ms of audio each)\n", num_playbacks, num_frames, num_frames * 20);
+
+    int from_ring;
+
+    for (from_ring = 0; from_ring <= 1; from_ring++)
+    {
+        int64_t elapsed = __voise_tts_bench(num_playbacks, num_frames, from_ring, entry);
+
+        if (elapsed < 0)
+        {
+            ast_cli(a->fd, "Out of memory\n");
+            break;
+        }
+
+        double ns_per_frame = 1000.0 * elapsed / ((double)num_playbacks * num_frames);
+
+        /* A playback produces a frame every 20 ms */
+        ast_cli(a->fd, "%-6s %8.1f ns/frame, %5.2f%% of a CPU for %d live playbacks\n",
+            from_ring ? "Ring:" : "Cache:", ns_per_frame, ns_per_frame * num_playbacks / 20000000.0 * 100.0, num_playbacks);
+    }
+
+    ao2_ref(entry, -1);
+
+    return CLI_SUCCESS;
+}
+
+static void __voise_show_stats_row(int fd, const char *server, const int64_t *counters)
+{
+    ast_cli(fd, "%-20s %6" PRId64 " %6" PRId64 " %8" PRId64 " %12" PRId64 " %12" PRId64 "\n", server,
+        counters[VOISE_STAT_CONNS_OPEN], counters[VOISE_STAT_CONNS_POOLED], counters[VOISE_STAT_SYNTHS],
+        counters[VOISE_STAT_BYTES_SENT], counters[VOISE_STAT_BYTES_RECEIVED]);
+}
+
+static char* handle_cli_voise_show_tts_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show tts stats";
+        e->usage =
+            "Usage: voise show tts stats\n"
+            "       Show the counters of the applications: active playbacks, TTS cache\n"
+            "       hit ratio and, for each server, open and pooled connections,\n"
+            "       syntheses, and bytes sent and received. The recognitions of\n"
+            "       VoiseAsk are counted by the speech engine, see 'voise show stats'.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_mutex_lock(&voise_tts_cache_lock);
+    unsigned int hits = voise_tts_cache_info.hits;
+    unsigned int lookups = voise_tts_cache_info.hits + voise_tts_cache_info.misses;
+    ast_mutex_unlock(&voise_tts_cache_lock);
+
+    int disk_lookups = voise_tts_disk_info.hits + voise_tts_disk_info.misses;
+
+    ast_cli(a->fd, "Active playbacks: %" PRId64 "\n", __voise_stats_get(&voise_stats_module, VOISE_STAT_PLAYBACKS));
+    ast_cli(a->fd, "Cache hit ratio:  %.1f%% (%u lookups)\n", lookups ? 100.0 * hits / lookups : 0.0, lookups);
+    ast_cli(a->fd, "Disk hit ratio:   %.1f%% (%d lookups)\n",
+        disk_lookups ? 100.0 * voise_tts_disk_info.hits / disk_lookups : 0.0, disk_lookups);
+    ast_cli(a->fd, "\n");
+
+    struct voise_stats *stats;
+    int64_t total[VOISE_STAT_MAX] = { 0 };
+    int64_t counters[VOISE_STAT_MAX];
+    int i;
+
+    ast_cli(a->fd, "%-20s %6s %6s %8s %12s %12s\n", "Server", "Conns", "Pooled", "Synths", "Sent", "Received");
+
+    AST_RWLIST_RDLOCK(&voise_stats_servers);
+
+    AST_RWLIST_TRAVERSE(&voise_stats_servers, stats, list)
+    {
+        for (i = 0; i < VOISE_STAT_MAX; ++i)
+        {
+            counters[i] = __voise_stats_get(stats, i);
+            total[i] += counters[i];
+        }
+
+        __voise_show_stats_row(a->fd, stats->server, counters);
+    }
+
+    AST_RWLIST_UNLOCK(&voise_stats_servers);
+
+    __voise_show_stats_row(a->fd, "Total", total);
+
+    return CLI_SUCCESS;
+}
+
+/*! \brief Helper function. Show the latency histograms, in milliseconds */
+static void __voise_show_latency(int fd)
+{
+    uint64_t buckets[VOISE_HIST_BUCKETS];
+    int i, j;
+
+    ast_cli(fd, "%-18s %10s %10s %10s %10s %10s %10s %10s\n", "Phase", "Count", "Mean", "p50", "p90", "p99", "p999", "Max");
+
+    for (i = 0; i < VOISE_HIST_MAX; ++i)
+    {
+        struct voise_histogram *h = &voise_histograms[i];
+        uint64_t count = 0;
+
+        for (j = 0; j < VOISE_HIST_BUCKETS; ++j)
+        {
+            buckets[j] = __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+            count += buckets[j];
+        }
+
+        uint64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+        ast_cli(fd, "%-18s %10" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", voise_hist_names[i], count,
+            count ? sum / 1000.0 / count : 0.0,
+            __voise_hist_percentile(buckets, count, 50) / 1000.0,
+            __voise_hist_percentile(buckets, count, 90) / 1000.0,
+            __voise_hist_percentile(buckets, count, 99) / 1000.0,
+            __voise_hist_percentile(buckets, count, 99.9) / 1000.0,
+            max / 1000.0);
+    }
+}
+
+static char* handle_cli_voise_show_tts_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show tts latency";
+        e->usage =
+            "Usage: voise show tts latency\n"
+            "       Show the latency percentiles (in milliseconds) of the applications:\n"
+            "       connection, synthesis start, first audio and each server read.\n"
+            "       The recognitions of VoiseAsk are in 'voise show latency'.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    __voise_show_latency(a->fd);
+
+    return CLI_SUCCESS;
+}
+
+static char* handle_cli_voise_reset_tts_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise reset tts latency";
+        e->usage =
+            "Usage: voise reset tts latency\n"
+            "       Clear the latency histograms of the applications.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    int i, j;
+
+    /* Latencies recorded meanwhile may be half cleared: good enough for a reset */
+    for (i = 0; i < VOISE_HIST_MAX; ++i)
+    {
+        struct voise_histogram *h = &voise_histograms[i];
+
+        for (j = 0; j < VOISE_HIST_BUCKETS; ++j)
+            __atomic_store_n(&h->buckets[j], 0, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+    }
+
+    ast_cli(a->fd, "Latency histograms cleared\n");
+
+    return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry voise_cli[] = {
+    AST_CLI_DEFINE(handle_cli_voise_show_tts_cache, "Show Voise TTS cache"),
+    AST_CLI_DEFINE(handle_cli_voise_show_tts_disk, "Show Voise TTS disk cache"),
+    AST_CLI_DEFINE(handle_cli_voise_tts_catalog_load, "Pre-synthesize a Voise TTS catalog"),
+    AST_CLI_DEFINE(handle_cli_voise_show_tts_catalog, "Show Voise TTS catalog progress"),
+    AST_CLI_DEFINE(handle_cli_voise_tts_render, "Render Voise TTS prompts into sound files"),
+    AST_CLI_DEFINE(handle_cli_voise_show_tts_render, "Show Voise TTS render progress"),
+    AST_CLI_DEFINE(handle_cli_voise_bench_tts, "Benchmark Voise TTS frame production"),
+    AST_CLI_DEFINE(handle_cli_voise_show_tts_stats, "Show Voise application counters"),
+    AST_CLI_DEFINE(handle_cli_voise_show_tts_latency, "Show Voise application latencies"),
+    AST_CLI_DEFINE(handle_cli_voise_reset_tts_latency, "Clear Voise application latencies"),
+};
+
+/*! \brief Helper function. Whether the caller has spoken for min_ms, on an inbound frame.
+ * The return of ast_dsp_noise() is not the answer: it is 1 on a silent frame, which
+ * also resets the noise counted so far
+ * \param noise_ms set to the ms of speech so far, if not NULL */
+static int __voise_speech_detected(struct ast_dsp *dsp, struct ast_frame *f, int min_ms, int *noise_ms)
+{
+    int totalnoise = 0;
+
+    ast_dsp_noise(dsp, f, &totalnoise);
+
+    if (noise_ms != NULL)
+        *noise_ms = totalnoise;
+
+    return totalnoise > 0 && totalnoise >= min_ms;
+}
+
+/*! \brief Text to speech application. */
+static int voise_say_exec(struct ast_channel *chan, const char* data)
+{
+    TRACE_FUNCTION();
+
+    struct ast_module_user *u;
+    char *parse;
+
+    int option_verbose = 0;
+    int option_beep = 0;
+    int option_no_hangup_on_err = 0;
+    int option_template = 0;
+
+    AST_DECLARE_APP_ARGS(args,
+        AST_APP_ARG(text);
+        AST_APP_ARG(lang);
+        AST_APP_ARG(options);
+    );
+
+    if (ast_strlen_zero(data))
+    {
+        ast_log(LOG_ERROR, "%s requires an argument (text[,lang][,options])\n", voise_say_app);
+        return -1;
+    }
+
+    /* We need to make a copy of the input string if we are going to modify it! */
+    parse = ast_strdupa(data);
+    AST_STANDARD_APP_ARGS(args, parse);
+
+    if (ast_strlen_zero(args.text))
+    {
+        ast_log(LOG_WARNING, "%s() requires a text argument (text[,lang][,options])\n", voise_say_app);
+        return -1;
+    }
+
+    struct ast_flags flags = { 0 };
+    char *opt_args[VOISE_SAY_OPT_ARG_ARRAY_SIZE] = { NULL };
+
+    if (!ast_strlen_zero(args.options) &&
+        ast_app_parse_options(voise_say_options, &flags, opt_args, args.options))
+    {
+        ast_log(LOG_WARNING, "%s: invalid options '%s'\n", voise_say_app, args.options);
+        return -1;
+    }
+
+    option_verbose = ast_test_flag(&flags, VOISE_SAY_OPT_VERBOSE) ? 1 : 0;
+    option_beep = ast_test_flag(&flags, VOISE_SAY_OPT_BEEP) ? 1 : 0;
+    option_no_hangup_on_err = ast_test_flag(&flags, VOISE_SAY_OPT_NO_HANGUP) ? 1 : 0;
+    option_template = ast_test_flag(&flags, VOISE_SAY_OPT_TEMPLATE) ? 1 : 0;
+
+    const char *escape_digits = NULL;
+    if (ast_test_flag(&flags, VOISE_SAY_OPT_ESCAPE) && !ast_strlen_zero(opt_args[VOISE_SAY_OPT_ARG_ESCAPE]))
+        escape_digits = opt_args[VOISE_SAY_OPT_ARG_ESCAPE];
+
+    /* Load default options */
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    if (!vcfg)
+    {
+        ast_log(LOG_ERROR, "Error opening configuration file %s\n", VOISE_CFG);
+        return -1;
+    }
+
+    /* If language is not defined, get default lang */
+    if (ast_strlen_zero(args.lang))
+    {
+        if ( !(args.lang = (char*) ast_variable_retrieve(vcfg, "general", "lang")))
+            args.lang = (char*) VOISE_DEF_LANG;
+    }
+
+    /* If verbosity is not defined, get default verbosity */
+    if (!option_verbose)
+    {
+        const char *vverbose;
+        if ( !(vverbose = ast_variable_retrieve(vcfg, "debug", "verbose")))
+            vverbose = VOISE_DEF_VERBOSE;
+
+        option_verbose = atoi(vverbose);
+    }
+
+    u = ast_module_user_add(chan);
+
+    struct ast_format *new_writeformat = ast_channel_get_speechwriteformat(chan);
+
+    int max_frame_ms = ast_format_get_default_ms(new_writeformat);
+    // Eg: Alaw: 20 (default_ms) / 10 (get_minimum_ms) * 80 (minimum_bytes) = 160;
+    int max_frame_len = max_frame_ms / ast_format_get_minimum_ms(new_writeformat) * ast_format_get_minimum_bytes(new_writeformat);
+
+    if (option_verbose)
+        ast_log(LOG_DEBUG, "Format name: %s, Max frame len: %d\n", ast_format_get_name(new_writeformat), max_frame_len);
+
+    /* Set channel format */
+    ast_channel_set_writeformat(chan, new_writeformat);
+
+    int cdr_latency = __voise_cdr_latency(vcfg);
+
+    const char *vbargethreshold;
+    if ( !(vbargethreshold = ast_variable_retrieve(vcfg, "tts", "barge_threshold")) )
+        vbargethreshold = VOISE_DEF_TTS_BARGE_THRESHOLD;
+
+    const char *vbargeminms;
+    if ( !(vbargeminms = ast_variable_retrieve(vcfg, "tts", "barge_min_ms")) )
+        vbargeminms = VOISE_DEF_TTS_BARGE_MIN_MS;
+
+    int barge_threshold = atoi(vbargethreshold);
+    const char *barge_min_default = ast_strdupa(vbargeminms);
+
+    /* The synthesis starts right away, and is read ahead while the channel
+     * is answered and the beep plays */
+    struct voise_tts_playback *playback = __voise_tts_playback_create(vcfg, new_writeformat,
+        args.text, args.lang, option_template, 0, option_verbose);
+
+    if (playback == NULL)
+    {
+        ast_module_user_remove(u);
+        ast_config_destroy(vcfg);
+
+        return -1;
+    }
+
+    ast_config_destroy(vcfg);
+
+    /* Answer if it's not already going. */
+    if (ast_channel_state(chan) != AST_STATE_UP)
+        ast_answer(chan);
+
+    /* Ensure no streams are currently running.. */
+    ast_stopstream(chan);
+
+    if (option_beep)
+    {
+        int res = ast_streamfile(chan, "beep", ast_channel_language(chan));
+
+        if (!res)
+            res = ast_waitstream(chan, "");
+        else
+            ast_log(LOG_WARNING, "ast_streamfile failed on %s\n", ast_channel_name(chan));
+
+        ast_stopstream(chan);
+    }
+
+    /* Speech barge-in: inbound audio is watched for energy */
+    struct ast_dsp *dsp = NULL;
+    struct ast_format *old_readformat = NULL;
+    int barge_min_ms = 0;
+
+    if (ast_test_flag(&flags, VOISE_SAY_OPT_BARGE))
+    {
+        barge_min_ms = atoi(S_OR(opt_args[VOISE_SAY_OPT_ARG_BARGE], barge_min_default));
+
+        old_readformat = ao2_bump(ast_channel_readformat(chan));
+
+        if (ast_set_read_format(chan, ast_format_slin) < 0 || !(dsp = ast_dsp_new()))
+        {
+            ast_log(LOG_WARNING, "Speech barge-in not available on %s\n", ast_channel_name(chan));
+        }
+        else
+        {
+            ast_dsp_set_threshold(dsp, barge_threshold);
+        }
+    }
+
+    /* Playback is paced by a timer at the packetization interval of the
+     * format, not by inbound frames. Without a timing module, by the clock */
+    int frame_ms = ast_format_get_default_ms(new_writeformat);
+
+    struct ast_timer *timer = ast_timer_open();
+    int timer_fd = -1;
+
+    if (timer != NULL)
+    {
+        timer_fd = ast_timer_fd(timer);
+
+        if (ast_timer_set_rate(timer, 1000 / frame_ms) < 0)
+        {
+            ast_log(LOG_WARNING, "Could not set timer rate, pacing by the clock\n");
+
+            ast_timer_close(timer);
+            timer = NULL;
+            timer_fd = -1;
+        }
+    }
+
+    /* Outbound frames are our own; their data belongs to the playback */
+    struct ast_frame frame = {
+        .frametype = AST_FRAME_VOICE,
+        .src = voise_say_app,
+    };
+    frame.subclass.format = new_writeformat;
+
+    struct timeval next_frame = ast_tvnow();
+
+    int result = 0;
+    int done = 0;
+
+    /* Interruption */
+    const char *interrupt_cause = "NONE";
+    char interrupt_digit[2] = "";
+    unsigned int played_samples = 0;
+
+    while (!done)
+    {
+        int ms = MAX_WAIT_TIME;
+
+        if (timer == NULL)
+            ms = MAX(0, (int)ast_tvdiff_ms(next_frame, ast_tvnow()));
+
+        int outfd = -1;
+        struct ast_channel *ready = ast_waitfor_nandfds(&chan, 1, &timer_fd, timer ? 1 : 0, NULL, &outfd, &ms);
+
+        if (ready == NULL && outfd < 0 && ms < 0)
+        {
+            ast_log(LOG_ERROR, "Wait failed.\n");
+
+            result = -1;
+            break;
+        }
+
+        if (ready != NULL)
+        {
+            /* Inbound media is only watched for hangup and barge-in */
+            struct ast_frame *f = ast_read(chan);
+
+            /* Hangup detection */
+            if (!f)
+            {
+                ast_log(LOG_DEBUG, "Hangup detected.\n");
+
+                interrupt_cause = "HANGUP";
+                result = -1;
+                break;
+            }
+
+            if (f->frametype == AST_FRAME_DTMF_END && escape_digits && strchr(escape_digits, f->subclass.integer))
+            {
+                interrupt_cause = "DTMF";
+                interrupt_digit[0] = (char)f->subclass.integer;
+                done = 1;
+            }
+            else if (f->frametype == AST_FRAME_VOICE && dsp != NULL)
+            {
+                if (__voise_speech_detected(dsp, f, barge_min_ms, NULL))
+                {
+                    interrupt_cause = "SPEECH";
+                    done = 1;
+                }
+            }
+
+            ast_frfree(f);
+            continue;
+        }
+
+        if (timer != NULL)
+        {
+            if (outfd < 0)
+                continue;
+
+            ast_timer_ack(timer, 1);
+        }
+        else
+        {
+            if (ms > 0)
+                continue;
+
+            next_frame = ast_tvadd(next_frame, ast_samp2tv(frame_ms, 1000));
+        }
+
+        int audio_len = __voise_tts_playback_next_frame(playback, &frame);
+
+        if (audio_len < 0)
+        {
+            done = 1;
+        }
+        else if (audio_len > 0)
+        {
+            if (ast_write(chan, &frame) < 0)
+                ast_log(LOG_ERROR, "Error writing frame to chan.\n");
+
+            played_samples += frame.samples;
+        }
+    }
+
+    if (timer != NULL)
+        ast_timer_close(timer);
+
+    if (strcmp(interrupt_cause, "NONE"))
+    {
+        if (option_verbose)
+            ast_log(LOG_DEBUG, "Prompt interrupted by %s\n", interrupt_cause);
+
+        __voise_tts_playback_cancel(playback);
+    }
+
+    if (dsp != NULL)
+        ast_dsp_free(dsp);
+
+    if (old_readformat != NULL)
+    {
+        ast_set_read_format(chan, old_readformat);
+        ao2_ref(old_readformat, -1);
+    }
+
+    char offset[16];
+    snprintf(offset, sizeof(offset), "%llu", (unsigned long long)played_samples * 1000 / ast_format_get_sample_rate(new_writeformat));
+
+    pbx_builtin_setvar_helper(chan, "VOISE_INTERRUPT_CAUSE", interrupt_cause);
+    pbx_builtin_setvar_helper(chan, "VOISE_INTERRUPT_DIGIT", interrupt_digit);
+    pbx_builtin_setvar_helper(chan, "VOISE_INTERRUPT_OFFSET", offset);
+
+    if (playback->underruns > 0)
+        ast_log(LOG_NOTICE, "VoiseSay on %s: %d underruns\n", ast_channel_name(chan), playback->underruns);
+
+    char underruns[16];
+    snprintf(underruns, sizeof(underruns), "%d", playback->underruns);
+    pbx_builtin_setvar_helper(chan, "VOISE_TTS_UNDERRUNS", underruns);
+
+    char trimmed[16];
+    snprintf(trimmed, sizeof(trimmed), "%zu", __voise_tts_playback_trimmed_ms(playback));
+    pbx_builtin_setvar_helper(chan, "VOISE_TTS_TRIMMED_MS", trimmed);
+
+    __voise_set_call_latency(chan, "VOISE_TTS_FIRST_AUDIO_MS", playback->first_audio_ms, cdr_latency);
+
+    if (option_verbose)
+        ast_log(LOG_DEBUG, "Silence trimmed: %s ms\n", trimmed);
+
+    __voise_tts_playback_destroy(playback);
+
+    ast_stopstream(chan);
+    ast_module_user_remove(u);
+
+    return result;
+}
+
+/* ********************************* */
+/* ******** VoiseBackground ******** */
+/* ********************************* */
+
+enum voise_background_state
+{
+    VOISE_BACKGROUND_PLAYING = 0,
+    VOISE_BACKGROUND_DONE,
+    VOISE_BACKGROUND_STOPPED,
+};
+
+/* Prompt played by VoiseBackground, as a generator of its channel. Referenced
+ * by the channel datastore and by the generator */
+struct voise_background
+{
+    struct voise_tts_playback *playback;
+    struct ast_frame frame;
+
+    /* Protected by the object lock */
+    enum voise_background_state state;
+    int eof;
+    unsigned int played_samples;
+    unsigned int rate;
+};
+
+static void __voise_background_destructor(void *obj)
+{
+    struct voise_background *background = obj;
+
+    if (background->playback)
+        __voise_tts_playback_destroy(background->playback);
+
+    ast_module_unref(ast_module_info->self);
+}
+
+static void __voise_background_datastore_destroy(void *data)
+{
+    ao2_cleanup(data);
+}
+
+static const struct ast_datastore_info voise_background_datastore = {
+    .type = "voise_background",
+    .destroy = __voise_background_datastore_destroy,
+};
+
+static void* __voise_background_gen_alloc(struct ast_channel *chan, void *params)
+{
+    ao2_ref(params, +1);
+    return params;
+}
+
+static void __voise_background_gen_release(struct ast_channel *chan, void *data)
+{
+    struct voise_background *background = data;
+
+    ao2_lock(background);
+    background->state = background->eof ? VOISE_BACKGROUND_DONE : VOISE_BACKGROUND_STOPPED;
+    ao2_unlock(background);
+
+    /* Cancel the synthesis of a prompt stopped half way */
+    __voise_tts_playback_cancel(background->playback);
+
+    ao2_ref(background, -1);
+}
+
+static int __voise_background_gen_generate(struct ast_channel *chan, void *data, int len, int samples)
+{
+    struct voise_background *background = data;
+
+    int audio_len = __voise_tts_playback_next_frame(background->playback, &background->frame);
+
+    if (audio_len < 0)
+    {
+        ao2_lock(background);
+        background->eof = 1;
+        ao2_unlock(background);
+
+        /* Ends the generator */
+        return -1;
+    }
+
+    if (audio_len == 0)
+        return 0;
+
+    if (ast_write(chan, &background->frame) < 0)
+    {
+        ast_log(LOG_WARNING, "Error writing frame to %s\n", ast_channel_name(chan));
+        return -1;
+    }
+
+    ao2_lock(background);
+    background->played_samples += background->frame.samples;
+    ao2_unlock(background);
+
+    return 0;
+}
+
+static struct ast_generator voise_background_generator = {
+    .alloc = __voise_background_gen_alloc,
+    .release = __voise_background_gen_release,
+    .generate = __voise_background_gen_generate,
+};
+
+/*! \brief Helper function. Find the background prompt of a channel. Returns a new reference or NULL */
+static struct voise_background* __voise_background_find(struct ast_channel *chan)
+{
+    struct voise_background *background = NULL;
+
+    ast_channel_lock(chan);
+
+    struct ast_datastore *datastore = ast_channel_datastore_find(chan, &voise_background_datastore, NULL);
+
+    if (datastore)
+        background = ao2_bump(datastore->data);
+
+    ast_channel_unlock(chan);
+
+    return background;
+}
+
+/*! \brief Helper function. Stop the background prompt of a channel, if it is playing */
+static void __voise_background_stop(struct ast_channel *chan)
+{
+    struct voise_background *background = __voise_background_find(chan);
+
+    if (background == NULL)
+        return;
+
+    ast_channel_lock(chan);
+
+    if (ast_channel_generatordata(chan) == background)
+    {
+        ast_channel_unlock(chan);
+        ast_deactivate_generator(chan);
+    }
+    else
+    {
+        ast_channel_unlock(chan);
+    }
+
+    ao2_ref(background, -1);
+}
+
+static const char* __voise_background_state_str(struct voise_background *background)
+{
+    if (background == NULL)
+        return "NONE";
+
+    switch (background->state)
+    {
+    case VOISE_BACKGROUND_PLAYING:
+        return "PLAYING";
+    case VOISE_BACKGROUND_DONE:
+        return "DONE";
+    case VOISE_BACKGROUND_STOPPED:
+    default:
+        return "STOPPED";
+    }
+}
+
+static int __voise_background_playing(void *data)
+{
+    struct voise_background *background = data;
+
+    ao2_lock(background);
+    int playing = (background->state == VOISE_BACKGROUND_PLAYING);
+    ao2_unlock(background);
+
+    /* ast_safe_sleep_conditional() goes on while this is true */
+    return playing;
+}
+
+/*! \brief VOISE_BACKGROUND(action[,timeout]) */
+static int voise_background_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+    AST_DECLARE_APP_ARGS(args,
+        AST_APP_ARG(action);
+        AST_APP_ARG(timeout);
+    );
+
+    if (!chan)
+    {
+        ast_log(LOG_WARNING, "%s requires a channel\n", cmd);
+        return -1;
+    }
+
+    AST_STANDARD_APP_ARGS(args, data);
+
+    if (ast_strlen_zero(args.action))
+    {
+        ast_log(LOG_WARNING, "%s requires an action (status, position, trimmed, wait or stop)\n", cmd);
+        return -1;
+    }
+
+    if (!strcasecmp(args.action, "stop"))
+    {
+        __voise_background_stop(chan);
+    }
+    else if (!strcasecmp(args.action, "wait"))
+    {
+        struct voise_background *background = __voise_background_find(chan);
+
+        if (background != NULL)
+        {
+            /* Reading the channel is what drives the generator */
+            int timeout = ast_strlen_zero(args.timeout) ? 0 : atoi(args.timeout) * 1000;
+
+            ast_safe_sleep_conditional(chan, timeout > 0 ? timeout : INT_MAX, __voise_background_playing, background);
+
+            ao2_ref(background, -1);
+        }
+    }
+    else if (strcasecmp(args.action, "status") && strcasecmp(args.action, "position") && strcasecmp(args.action, "trimmed"))
+    {
+        ast_log(LOG_WARNING, "%s: unknown action '%s'\n", cmd, args.action);
+        return -1;
+    }
+
+    struct voise_background *background = __voise_background_find(chan);
+
+    if (background)
+        ao2_lock(background);
+
+    if (!strcasecmp(args.action, "position"))
+        snprintf(buf, len, "%llu", background ? (unsigned long long)background->played_samples * 1000 / background->rate : 0);
+    else if (!strcasecmp(args.action, "trimmed"))
+        snprintf(buf, len, "%zu", background ? __voise_tts_playback_trimmed_ms(background->playback) : 0);
+    else
+        ast_copy_string(buf, __voise_background_state_str(background), len);
+
+    if (background)
+    {
+        ao2_unlock(background);
+        ao2_ref(background, -1);
+    }
+
+    return 0;
+}
+
+/*! \brief VOISE_BACKGROUND(append|end)=text */
+static int voise_background_write(struct ast_channel *chan, const char *cmd, char *data, const char *value)
+{
+    if (!chan)
+    {
+        ast_log(LOG_WARNING, "%s requires a channel\n", cmd);
+        return -1;
+    }
+
+    int last;
+
+    if (!strcasecmp(data, "append"))
+        last = 0;
+    else if (!strcasecmp(data, "end"))
+        last = 1;
+    else
+    {
+        ast_log(LOG_WARNING, "%s: unknown action '%s' (append or end)\n", cmd, data);
+        return -1;
+    }
+
+    struct voise_background *background = __voise_background_find(chan);
+
+    if (background == NULL)
+    {
+        ast_log(LOG_WARNING, "%s: no background prompt on %s\n", cmd, ast_channel_name(chan));
+        return -1;
+    }
+
+    int ret = __voise_tts_playback_append(background->playback, S_OR(value, ""), last);
+
+    if (ret < 0)
+        ast_log(LOG_WARNING, "%s: text not added to the prompt of %s (not streamed, or over)\n", cmd, ast_channel_name(chan));
+
+    ao2_ref(background, -1);
+
+    return ret;
+}
+
+static struct ast_custom_function voise_background_function = {
+    .name = "VOISE_BACKGROUND",
+    .read = voise_background_read,
+    .write = voise_background_write,
+};
+
+/*! \brief Text to speech in the background. */
+static int voise_background_exec(struct ast_channel *chan, const char* data)
+{
+    TRACE_FUNCTION();
+
+    char *parse;
+
+    AST_DECLARE_APP_ARGS(args,
+        AST_APP_ARG(text);
+        AST_APP_ARG(lang);
+        AST_APP_ARG(options);
+    );
+
+    parse = ast_strdupa(S_OR(data, ""));
+    AST_STANDARD_APP_ARGS(args, parse);
+
+    struct ast_flags flags = { 0 };
+    char *opt_args[VOISE_SAY_OPT_ARG_ARRAY_SIZE] = { NULL };
+
+    if (!ast_strlen_zero(args.options) &&
+        ast_app_parse_options(voise_background_options, &flags, opt_args, args.options))
+    {
+        ast_log(LOG_WARNING, "%s: invalid options '%s'\n", voise_background_app, args.options);
+        return -1;
+    }
+
+    int option_verbose = ast_test_flag(&flags, VOISE_SAY_OPT_VERBOSE) ? 1 : 0;
+    int option_stream = ast_test_flag(&flags, VOISE_SAY_OPT_STREAM) ? 1 : 0;
+
+    /* A streamed text may start empty */
+    if (ast_strlen_zero(args.text) && !option_stream)
+    {
+        ast_log(LOG_WARNING, "%s() requires a text argument (text[,lang][,options])\n", voise_background_app);
+        return -1;
+    }
+
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    if (!vcfg)
+    {
+        ast_log(LOG_ERROR, "Error opening configuration file %s\n", VOISE_CFG);
+        return -1;
+    }
+
+    if (ast_strlen_zero(args.lang))
+    {
+        if ( !(args.lang = (char*) ast_variable_retrieve(vcfg, "general", "lang")))
+            args.lang = (char*) VOISE_DEF_LANG;
+    }
+
+    if (!option_verbose)
+    {
+        const char *vverbose;
+        if ( !(vverbose = ast_variable_retrieve(vcfg, "debug", "verbose")))
+            vverbose = VOISE_DEF_VERBOSE;
+
+        option_verbose = atoi(vverbose);
+    }
+
+    /* One background prompt per channel */
+    __voise_background_stop(chan);
+
+    struct ast_format *new_writeformat = ast_channel_get_speechwriteformat(chan);
+    ast_channel_set_writeformat(chan, new_writeformat);
+
+    struct voise_background *background = ao2_alloc(sizeof(*background), __voise_background_destructor);
+
+    if (background == NULL)
+    {
+        ast_config_destroy(vcfg);
+        return -1;
+    }
+
+    /* Released by the destructor */
+    ast_module_ref(ast_module_info->self);
+
+    background->playback = __voise_tts_playback_create(vcfg, new_writeformat, S_OR(args.text, ""), args.lang,
+        ast_test_flag(&flags, VOISE_SAY_OPT_TEMPLATE) ? 1 : 0, option_stream, option_verbose);
+
+    ast_config_destroy(vcfg);
+
+    if (background->playback == NULL)
+    {
+        ao2_ref(background, -1);
+        return -1;
+    }
+
+    background->frame.frametype = AST_FRAME_VOICE;
+    background->frame.subclass.format = new_writeformat;
+    background->frame.src = voise_background_app;
+    background->rate = ast_format_get_sample_rate(new_writeformat);
+
+    /* Answer if it's not already going. */
+    if (ast_channel_state(chan) != AST_STATE_UP)
+        ast_answer(chan);
+
+    ast_stopstream(chan);
+
+    struct ast_datastore *datastore = ast_datastore_alloc(&voise_background_datastore, NULL);
+
+    if (datastore == NULL)
+    {
+        ao2_ref(background, -1);
+        return -1;
+    }
+
+    /* The datastore takes over the reference */
+    datastore->data = background;
+
+    ast_channel_lock(chan);
+
+    struct ast_datastore *old = ast_channel_datastore_find(chan, &voise_background_datastore, NULL);
+
+    if (old)
+    {
+        ast_channel_datastore_remove(chan, old);
+        ast_datastore_free(old);
+    }
+
+    ast_channel_datastore_add(chan, datastore);
+
+    ast_channel_unlock(chan);
+
+    if (ast_activate_generator(chan, &voise_background_generator, background) < 0)
+    {
+        ast_log(LOG_WARNING, "Could not start %s on %s\n", voise_background_app, ast_channel_name(chan));
+
+        ao2_lock(background);
+        background->state = VOISE_BACKGROUND_STOPPED;
+        ao2_unlock(background);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ********************************* */
+/* ************ VoiseAsk *********** */
+/* ********************************* */
+
+/* Recognition side of a VoiseAsk turn: a session of the Voise speech engine,
+ * whose stream is started while the prompt is synthesized. Its endpointer and
+ * settings ([general] initsil, maxsil, abs_timeout, asr_engine...) are the
+ * engine's, and count from the first audio written */
+struct voise_ask_asr
+{
+    const char *grammar;
+    const char *lang;
+    int verbose;
+
+    struct ast_speech *speech;
+    pthread_t thread;
+};
+
+/* VoiseAsk variables read from VOISE_LATENCY() after the recognition */
+static const struct
+{
+    const char *var;
+    const char *latency;
+} voise_ask_latencies[] = {
+    { "VOISE_CONNECT_MS", "connect" },
+    { "VOISE_START_MS", "start" },
+    { "VOISE_ENDPOINT_MS", "endpoint" },
+    { "VOISE_RESULT_MS", "result" },
+    { "VOISE_END_REASON", "end_reason" },
+};
+
+/*! \brief Helper function. Connect to the speech engine, activate the grammar and
+ * start the stream, so that no round trip is left for the barge-in */
+static void* __voise_ask_create_asr(void *data)
+{
+    TRACE_FUNCTION();
+
+    struct voise_ask_asr *asr = data;
+    struct ast_format_cap *cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
+
+    if (cap == NULL)
+        return NULL;
+
+    ast_format_cap_append(cap, ast_format_slin, 0);
+
+    struct ast_speech *speech = ast_speech_new(VOISE_ASK_ENGINE, cap);
+
+    ao2_ref(cap, -1);
+
+    if (speech == NULL)
+    {
+        ast_log(LOG_ERROR, "Could not create a '%s' speech session\n", VOISE_ASK_ENGINE);
+        return NULL;
+    }
+
+    if (asr->verbose)
+        ast_speech_change(speech, "verbose", "1");
+
+    int ret = ast_speech_change(speech, "lang", asr->lang);
+
+    /* A grammar file is loaded under a name of its own, anything else is the
+     * name of a server model */
+    const char *name = asr->grammar;
+
+    if (ret == 0 && strchr(asr->grammar, '/'))
+    {
+        name = VOISE_ASK_GRAMMAR;
+        ret = ast_speech_grammar_load(speech, name, asr->grammar);
+    }
+
+    if (ret == 0)
+        ret = ast_speech_grammar_activate(speech, name);
 
-    va_start(va, fmt);
+    if (ret != 0)
+    {
+        ast_log(LOG_ERROR, "Could not activate grammar %s\n", asr->grammar);
+        ast_speech_destroy(speech);
+        return NULL;
+    }
 
-    vsnprintf(msg, 1000, fmt, va);
-    ast_log(LOG_ERROR, "libvoise.so -> %s", msg);
+    /* Nothing is written until the caller speaks or the prompt ends: the
+     * prompt's echo is not recognized */
+    ast_speech_start(speech);
 
-    va_end(va);
+    if (speech->state != AST_SPEECH_STATE_READY)
+    {
+        ast_log(LOG_ERROR, "Could not start the recognition of %s\n", asr->grammar);
+        ast_speech_destroy(speech);
+        return NULL;
+    }
+
+    asr->speech = speech;
+
+    return NULL;
 }
 
-static struct ast_format* ast_channel_get_speechwriteformat(struct ast_channel *chan)
+/*! \brief Helper function. Keep the last inbound audio, so the start of the speech
+ * that interrupts the prompt is recognized too */
+static void __voise_ask_preroll_add(unsigned char *preroll, size_t size, size_t *head, size_t *count,
+    const unsigned char *data, size_t len)
 {
-    TRACE_FUNCTION();
+    if (len >= size)
+    {
+        memcpy(preroll, data + len - size, size);
+        *head = 0;
+        *count = size;
+        return;
+    }
 
-    struct ast_format *raw_format = ast_channel_rawreadformat(chan);
+    size_t tail = (*head + *count) % size;
+    size_t first = MIN(len, size - tail);
 
-    if (raw_format == ast_format_ulaw || raw_format == ast_format_alaw)
-        return raw_format;
+    memcpy(preroll + tail, data, first);
+    memcpy(preroll, data + first, len - first);
 
-    int sample_rate = ast_format_get_sample_rate(raw_format);
+    *count += len;
 
-    return ast_format_cache_get_slin_by_rate(sample_rate);
+    if (*count > size)
+    {
+        *head = (*head + *count - size) % size;
+        *count = size;
+    }
 }
 
-static int voise_get_bytes_per_sample(struct ast_format *format)
+/*! \brief Helper function. Feed the recognizer silence for a gap without inbound
+ * audio, so its endpointer and timeouts run on a silent channel too
+ * \return the ms of silence written */
+static int __voise_ask_write_silence(struct ast_speech *speech, int ms)
 {
-    if (format == ast_format_ulaw || format == ast_format_alaw)
-        return 1;
+    static const int16_t silence[160]; /* 20 ms */
+    int written = 0;
 
-    /* linear */
-    return 2;
+    while (written + 20 <= ms && speech->state == AST_SPEECH_STATE_READY)
+    {
+        if (ast_speech_write(speech, (void *)silence, sizeof(silence)) < 0)
+            break;
+
+        written += 20;
+    }
+
+    return written;
 }
 
-/*! \brief Text to speech application. */
-static int voise_say_exec(struct ast_channel *chan, const char* data)
+/*! \brief Prompt and listen: the recognition stream is started while the prompt is
+ * synthesized, and audio is sent to it from the caller's speech that interrupts
+ * the prompt, or from the end of the prompt. */
+static int voise_ask_exec(struct ast_channel *chan, const char* data)
 {
     TRACE_FUNCTION();
 
     struct ast_module_user *u;
     char *parse;
 
-    int option_verbose = 0;
-    int option_beep = 0;
-    int option_no_hangup_on_err = 0;
-
     AST_DECLARE_APP_ARGS(args,
         AST_APP_ARG(text);
-        AST_APP_ARG(lang);
+        AST_APP_ARG(grammar);
         AST_APP_ARG(options);
+        AST_APP_ARG(lang);
     );
 
     if (ast_strlen_zero(data))
     {
-        ast_log(LOG_ERROR, "%s requires an argument (text[,lang][,options])\n", voise_say_app);
+        ast_log(LOG_ERROR, "%s requires an argument (text,grammar[,options][,lang])\n", voise_ask_app);
         return -1;
     }
 
-    /* We need to make a copy of the input string if we are going to modify it! */
     parse = ast_strdupa(data);
     AST_STANDARD_APP_ARGS(args, parse);
 
-    if (ast_strlen_zero(args.text))
+    if (ast_strlen_zero(args.text) || ast_strlen_zero(args.grammar))
     {
-        ast_log(LOG_WARNING, "%s() requires a text argument (text[,lang][,options])\n", voise_say_app);
+        ast_log(LOG_WARNING, "%s() requires text and grammar arguments (text,grammar[,options][,lang])\n", voise_ask_app);
         return -1;
     }
 
-    if (!ast_strlen_zero(args.options))
+    struct ast_flags flags = { 0 };
+    char *opt_args[VOISE_SAY_OPT_ARG_ARRAY_SIZE] = { NULL };
+
+    if (!ast_strlen_zero(args.options) &&
+        ast_app_parse_options(voise_ask_options, &flags, opt_args, args.options))
     {
-        if (strchr(args.options, 'v'))
-            option_verbose = 1;
-        if (strchr(args.options, 'b'))
-            option_beep = 1;
-        if (strchr(args.options, 'n'))
-            option_no_hangup_on_err = 1;
+        ast_log(LOG_WARNING, "%s: invalid options '%s'\n", voise_ask_app, args.options);
+        return -1;
     }
 
-    /* Load default options */
+    int option_verbose = ast_test_flag(&flags, VOISE_SAY_OPT_VERBOSE) ? 1 : 0;
+    int option_barge = !ast_test_flag(&flags, VOISE_SAY_OPT_NO_BARGE);
+
     struct ast_config *vcfg = voise_load_asterisk_config();
 
     if (!vcfg)
@@ -167,14 +5852,12 @@ static int voise_say_exec(struct ast_channel *chan, const char* data)
         return -1;
     }
 
-    /* If language is not defined, get default lang */
     if (ast_strlen_zero(args.lang))
     {
         if ( !(args.lang = (char*) ast_variable_retrieve(vcfg, "general", "lang")))
             args.lang = (char*) VOISE_DEF_LANG;
     }
 
-    /* If verbosity is not defined, get default verbosity */
     if (!option_verbose)
     {
         const char *vverbose;
@@ -184,34 +5867,56 @@ static int voise_say_exec(struct ast_channel *chan, const char* data)
         option_verbose = atoi(vverbose);
     }
 
-    /* Server IP */
-    const char *vserverip;
-    if ( !(vserverip = ast_variable_retrieve(vcfg, "general", "serverip")) )
-        vserverip = VOISE_DEF_HOST;
+    const char *vbargethreshold;
+    if ( !(vbargethreshold = ast_variable_retrieve(vcfg, "tts", "barge_threshold")) )
+        vbargethreshold = VOISE_DEF_TTS_BARGE_THRESHOLD;
 
-    u = ast_module_user_add(chan);
+    const char *vbargeminms;
+    if ( !(vbargeminms = ast_variable_retrieve(vcfg, "tts", "barge_min_ms")) )
+        vbargeminms = VOISE_DEF_TTS_BARGE_MIN_MS;
 
-    struct ast_format *new_writeformat = ast_channel_get_speechwriteformat(chan);
+    int barge_threshold = atoi(vbargethreshold);
+    int barge_min_ms = atoi(S_OR(opt_args[VOISE_SAY_OPT_ARG_BARGE], vbargeminms));
+    int cdr_latency = __voise_cdr_latency(vcfg);
 
-    int max_frame_ms = ast_format_get_default_ms(new_writeformat);
-    // Eg: Alaw: 20 (default_ms) / 10 (get_minimum_ms) * 80 (minimum_bytes) = 160;
-    int max_frame_len = max_frame_ms / ast_format_get_minimum_ms(new_writeformat) * ast_format_get_minimum_bytes(new_writeformat);
+    u = ast_module_user_add(chan);
 
-    if (option_verbose)
-        ast_log(LOG_DEBUG, "Format name: %s, Max frame len: %d\n", ast_format_get_name(new_writeformat), max_frame_len);
+    /* The recognition thread may outlive the configuration */
+    struct voise_ask_asr asr = {
+        .grammar = args.grammar,
+        .lang = ast_strdupa(args.lang),
+        .verbose = option_verbose,
+        .thread = AST_PTHREADT_NULL,
+    };
 
-    /* Set channel format */
+    /* The recognition stream is started while the prompt is synthesized */
+    if (ast_pthread_create_background(&asr.thread, NULL, __voise_ask_create_asr, &asr))
+    {
+        asr.thread = AST_PTHREADT_NULL;
+        __voise_ask_create_asr(&asr);
+    }
+
+    struct ast_format *new_writeformat = ast_channel_get_speechwriteformat(chan);
     ast_channel_set_writeformat(chan, new_writeformat);
 
-    voise_client_t client;
-    int ret = voise_init(&client, vserverip, 8102, 1, __voise_capture_error_cb);
+    struct voise_tts_playback *playback = __voise_tts_playback_create(vcfg, new_writeformat, args.text, args.lang,
+        ast_test_flag(&flags, VOISE_SAY_OPT_TEMPLATE) ? 1 : 0, 0, option_verbose);
 
-    if (ret < 0)
+    ast_config_destroy(vcfg);
+
+    if (asr.thread != AST_PTHREADT_NULL)
+        pthread_join(asr.thread, NULL);
+
+    if (playback == NULL || asr.speech == NULL)
     {
-        ast_log(LOG_ERROR, "Could not connect to Voise server (%s).\n", vserverip);
+        if (playback)
+            __voise_tts_playback_destroy(playback);
+
+        if (asr.speech)
+            ast_speech_destroy(asr.speech);
 
+        pbx_builtin_setvar_helper(chan, "VOISE_ASK_STATUS", "ERROR");
         ast_module_user_remove(u);
-        ast_config_destroy(vcfg);
 
         return -1;
     }
@@ -220,131 +5925,445 @@ static int voise_say_exec(struct ast_channel *chan, const char* data)
     if (ast_channel_state(chan) != AST_STATE_UP)
         ast_answer(chan);
 
-    /* Ensure no streams are currently running.. */
     ast_stopstream(chan);
 
-    voise_response_t response;
-    ret = voise_start_synth(&client, &response,
-        args.text, ast_format_get_name(new_writeformat), ast_format_get_sample_rate(new_writeformat), args.lang, max_frame_ms);
-
-    // 201 = Accepted
-    if (ret < 0 || response.result_code != 201)
-    {
-        ast_log(LOG_ERROR, "VoiseSay: %s\n", response.result_message);
+    /* Recognition takes signed linear at 8 kHz */
+    struct ast_format *old_readformat = ao2_bump(ast_channel_readformat(chan));
+    ast_set_read_format(chan, ast_format_slin);
 
-        ast_module_user_remove(u);
+    struct ast_dsp *dsp = ast_dsp_new();
 
-        voise_close(&client);
+    if (dsp)
+        ast_dsp_set_threshold(dsp, barge_threshold);
 
-        ast_config_destroy(vcfg);
+    int frame_ms = ast_format_get_default_ms(new_writeformat);
+    struct ast_timer *timer = ast_timer_open();
+    int timer_fd = -1;
 
-        return -1;
+    if (timer != NULL && ast_timer_set_rate(timer, 1000 / frame_ms) == 0)
+    {
+        timer_fd = ast_timer_fd(timer);
     }
-
-    ast_config_destroy(vcfg);
-
-    if (option_beep)
+    else if (timer != NULL)
     {
-        int res = ast_streamfile(chan, "beep", ast_channel_language(chan));
-
-        if (!res)
-            res = ast_waitstream(chan, "");
-        else
-            ast_log(LOG_WARNING, "ast_streamfile failed on %s\n", ast_channel_name(chan));
-
-        ast_stopstream(chan);
+        ast_timer_close(timer);
+        timer = NULL;
     }
 
-    ast_safe_sleep(chan, 300);
+    struct ast_frame frame = {
+        .frametype = AST_FRAME_VOICE,
+        .src = voise_ask_app,
+    };
+    frame.subclass.format = new_writeformat;
 
-    struct ast_frame *f;
-    unsigned char audio_data[VOISE_MAX_FRAME_LEN];
+    unsigned char preroll[VOISE_ASK_PREROLL_MS * 16];
+    size_t preroll_head = 0;
+    size_t preroll_count = 0;
+
+    struct timeval next_frame = ast_tvnow();
+    struct timeval prompt_start = ast_tvnow();
+    struct timeval last_audio = ast_tvnow();
 
+    const char *status = NULL;
+    int onset_ms = -1;
+    int playing = 1;
+    int listening = 0;
+    int bargein = 0;
     int result = 0;
-    int done = 0;
 
-    while (!done)
+    while (status == NULL)
     {
-        int ms = ast_waitfor(chan, MAX_WAIT_TIME);
+        /* While listening, wake up at least every gap to feed the silence */
+        int ms = playing ? MAX_WAIT_TIME : VOISE_ASK_GAP_MS;
 
-        if (option_verbose)
-            ast_log(LOG_DEBUG, "Waited %d ms\n", ms);
+        if (playing && timer == NULL)
+            ms = MAX(0, (int)ast_tvdiff_ms(next_frame, ast_tvnow()));
+
+        int outfd = -1;
+        struct ast_channel *ready = ast_waitfor_nandfds(&chan, 1, &timer_fd, (playing && timer) ? 1 : 0, NULL, &outfd, &ms);
 
-        if (ms < 0)
+        if (ready == NULL && outfd < 0 && ms < 0)
         {
             ast_log(LOG_ERROR, "Wait failed.\n");
 
+            status = "ERROR";
             result = -1;
             break;
         }
 
-        if (option_verbose)
-            ast_log(LOG_DEBUG, "Going to read a new frame\n");
+        if (ready != NULL)
+        {
+            struct ast_frame *f = ast_read(chan);
 
-        f = ast_read(chan);
+            /* Hangup detection */
+            if (!f)
+            {
+                ast_log(LOG_DEBUG, "Hangup detected.\n");
 
-        /* Hangup detection */
-        if (!f)
-        {
-            ast_log(LOG_DEBUG, "Hangup detected.\n");
+                status = "HANGUP";
+                result = -1;
+                break;
+            }
 
-            result = -1;
-            break;
-        }
+            if (f->frametype == AST_FRAME_VOICE && f->datalen > 0)
+            {
+                if (playing)
+                {
+                    __voise_ask_preroll_add(preroll, sizeof(preroll), &preroll_head, &preroll_count, f->data.ptr, f->datalen);
+
+                    int totalnoise = 0;
 
-        if (f->frametype == AST_FRAME_VOICE)
+                    if (option_barge && dsp && __voise_speech_detected(dsp, f, barge_min_ms, &totalnoise))
+                    {
+                        if (option_verbose)
+                            ast_log(LOG_DEBUG, "Barge-in after %d ms of speech\n", totalnoise);
+
+                        /* Stop the prompt, and recognize the speech heard so far */
+                        __voise_tts_playback_cancel(playback);
+
+                        playing = 0;
+                        bargein = 1;
+                        last_audio = ast_tvnow();
+                        onset_ms = MAX((int)ast_tvdiff_ms(last_audio, prompt_start) - totalnoise, 0);
+                        listening = 1;
+
+                        size_t first = MIN(preroll_count, sizeof(preroll) - preroll_head);
+
+                        if (ast_speech_write(asr.speech, preroll + preroll_head, first) == 0 && preroll_count > first)
+                            ast_speech_write(asr.speech, preroll, preroll_count - first);
+                    }
+                }
+                else
+                {
+                    ast_speech_write(asr.speech, f->data.ptr, f->datalen);
+                    last_audio = ast_tvnow();
+                }
+            }
+
+            ast_frfree(f);
+        }
+        else if (playing)
         {
-            memset(audio_data, 0, VOISE_MAX_FRAME_LEN * sizeof(unsigned char));
+            if (timer != NULL)
+            {
+                if (outfd < 0)
+                    continue;
 
-            size_t audio_len = -1;
-            ret = voise_read_synth(&client, audio_data, &audio_len);
+                ast_timer_ack(timer, 1);
+            }
+            else
+            {
+                if (ms > 0)
+                    continue;
+
+                next_frame = ast_tvadd(next_frame, ast_samp2tv(frame_ms, 1000));
+            }
 
-            if (ret < 0)
+            int audio_len = __voise_tts_playback_next_frame(playback, &frame);
+
+            if (audio_len < 0)
+            {
+                /* The prompt ended: listen. What was heard meanwhile was the prompt's echo */
+                playing = 0;
+                last_audio = ast_tvnow();
+                listening = 1;
+            }
+            else if (audio_len > 0 && ast_write(chan, &frame) < 0)
             {
-                ast_log(LOG_ERROR, "Read synth error: %d\n", ret);
+                ast_log(LOG_ERROR, "Error writing frame to chan.\n");
             }
+        }
 
-            int nbytes = f->samples * voise_get_bytes_per_sample(new_writeformat);
+        if (!listening)
+            continue;
 
-            if (audio_len < nbytes)
-                done = 1;
+        int gap = (int)ast_tvdiff_ms(ast_tvnow(), last_audio);
 
-            f->datalen = (int)audio_len;
-            f->samples = (int)audio_len / voise_get_bytes_per_sample(new_writeformat);
-            f->offset = 0;
+        if (gap >= VOISE_ASK_GAP_MS)
+            last_audio = ast_tvadd(last_audio, ast_samp2tv(__voise_ask_write_silence(asr.speech, gap), 1000));
 
-            /* Tell the frame which are it's new samples */
-            f->data.ptr = audio_data;
+        if (asr.speech->state == AST_SPEECH_STATE_DONE)
+        {
+            status = "OK";
+        }
+        else if (asr.speech->state != AST_SPEECH_STATE_READY)
+        {
+            ast_log(LOG_ERROR, "Recognition error\n");
+            status = "ERROR";
+        }
+    }
 
-            if (ast_write(chan, f) < 0)
-                ast_log(LOG_ERROR, "Error writing frame to chan.\n");
+    if (timer != NULL)
+        ast_timer_close(timer);
+
+    if (dsp != NULL)
+        ast_dsp_free(dsp);
+
+    int first_audio_ms = playback->first_audio_ms;
+
+    char trimmed[16];
+    snprintf(trimmed, sizeof(trimmed), "%zu", __voise_tts_playback_trimmed_ms(playback));
+    pbx_builtin_setvar_helper(chan, "VOISE_TTS_TRIMMED_MS", trimmed);
+
+    __voise_tts_playback_destroy(playback);
+
+    /* Results, and the latencies of the recognition as the engine measured them */
+    struct ast_speech_result *results = NULL;
+    char value[32];
+    size_t i;
+
+    if (listening && strcmp(status, "HANGUP"))
+    {
+        if (!ast_func_read(chan, "VOISE_LATENCY(end_reason)", value, sizeof(value)) && !strcmp(value, "initsil"))
+            status = "NOINPUT";
+
+        if (!strcmp(status, "OK"))
+            results = ast_speech_results_get(asr.speech);
+
+        for (i = 0; i < ARRAY_LEN(voise_ask_latencies); ++i)
+        {
+            char function[64];
+
+            snprintf(function, sizeof(function), "VOISE_LATENCY(%s)", voise_ask_latencies[i].latency);
+
+            if (ast_func_read(chan, function, value, sizeof(value)))
+                value[0] = '\0';
+
+            __voise_set_call_var(chan, voise_ask_latencies[i].var, value, cdr_latency);
+        }
+
+        /* With a barge-in, the speech started during the prompt */
+        if (!bargein)
+        {
+            if (ast_func_read(chan, "VOISE_LATENCY(speech_onset)", value, sizeof(value)) || ast_strlen_zero(value))
+                onset_ms = -1;
+            else
+                onset_ms = atoi(value);
         }
+    }
+    else
+    {
+        for (i = 0; i < ARRAY_LEN(voise_ask_latencies); ++i)
+            __voise_set_call_var(chan, voise_ask_latencies[i].var, "", cdr_latency);
 
-        ast_frfree(f);
+        __voise_set_call_var(chan, "VOISE_END_REASON", !strcmp(status, "HANGUP") ? "hangup" : "error", cdr_latency);
     }
 
-    voise_close(&client);
+    char score[16];
+    snprintf(score, sizeof(score), "%d", results ? results->score : 0);
 
-    ast_safe_sleep(chan, 20);
+    pbx_builtin_setvar_helper(chan, "VOISE_ASK_STATUS", status);
+    pbx_builtin_setvar_helper(chan, "VOISE_ASK_TEXT", results ? S_OR(results->text, "") : "");
+    pbx_builtin_setvar_helper(chan, "VOISE_ASK_INTENT", results ? S_OR(results->grammar, "") : "");
+    pbx_builtin_setvar_helper(chan, "VOISE_ASK_SCORE", score);
+    pbx_builtin_setvar_helper(chan, "VOISE_ASK_BARGEIN", bargein ? "1" : "0");
+
+    __voise_set_call_latency(chan, "VOISE_SPEECH_ONSET_MS", onset_ms, cdr_latency);
+    __voise_set_call_latency(chan, "VOISE_TTS_FIRST_AUDIO_MS", first_audio_ms, cdr_latency);
+
+    ast_speech_destroy(asr.speech);
+
+    if (old_readformat != NULL)
+    {
+        ast_set_read_format(chan, old_readformat);
+        ao2_ref(old_readformat, -1);
+    }
 
-    ast_stopstream(chan);
     ast_module_user_remove(u);
 
     return result;
 }
 
+/* ********************************* */
+/* ********** VoiseRender ********** */
+/* ********************************* */
+
+/*! \brief Render a text into a sound file, for Playback. */
+static int voise_render_exec(struct ast_channel *chan, const char* data)
+{
+    TRACE_FUNCTION();
+
+    char *parse;
+
+    AST_DECLARE_APP_ARGS(args,
+        AST_APP_ARG(file);
+        AST_APP_ARG(text);
+        AST_APP_ARG(lang);
+    );
+
+    if (ast_strlen_zero(data))
+    {
+        ast_log(LOG_ERROR, "%s requires an argument (file,text[,lang])\n", voise_render_app);
+        return -1;
+    }
+
+    parse = ast_strdupa(data);
+    AST_STANDARD_APP_ARGS(args, parse);
+
+    if (ast_strlen_zero(args.file) || ast_strlen_zero(args.text))
+    {
+        ast_log(LOG_WARNING, "%s() requires file and text arguments (file,text[,lang])\n", voise_render_app);
+        return -1;
+    }
+
+    /* The extension gives the format */
+    char *ext = strrchr(args.file, '.');
+    char *slash = strrchr(args.file, '/');
+
+    if (ext != NULL && (slash == NULL || ext > slash))
+        *ext++ = '\0';
+    else
+        ext = "ulaw";
+
+    struct ast_format *format = __voise_tts_render_format(ext);
+
+    if (format == NULL)
+    {
+        ast_log(LOG_WARNING, "%s: cannot render .%s files (ulaw, alaw, sln or sln16)\n", voise_render_app, ext);
+        pbx_builtin_setvar_helper(chan, "VOISE_RENDER_STATUS", "ERROR");
+        return 0;
+    }
+
+    char path[PATH_MAX];
+
+    if (__voise_tts_render_path(args.file, ext, path, sizeof(path)) < 0)
+    {
+        ast_log(LOG_WARNING, "%s: '%s' is not a file name relative to the sounds directory\n", voise_render_app, args.file);
+        pbx_builtin_setvar_helper(chan, "VOISE_RENDER_STATUS", "ERROR");
+        ao2_ref(format, -1);
+        return 0;
+    }
+
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    if (!vcfg)
+    {
+        ast_log(LOG_ERROR, "Error opening configuration file %s\n", VOISE_CFG);
+        ao2_ref(format, -1);
+        return -1;
+    }
+
+    if (ast_strlen_zero(args.lang))
+    {
+        if ( !(args.lang = (char*) ast_variable_retrieve(vcfg, "general", "lang")))
+            args.lang = (char*) VOISE_DEF_LANG;
+    }
+
+    const char *vserverip;
+    if ( !(vserverip = ast_variable_retrieve(vcfg, "general", "serverip")) )
+        vserverip = VOISE_DEF_HOST;
+
+    char md5[33];
+    size_t len = 0;
+
+    int ret = __voise_tts_render_file(vserverip, args.text, args.lang, format, path, &len, md5);
+
+    ast_config_destroy(vcfg);
+
+    if (ret < 0)
+    {
+        pbx_builtin_setvar_helper(chan, "VOISE_RENDER_STATUS", "ERROR");
+    }
+    else
+    {
+        char duration[32];
+        size_t samples = len / voise_get_bytes_per_sample(format);
+
+        snprintf(duration, sizeof(duration), "%llu", (unsigned long long)samples * 1000 / ast_format_get_sample_rate(format));
+
+        pbx_builtin_setvar_helper(chan, "VOISE_RENDER_STATUS", "OK");
+        pbx_builtin_setvar_helper(chan, "VOISE_RENDER_DURATION", duration);
+        pbx_builtin_setvar_helper(chan, "VOISE_RENDER_MD5", md5);
+    }
+
+    ao2_ref(format, -1);
+
+    return 0;
+}
+
 static int load_module(void)
 {
+    voise_tts_cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, VOISE_TTS_CACHE_BUCKETS,
+        __voise_tts_entry_hash_fn, NULL, __voise_tts_entry_cmp_fn);
+
+    if (!voise_tts_cache)
+    {
+        ast_log(LOG_ERROR, "Failed to alloc TTS cache\n");
+        return AST_MODULE_LOAD_FAILURE;
+    }
+
+    __voise_tts_cache_load_config();
+
+    __voise_tts_disk_start();
+
+    /* Warm the cache with the catalog, in the background */
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    const char *vpoolsize = vcfg ? ast_variable_retrieve(vcfg, "tts", "pool_size") : NULL;
+    voise_tts_pool_max = atoi(vpoolsize ? vpoolsize : VOISE_DEF_TTS_POOL_SIZE);
+
+    const char *vreadms = vcfg ? ast_variable_retrieve(vcfg, "tts", "read_ms") : NULL;
+    voise_tts_read_ms = atoi(vreadms ? vreadms : VOISE_DEF_TTS_READ_MS);
+
+    if (vcfg)
+    {
+        const char *vonload = ast_variable_retrieve(vcfg, "tts_catalog", "on_load");
+
+        if (ast_variable_retrieve(vcfg, "tts_catalog", "file") && (!vonload || ast_true(vonload)))
+            __voise_tts_catalog_start(NULL);
+
+        ast_config_destroy(vcfg);
+    }
+
+    ast_cli_register_multiple(voise_cli, ARRAY_LEN(voise_cli));
+
+    ast_custom_function_register(&voise_background_function);
+    ast_register_application(voise_ask_app, voise_ask_exec, "Prompt and recognize the answer", voise_ask_descrip);
+    ast_register_application(voise_render_app, voise_render_exec, "Text to speech into a sound file", voise_render_descrip);
+    ast_register_application(voise_background_app, voise_background_exec, "Text to speech in the background", voise_background_descrip);
+
     return ast_register_application(voise_say_app, voise_say_exec, "Text to speech application", voise_say_descrip);
 }
 
 static int unload_module(void)
 {
-    return ast_unregister_application(voise_say_app);
+    int res = ast_unregister_application(voise_say_app);
+
+    res |= ast_unregister_application(voise_background_app);
+    res |= ast_unregister_application(voise_ask_app);
+    res |= ast_unregister_application(voise_render_app);
+    res |= ast_custom_function_unregister(&voise_background_function);
+
+    ast_cli_unregister_multiple(voise_cli, ARRAY_LEN(voise_cli));
+
+    __voise_tts_job_stop(&voise_tts_catalog);
+    __voise_tts_job_stop(&voise_tts_render);
+
+    /* Readers of abandoned syntheses stop after their current read */
+    __voise_tts_inflight_wait();
+
+    ast_mutex_lock(&voise_tts_cache_lock);
+
+    voise_tts_lru_head = voise_tts_lru_tail = NULL;
+    voise_tts_cache_info.bytes = 0;
+
+    ao2_cleanup(voise_tts_cache);
+    voise_tts_cache = NULL;
+
+    ast_mutex_unlock(&voise_tts_cache_lock);
+
+    __voise_tts_disk_stop();
+
+    __voise_tts_pool_drain();
+
+    __voise_stats_free();
+
+    return res;
 }
 
 
 AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Voise TTS Application",
     .load = load_module,
     .unload = unload_module,
+    .nonoptreq = "res_speech,res_speech_voise",
 );
@@ -31,8 +31,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <sched.h>
 
 #include "asterisk/channel.h"
+#include "asterisk/pbx.h"
 #include "asterisk/frame.h"
 #include "asterisk/dsp.h"
 #include "asterisk/module.h"
@@ -40,6 +44,13 @@
 #include "asterisk/config.h"
 #include "asterisk/speech.h"
 #include "asterisk/ast_version.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/utils.h"
+#include "asterisk/strings.h"
+#include "asterisk/cli.h"
+#include "asterisk/lock.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/threadstorage.h"
 #include <asterisk/format_cache.h>
 
 #include <voise_client.h>
@@ -63,6 +74,8 @@ static const int  VOISE_BUFSIZE = 2048;
 static const int  VOISE_NOISE_FRAMES = 1;
 static const int  VOISE_SILENCE_THRESHOLD = 2000;
 static const int  VOISE_MAX_NBEST = 1;
+static const int  VOISE_SERVER_PORT = 8102;
+static const int  VOISE_WARMUP_AUDIO_MS = 500;
 
 static const char *VOISE_CFG = "voise.conf";
 static const char *VOISE_DEF_HOST = "127.0.0.1";
@@ -72,23 +85,281 @@ static const char *VOISE_DEF_INIT_SIL = "5000";
 static const char *VOISE_DEF_MAX_SIL = "1000";
 static const char *VOISE_DEF_ABS_TIMEOUT = "15";
 static const char *VOISE_DEF_VERBOSE = "0"; /* disabled */
+static const char *VOISE_DEF_GRAMMAR_CACHE_SIZE = "100";
+
+static const int  VOISE_GRAMMAR_BUCKETS = 53;
+
+static const int  VOISE_INTERNED_BUCKETS = 211;
+
+/* Maximum lengths accepted by the setters */
+static const size_t VOISE_MAX_LANG_LEN = 16;
+static const size_t VOISE_MAX_ASR_ENGINE_LEN = 32;
+static const size_t VOISE_MAX_MODEL_NAME_LEN = 255;
+
+/* Number of sessions allocated at once by the session slab */
+#define VOISE_SLAB_BLOCK_SIZE 64
+
+/* Maximum number of grammars active at the same time in a session */
+#define VOISE_MAX_ACTIVE_GRAMMARS 8
+
+/* Audio chunks a parallel stream may have waiting to be sent (~10 s) */
+#define VOISE_STREAM_QUEUE_LEN 512
+
+/* Grammar uploaded to the Voise server, shared by every channel.
+ * The content hash is the grammar identity: the server compiles it once and
+ * later recognitions reference it only by model id. */
+struct voise_grammar
+{
+    /* SHA1 of the grammar content (hex) */
+    char hash[41];
+
+    /* Model id used to reference the grammar on the server */
+    char model_id[50];
+
+    /* Grammar content, sent only on first use */
+    char *content;
+
+    /* True once the server has accepted (and compiled) the grammar */
+    int uploaded;
+
+    /* Number of sessions that have the grammar loaded */
+    int users;
+
+    /* Last time the grammar was loaded or activated (for eviction) */
+    struct timeval last_used;
+};
+
+/* Grammar loaded in a session through SpeechLoadGrammar */
+struct voise_loaded_grammar
+{
+    /* Name given in the dialplan, interned */
+    const char *name;
+
+    /* Shared grammar (holds a reference) */
+    struct voise_grammar *grammar;
+
+    AST_LIST_ENTRY(voise_loaded_grammar) list;
+};
+
+AST_LIST_HEAD_NOLOCK(voise_loaded_grammars, voise_loaded_grammar);
+
+/* Grammar active in a session */
+struct voise_active_grammar
+{
+    /* Name given in the dialplan (reported as the result grammar), interned */
+    const char *name;
+
+    /* Model name sent to the server, interned */
+    const char *model_name;
+
+    /* Uploaded grammar, NULL when model_name is a server model */
+    struct voise_grammar *grammar;
+};
+
+/* Audio received by voise_write(). Copied once and referenced by the
+ * sender of every parallel stream */
+struct voise_audio_chunk
+{
+    int len;
+    unsigned char data[0];
+};
+
+/* Recognition of one active grammar, fed by its own sender thread */
+struct voise_stream
+{
+    /* Grammar recognized by the stream */
+    struct voise_active_grammar *active;
+
+    /* Connection used by the stream */
+    voise_client_t *client;
+    struct voise_stats *stats;
+
+    const char *lang;
+    const char *asr_engine;
+    int verbose;
+
+    pthread_t thread;
+    ast_mutex_t lock;
+    ast_cond_t cond;
+
+    /* Audio waiting to be sent */
+    struct voise_audio_chunk *queue[VOISE_STREAM_QUEUE_LEN];
+    int head;
+    int count;
+
+    /* Set by the sender once the server accepted (or refused) the stream */
+    int started;
+
+    /* Set when the recognition must be stopped */
+    int stop;
+
+    /* Set on any error; the stream is ignored from then on */
+    int error;
+
+    /* Audio chunks dropped because the sender was late */
+    int dropped;
+
+    /* Final response, valid when the thread is done without error */
+    voise_response_t response;
+};
+
+/* Result of the warm-up of one model on one server */
+struct voise_warmup_result
+{
+    char server[64];
+    char model_name[256];
+    char lang[16];
+    char asr_engine[16];
+
+    /* Time taken by the warm-up recognition (in milliseconds), -1 on failure */
+    int elapsed;
+
+    AST_LIST_ENTRY(voise_warmup_result) list;
+};
+
+AST_LIST_HEAD_NOLOCK(voise_warmup_results, voise_warmup_result);
+
+/* Results of the last warm-up */
+static struct voise_warmup_results voise_warmup_last;
+AST_MUTEX_DEFINE_STATIC(voise_warmup_last_lock);
+
+/* Serializes warm-up runs */
+AST_MUTEX_DEFINE_STATIC(voise_warmup_lock);
+
+/* Warm-up started by load_module() */
+static pthread_t voise_warmup_thread = AST_PTHREADT_NULL;
+
+/* Set by unload_module(): warm-up ends after the current model and server */
+static volatile int voise_warmup_stop;
+
+/* Runtime counters */
+enum voise_stat
+{
+    /* Gauges */
+    VOISE_STAT_SESSIONS,
+    VOISE_STAT_CONNS_OPEN,
+
+    /* Recognitions, and how they ended */
+    VOISE_STAT_RECOG_STARTED,
+    VOISE_STAT_END_INITSIL,
+    VOISE_STAT_END_MAXSIL,
+    VOISE_STAT_END_ABS_TIMEOUT,
+    VOISE_STAT_END_ERROR,
+
+    /* Audio and grammars sent, results received */
+    VOISE_STAT_BYTES_SENT,
+    VOISE_STAT_BYTES_RECEIVED,
+
+    VOISE_STAT_MAX
+};
+
+/* Phases of a recognition with a latency histogram */
+enum voise_hist
+{
+    /* Connection to the server */
+    VOISE_HIST_CONNECT,
+
+    /* voise_start_streaming_recognize() until the server accepts */
+    VOISE_HIST_START,
+
+    /* voise_write() itself */
+    VOISE_HIST_WRITE,
+
+    /* Stop of the stream until the result is set */
+    VOISE_HIST_RESULT,
+
+    /* End of speech until the result is set, endpointer silence included */
+    VOISE_HIST_END_OF_SPEECH,
+
+    VOISE_HIST_MAX
+};
+
+static const char *voise_hist_names[VOISE_HIST_MAX] = {
+    [VOISE_HIST_CONNECT] = "Connect",
+    [VOISE_HIST_START] = "Stream start",
+    [VOISE_HIST_WRITE] = "Write",
+    [VOISE_HIST_RESULT] = "Result",
+    [VOISE_HIST_END_OF_SPEECH] = "End of speech",
+};
+
+#include "voise_stats.h"
+
+/* VOISE_END_REASON of each end of a recognition */
+static const char *voise_end_reasons[VOISE_STAT_MAX] = {
+    [VOISE_STAT_END_INITSIL] = "initsil",
+    [VOISE_STAT_END_MAXSIL] = "maxsil",
+    [VOISE_STAT_END_ABS_TIMEOUT] = "abs_timeout",
+    [VOISE_STAT_END_ERROR] = "error",
+};
+
+/* Latencies of the last recognition that ended in a thread (in milliseconds,
+ * -1 when not measured). The speech API does not give the channel to the
+ * engine, but recognitions are written to from the thread of their channel,
+ * where the dialplan reads them with VOISE_LATENCY() */
+struct voise_call_latency
+{
+    int ended;
+    int connect_ms;
+    int start_ms;
+    int onset_ms;
+    int endpoint_ms;
+    int result_ms;
+    enum voise_stat reason;
+};
+
+AST_THREADSTORAGE(voise_call_latency_buf);
+
+/* Block of sessions of the session slab */
+struct voise_speech_info_block;
+
+/* Language codes, ASR engines and model names are interned in this
+ * read-mostly table: sessions only keep pointers, compared by address.
+ * Entries are reference-counted; the last __voise_unintern() removes them */
+static struct ao2_container *voise_interned;
+
+/* Module-wide grammar table, keyed by content hash */
+static struct ao2_container *voise_grammars;
+
+/* Maximum number of grammars kept in the table */
+static int voise_grammar_cache_size;
 
 struct voise_speech_info
 {
     /* Client */
     voise_client_t *client;
 
+    /* Counters of the server the client is connected to */
+    struct voise_stats *stats;
+
     /* Verbosity */
     int verbose;
 
-    /* Language code used */
-    char lang[10];
+    /* Language code used, interned */
+    const char *lang;
+
+    /* ASR engine used, interned */
+    const char *asr_engine;
+
+    /* Grammars (or server models) active in the session */
+    struct voise_active_grammar active_grammars[VOISE_MAX_ACTIVE_GRAMMARS];
+    int num_active_grammars;
 
-    /* ASR engine used */
-    char asr_engine[10];
+    /* Grammars loaded in this session */
+    struct voise_loaded_grammars loaded_grammars;
 
-    /* Model (i.e. pseudo grammar) used */
-    char model_name[1000];
+    /* Recognize several grammars in a single multi-model stream */
+    int multi_model;
+
+    /* Servers, used to open the connections of parallel streams */
+    char *serverip;
+
+    /* Connections of parallel streams (stream 0 uses client) */
+    voise_client_t *fanout_clients[VOISE_MAX_ACTIVE_GRAMMARS];
+    struct voise_stats *fanout_stats[VOISE_MAX_ACTIVE_GRAMMARS];
+
+    /* Parallel streams of the running recognition, NULL for a single stream */
+    struct voise_stream *streams;
+    int num_streams;
 
     /* Maximum duration of initial silence (in milliseconds) */
     int initsil;
@@ -108,10 +379,35 @@ struct voise_speech_info
     /* Start time of recognition's stream */
     time_t start_time;
 
+    /* Latencies of the session and of its recognition (in milliseconds) */
+    int connect_ms;
+    int start_ms;
+    int onset_ms;
+    struct timeval recog_start;
+
     /* Holds our silence-detection DSP */
     struct ast_dsp *dsp;
 };
 
+/* Session slab: sessions are taken from blocks and returned to a free list */
+union voise_speech_info_slot
+{
+    struct voise_speech_info info;
+    union voise_speech_info_slot *next_free;
+};
+
+struct voise_speech_info_block
+{
+    union voise_speech_info_slot slots[VOISE_SLAB_BLOCK_SIZE];
+
+    AST_LIST_ENTRY(voise_speech_info_block) list;
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(voise_speech_info_blocks, voise_speech_info_block);
+static union voise_speech_info_slot *voise_speech_info_free;
+static int voise_speech_info_used;
+AST_MUTEX_DEFINE_STATIC(voise_speech_info_lock);
+
 static struct ast_speech_engine voise_engine;
 
 /* ********************************* */
@@ -138,6 +434,249 @@ static void __voise_capture_error_cb(const char* fmt, ...)
     va_end(va);
 }
 
+/*! \brief Helper function. Connect to the first available server of a comma-separated list
+ * \param stats set to the counters of the server connected to */
+static int __voise_connect(voise_client_t *client, const char *serverips, struct voise_stats **stats)
+{
+    char *servers = ast_strdupa(serverips);
+    char *server;
+
+    while ((server = strsep(&servers, ",")))
+    {
+        server = ast_strip(server);
+
+        if (ast_strlen_zero(server))
+            continue;
+
+        struct timeval start = ast_tvnow();
+
+        if (voise_init(client, server, VOISE_SERVER_PORT, 1, __voise_capture_error_cb) >= 0)
+        {
+            __voise_hist_since(VOISE_HIST_CONNECT, start);
+
+            *stats = __voise_stats_server(server);
+            __voise_stats_add(*stats, VOISE_STAT_CONNS_OPEN, 1);
+
+            return 0;
+        }
+
+        ast_log(LOG_WARNING, "Could not connect to Voise server (%s).\n", server);
+    }
+
+    return -1;
+}
+
+/*! \brief Helper function. Close a connection opened by __voise_connect() */
+static void __voise_disconnect(voise_client_t *client, struct voise_stats *stats)
+{
+    voise_close(client);
+
+    __voise_stats_add(stats, VOISE_STAT_CONNS_OPEN, -1);
+}
+
+/*! \brief Helper function. Get a session from the slab (zeroed) */
+static struct voise_speech_info* __voise_speech_info_alloc(void)
+{
+    union voise_speech_info_slot *slot;
+
+    ast_mutex_lock(&voise_speech_info_lock);
+
+    if (voise_speech_info_free == NULL)
+    {
+        struct voise_speech_info_block *block = ast_calloc(1, sizeof(struct voise_speech_info_block));
+
+        if (block == NULL)
+        {
+            ast_mutex_unlock(&voise_speech_info_lock);
+            return NULL;
+        }
+
+        int i;
+        for (i = 0; i < VOISE_SLAB_BLOCK_SIZE; ++i)
+        {
+            block->slots[i].next_free = voise_speech_info_free;
+            voise_speech_info_free = &block->slots[i];
+        }
+
+        AST_LIST_INSERT_HEAD(&voise_speech_info_blocks, block, list);
+    }
+
+    slot = voise_speech_info_free;
+    voise_speech_info_free = slot->next_free;
+    voise_speech_info_used++;
+
+    ast_mutex_unlock(&voise_speech_info_lock);
+
+    memset(&slot->info, 0, sizeof(slot->info));
+
+    return &slot->info;
+}
+
+/*! \brief Helper function. Return a session to the slab */
+static void __voise_speech_info_free(struct voise_speech_info *voise_info)
+{
+    union voise_speech_info_slot *slot = (union voise_speech_info_slot *)voise_info;
+
+    ast_mutex_lock(&voise_speech_info_lock);
+
+    slot->next_free = voise_speech_info_free;
+    voise_speech_info_free = slot;
+    voise_speech_info_used--;
+
+    ast_mutex_unlock(&voise_speech_info_lock);
+}
+
+/*! \brief Helper function. Number of sessions taken from the slab */
+static int __voise_speech_info_in_use(void)
+{
+    int used;
+
+    ast_mutex_lock(&voise_speech_info_lock);
+    used = voise_speech_info_used;
+    ast_mutex_unlock(&voise_speech_info_lock);
+
+    return used;
+}
+
+static void __voise_speech_info_destroy_slab(void)
+{
+    struct voise_speech_info_block *block;
+
+    ast_mutex_lock(&voise_speech_info_lock);
+
+    while ((block = AST_LIST_REMOVE_HEAD(&voise_speech_info_blocks, list)))
+        ast_free(block);
+
+    voise_speech_info_free = NULL;
+
+    ast_mutex_unlock(&voise_speech_info_lock);
+}
+
+static int __voise_interned_hash_fn(const void *obj, int flags)
+{
+    return ast_str_hash(obj);
+}
+
+static int __voise_interned_cmp_fn(void *obj, void *arg, int flags)
+{
+    return strcmp(obj, arg) ? 0 : CMP_MATCH;
+}
+
+/*! \brief Helper function. Find the interned copy of a string, without adding it.
+ * No reference is taken: the pointer is only good to compare with the strings
+ * the caller already holds */
+static const char* __voise_lookup_interned(const char *str)
+{
+    char *interned = ao2_find(voise_interned, str, OBJ_SEARCH_KEY);
+
+    if (interned != NULL)
+        ao2_ref(interned, -1);
+
+    return interned;
+}
+
+/*! \brief Helper function. Get the interned copy of a string, with a reference
+ * released by __voise_unintern() */
+static const char* __voise_intern(const char *str)
+{
+    char *interned = ao2_find(voise_interned, str, OBJ_SEARCH_KEY);
+
+    if (interned == NULL)
+    {
+        ao2_lock(voise_interned);
+
+        interned = ao2_find(voise_interned, str, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+
+        if (interned == NULL)
+        {
+            size_t len = strlen(str) + 1;
+
+            if ((interned = ao2_alloc_options(len, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK)))
+            {
+                memcpy(interned, str, len);
+                ao2_link_flags(voise_interned, interned, OBJ_NOLOCK);
+            }
+        }
+
+        ao2_unlock(voise_interned);
+
+        if (interned == NULL)
+        {
+            ast_log(LOG_ERROR, "Could not intern '%s'\n", str);
+            return NULL;
+        }
+    }
+
+    return interned;
+}
+
+/*! \brief Helper function. Release a string got from __voise_intern(). The last
+ * user removes it from the table */
+static void __voise_unintern(const char *str)
+{
+    char *interned = (char *)str;
+
+    if (interned == NULL)
+        return;
+
+    ao2_lock(voise_interned);
+
+    /* Only the table and this user hold it. Finders take the table lock first */
+    if (ao2_ref(interned, 0) == 2)
+        ao2_unlink_flags(voise_interned, interned, OBJ_NOLOCK);
+
+    ao2_unlock(voise_interned);
+
+    ao2_ref(interned, -1);
+}
+
+/*! \brief Helper function. Release the strings and connection of a session,
+ * and return it to the slab */
+static void __voise_speech_info_release(struct voise_speech_info *voise_info)
+{
+    __voise_unintern(voise_info->lang);
+    __voise_unintern(voise_info->asr_engine);
+
+    ast_free(voise_info->serverip);
+    ast_free(voise_info->client);
+
+    __voise_speech_info_free(voise_info);
+}
+
+/*! \brief Helper function. Check a name: bounded length, letters, digits and '-', '_', '.' only */
+static int __voise_valid_name(const char *name, size_t max_len)
+{
+    size_t len = 0;
+
+    if (ast_strlen_zero(name))
+        return 0;
+
+    for (; *name; ++name, ++len)
+    {
+        if (len >= max_len)
+            return 0;
+
+        if (!isalnum((unsigned char)*name) && *name != '-' && *name != '_' && *name != '.')
+            return 0;
+    }
+
+    return 1;
+}
+
+/*! \brief Helper function. Check a model name: bounded length, no control characters */
+static int __voise_valid_model_name(const char *model_name)
+{
+    size_t len = 0;
+
+    for (; *model_name; ++model_name, ++len)
+    {
+        if (len >= VOISE_MAX_MODEL_NAME_LEN || iscntrl((unsigned char)*model_name))
+            return 0;
+    }
+
+    return 1;
+}
+
 /*! \brief Helper function. Test config file  */
 static int __init_voise_res_speech(void)
 {
@@ -153,6 +692,13 @@ static int __init_voise_res_speech(void)
         return -1;
     }
 
+    /* Grammar table size */
+    const char *vgrammarcachesize;
+    if ( !(vgrammarcachesize = ast_variable_retrieve(vcfg, "general", "grammar_cache_size")))
+        vgrammarcachesize = VOISE_DEF_GRAMMAR_CACHE_SIZE;
+
+    voise_grammar_cache_size = atoi(vgrammarcachesize);
+
     ast_config_destroy(vcfg);
 
     return 1;
@@ -240,10 +786,11 @@ static int __voise_set_lang(struct ast_speech *speech, const char *lang)
     struct voise_speech_info *voise_info;
     voise_info = (struct voise_speech_info *)speech->data;
 
-    if (voise_info != NULL)
+    if (voise_info != NULL && __voise_valid_name(lang, VOISE_MAX_LANG_LEN)
+        && (lang = __voise_intern(lang)) != NULL)
     {
-        strncpy(voise_info->lang, lang, strlen(lang));
-        voise_info->lang[strlen(lang)] = '\0';
+        __voise_unintern(voise_info->lang);
+        voise_info->lang = lang;
         return 0;
     }
     else
@@ -278,10 +825,11 @@ static int __voise_set_asr_engine(struct ast_speech *speech, const char *asr_eng
     struct voise_speech_info *voise_info;
     voise_info = (struct voise_speech_info *)speech->data;
 
-    if (voise_info != NULL)
+    if (voise_info != NULL && __voise_valid_name(asr_engine, VOISE_MAX_ASR_ENGINE_LEN)
+        && (asr_engine = __voise_intern(asr_engine)) != NULL)
     {
-        strncpy(voise_info->asr_engine, asr_engine, strlen(asr_engine));
-        voise_info->asr_engine[strlen(asr_engine)] = '\0';
+        __voise_unintern(voise_info->asr_engine);
+        voise_info->asr_engine = asr_engine;
         return 0;
     }
     else
@@ -306,44 +854,6 @@ static const char* __voise_get_asr_engine(struct ast_speech *speech)
     return voise_info->asr_engine;
 }
 
-/*! \brief Helper function. Set model*/
-static int __voise_set_model(struct ast_speech *speech, const char *model_name)
-{
-    TRACE_FUNCTION();
-
-    CHECK_NOT_NULL(speech, "Speech is NULL", -1);
-
-    struct voise_speech_info *voise_info;
-    voise_info = (struct voise_speech_info *)speech->data;
-
-    if (voise_info != NULL)
-    {
-        strncpy(voise_info->model_name, model_name, strlen(model_name));
-        voise_info->model_name[strlen(model_name)] = '\0';
-        return 0;
-    }
-    else
-    {
-        ast_log(LOG_ERROR, "Could not set model to %s\n", model_name);
-        return -1;
-    }
-}
-
-/*! \brief Helper function. Get model*/
-static const char* __voise_get_model(struct ast_speech *speech)
-{
-    TRACE_FUNCTION();
-
-    CHECK_NOT_NULL(speech, "Speech is NULL", NULL);
-
-    struct voise_speech_info *voise_info;
-    voise_info = (struct voise_speech_info *)speech->data;
-
-    CHECK_NOT_NULL(voise_info, "Could not get model", NULL);
-
-    return voise_info->model_name;
-}
-
 /*! \brief Helper function. Set maximum initial silence*/
 static int __voise_set_initsilence(struct ast_speech *speech, int initsil)
 {
@@ -500,22 +1010,1035 @@ static void __voise_set_result(struct ast_speech *speech, voise_response_t *vois
     ast_speech_change_state(speech, AST_SPEECH_STATE_DONE);
 }
 
-/* ******************************************** */
-/* ********* Speech API implementation ******** */
-/* ******************************************** */
+/* ********************************* */
+/* ********* Grammar cache ********* */
+/* ********************************* */
 
-/*! \brief Find a speech recognition engine of specified name, if NULL then use the default one */
-static int voise_create(struct ast_speech *speech, int format)
+static void __voise_grammar_destructor(void *obj)
 {
-    TRACE_FUNCTION();
+    struct voise_grammar *grammar = obj;
 
-    CHECK_NOT_NULL(speech, "Speech is NULL", -1);
+    ast_free(grammar->content);
+}
 
-    if (speech->data == NULL)
-    {
-        speech->data = ast_calloc(1, sizeof(struct voise_speech_info));
+static int __voise_grammar_hash_fn(const void *obj, int flags)
+{
+    const struct voise_grammar *grammar;
+    const char *key;
 
-        CHECK_NOT_NULL(speech->data, "Voise info is NULL", -1);
+    switch (flags & OBJ_SEARCH_MASK)
+    {
+    case OBJ_SEARCH_KEY:
+        key = obj;
+        break;
+    case OBJ_SEARCH_OBJECT:
+        grammar = obj;
+        key = grammar->hash;
+        break;
+    default:
+        ast_assert(0);
+        return 0;
+    }
+
+    return ast_str_hash(key);
+}
+
+static int __voise_grammar_cmp_fn(void *obj, void *arg, int flags)
+{
+    const struct voise_grammar *left = obj;
+    const struct voise_grammar *right = arg;
+    const char *right_key = arg;
+
+    switch (flags & OBJ_SEARCH_MASK)
+    {
+    case OBJ_SEARCH_OBJECT:
+        right_key = right->hash;
+        /* Fall through */
+    case OBJ_SEARCH_KEY:
+        return strcmp(left->hash, right_key) ? 0 : CMP_MATCH;
+    default:
+        return 0;
+    }
+}
+
+/*! \brief Helper function. Find the least recently used grammar not loaded by any session */
+static int __voise_grammar_lru_cb(void *obj, void *arg, int flags)
+{
+    struct voise_grammar *grammar = obj;
+    struct voise_grammar **lru = arg;
+
+    if (grammar->users > 0)
+        return 0;
+
+    if (*lru == NULL || ast_tvdiff_ms(grammar->last_used, (*lru)->last_used) < 0)
+        *lru = grammar;
+
+    return 0;
+}
+
+/*! \brief Helper function. Evict unused grammars above the table size. Table must be locked */
+static void __voise_grammar_evict(void)
+{
+    while (ao2_container_count(voise_grammars) > voise_grammar_cache_size)
+    {
+        struct voise_grammar *lru = NULL;
+
+        ao2_callback(voise_grammars, OBJ_NOLOCK | OBJ_NODATA, __voise_grammar_lru_cb, &lru);
+
+        /* Every grammar is in use */
+        if (lru == NULL)
+            break;
+
+        ast_log(LOG_DEBUG, "Evicting grammar %s\n", lru->model_id);
+
+        ao2_unlink_flags(voise_grammars, lru, OBJ_NOLOCK);
+    }
+}
+
+/*! \brief Helper function. Get (or add) the shared grammar for a content. Returns a new reference */
+static struct voise_grammar* __voise_grammar_acquire(const char *content)
+{
+    char hash[41];
+    struct voise_grammar *grammar;
+
+    ast_sha1_hash(hash, content);
+
+    ao2_lock(voise_grammars);
+
+    grammar = ao2_find(voise_grammars, hash, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+
+    if (grammar == NULL)
+    {
+        grammar = ao2_alloc(sizeof(struct voise_grammar), __voise_grammar_destructor);
+
+        if (grammar == NULL || !(grammar->content = ast_strdup(content)))
+        {
+            ao2_unlock(voise_grammars);
+            ao2_cleanup(grammar);
+            return NULL;
+        }
+
+        ast_copy_string(grammar->hash, hash, sizeof(grammar->hash));
+        snprintf(grammar->model_id, sizeof(grammar->model_id), "grammar-%s", hash);
+
+        ao2_link_flags(voise_grammars, grammar, OBJ_NOLOCK);
+    }
+
+    grammar->users++;
+    grammar->last_used = ast_tvnow();
+
+    __voise_grammar_evict();
+
+    ao2_unlock(voise_grammars);
+
+    return grammar;
+}
+
+/*! \brief Helper function. Release a grammar got from __voise_grammar_acquire */
+static void __voise_grammar_release(struct voise_grammar *grammar)
+{
+    ao2_lock(voise_grammars);
+
+    grammar->users--;
+
+    __voise_grammar_evict();
+
+    ao2_unlock(voise_grammars);
+
+    ao2_ref(grammar, -1);
+}
+
+/*! \brief Helper function. Get/set whether the server already has the grammar */
+static int __voise_grammar_is_uploaded(struct voise_grammar *grammar)
+{
+    int uploaded;
+
+    ao2_lock(voise_grammars);
+    uploaded = grammar->uploaded;
+    grammar->last_used = ast_tvnow();
+    ao2_unlock(voise_grammars);
+
+    return uploaded;
+}
+
+static void __voise_grammar_set_uploaded(struct voise_grammar *grammar, int uploaded)
+{
+    ao2_lock(voise_grammars);
+    grammar->uploaded = uploaded;
+    ao2_unlock(voise_grammars);
+}
+
+/*! \brief Helper function. Find a grammar loaded in the session */
+static struct voise_loaded_grammar* __voise_find_loaded_grammar(struct voise_speech_info *voise_info, const char *grammar_name)
+{
+    struct voise_loaded_grammar *loaded;
+
+    /* Names are interned: compare by address */
+    AST_LIST_TRAVERSE(&voise_info->loaded_grammars, loaded, list)
+    {
+        if (loaded->name == grammar_name)
+            return loaded;
+    }
+
+    return NULL;
+}
+
+static void __voise_free_loaded_grammar(struct voise_loaded_grammar *loaded)
+{
+    __voise_grammar_release(loaded->grammar);
+    __voise_unintern(loaded->name);
+    ast_free(loaded);
+}
+
+/*! \brief Helper function. Find an active grammar by name. Returns its index or -1 */
+static int __voise_find_active_grammar(struct voise_speech_info *voise_info, const char *grammar_name)
+{
+    int i;
+
+    /* Names are interned: compare by address */
+    for (i = 0; i < voise_info->num_active_grammars; ++i)
+    {
+        if (voise_info->active_grammars[i].name == grammar_name)
+            return i;
+    }
+
+    return -1;
+}
+
+/*! \brief Helper function. Activate a grammar. grammar_name must be interned;
+ * grammar is NULL when model_name is a server model. The active grammar holds
+ * references of its own on both names */
+static int __voise_add_active_grammar(struct voise_speech_info *voise_info, const char *grammar_name,
+    const char *model_name, struct voise_grammar *grammar)
+{
+    if (__voise_find_active_grammar(voise_info, grammar_name) >= 0)
+        return 0;
+
+    if (voise_info->num_active_grammars >= VOISE_MAX_ACTIVE_GRAMMARS)
+    {
+        ast_log(LOG_ERROR, "Could not activate '%s': maximum of %d active grammars\n",
+            grammar_name, VOISE_MAX_ACTIVE_GRAMMARS);
+        return -1;
+    }
+
+    if (!__voise_valid_model_name(model_name) || (model_name = __voise_intern(model_name)) == NULL)
+    {
+        ast_log(LOG_ERROR, "Invalid model name for grammar '%s'\n", grammar_name);
+        return -1;
+    }
+
+    struct voise_active_grammar *active = &voise_info->active_grammars[voise_info->num_active_grammars];
+
+    active->name = __voise_intern(grammar_name);
+    active->model_name = model_name;
+
+    if (grammar != NULL)
+        ao2_ref(grammar, +1);
+
+    active->grammar = grammar;
+
+    voise_info->num_active_grammars++;
+
+    return 0;
+}
+
+/*! \brief Helper function. Deactivate the grammar at index */
+static void __voise_remove_active_grammar(struct voise_speech_info *voise_info, int index)
+{
+    struct voise_active_grammar *active = &voise_info->active_grammars[index];
+
+    ao2_cleanup(active->grammar);
+    __voise_unintern(active->name);
+    __voise_unintern(active->model_name);
+
+    voise_info->num_active_grammars--;
+
+    memmove(active, active + 1, (voise_info->num_active_grammars - index) * sizeof(*active));
+    memset(&voise_info->active_grammars[voise_info->num_active_grammars], 0, sizeof(*active));
+}
+
+/*! \brief Helper function. Start a recognition on a connection.
+ * The content of an uploaded grammar is sent only the first time; after
+ * that the server already has it compiled and it is referenced by model id */
+static int __voise_start_stream(voise_client_t *client, struct voise_stats *stats, const char *lang,
+    const char *asr_engine, const char *model_name, struct voise_grammar *grammar, int verbose)
+{
+    const char *grammar_content = NULL;
+
+    if (grammar != NULL && !__voise_grammar_is_uploaded(grammar))
+        grammar_content = grammar->content;
+
+    struct timeval start = ast_tvnow();
+
+    voise_response_t response;
+    int ret = voise_start_streaming_recognize(
+        client, &response, "LINEAR16", 8000, lang, grammar_content, model_name, asr_engine);
+
+    if (ret >= 0 && response.result_code != 201 && grammar != NULL && grammar_content == NULL)
+    {
+        /* The server lost the grammar (e.g. restart). Upload it again */
+        if (verbose)
+            ast_log(LOG_NOTICE, "Uploading grammar %s again\n", model_name);
+
+        __voise_grammar_set_uploaded(grammar, 0);
+
+        grammar_content = grammar->content;
+
+        ret = voise_start_streaming_recognize(
+            client, &response, "LINEAR16", 8000, lang, grammar_content, model_name, asr_engine);
+    }
+
+    if (ret < 0)
+    {
+        ast_log(LOG_ERROR, "Streaming start error: %d\n", ret);
+        return -1;
+    }
+
+    if (response.result_code != 201)
+    {
+        ast_log(LOG_ERROR, "Streaming not started: %s\n", response.result_message);
+        return -1;
+    }
+
+    __voise_hist_since(VOISE_HIST_START, start);
+
+    if (grammar_content != NULL)
+    {
+        __voise_grammar_set_uploaded(grammar, 1);
+        __voise_stats_add(stats, VOISE_STAT_BYTES_SENT, strlen(grammar_content));
+    }
+
+    return 0;
+}
+
+/* ********************************* */
+/* ******* Parallel streams ******** */
+/* ********************************* */
+
+/*! \brief Sender thread of a parallel stream */
+static void* __voise_stream_thread(void *data)
+{
+    struct voise_stream *stream = data;
+
+    int ret = __voise_start_stream(stream->client, stream->stats, stream->lang, stream->asr_engine,
+        stream->active->model_name, stream->active->grammar, stream->verbose);
+
+    ast_mutex_lock(&stream->lock);
+
+    stream->started = 1;
+    stream->error = (ret < 0);
+
+    ast_cond_broadcast(&stream->cond);
+
+    while (!stream->error)
+    {
+        if (stream->count == 0)
+        {
+            if (stream->stop)
+                break;
+
+            ast_cond_wait(&stream->cond, &stream->lock);
+            continue;
+        }
+
+        struct voise_audio_chunk *chunk = stream->queue[stream->head];
+
+        stream->head = (stream->head + 1) % VOISE_STREAM_QUEUE_LEN;
+        stream->count--;
+
+        ast_mutex_unlock(&stream->lock);
+
+        ret = voise_data_streaming_recognize(stream->client, chunk->data, chunk->len);
+
+        if (ret >= 0)
+            __voise_stats_add(stream->stats, VOISE_STAT_BYTES_SENT, chunk->len);
+
+        ao2_ref(chunk, -1);
+
+        ast_mutex_lock(&stream->lock);
+
+        if (ret < 0)
+        {
+            ast_log(LOG_ERROR, "Streaming data error (%s): %d\n", stream->active->name, ret);
+            stream->error = 1;
+        }
+    }
+
+    int error = stream->error;
+
+    ast_mutex_unlock(&stream->lock);
+
+    if (!error)
+    {
+        ret = voise_stop_streaming_recognize(stream->client, &stream->response);
+
+        if (ret < 0)
+        {
+            ast_log(LOG_ERROR, "Streaming stop error (%s): %d\n", stream->active->name, ret);
+
+            ast_mutex_lock(&stream->lock);
+            stream->error = 1;
+            ast_mutex_unlock(&stream->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*! \brief Helper function. Stop the sender threads and free the parallel streams */
+static void __voise_streams_join(struct voise_speech_info *voise_info)
+{
+    int i;
+
+    for (i = 0; i < voise_info->num_streams; ++i)
+    {
+        struct voise_stream *stream = &voise_info->streams[i];
+
+        ast_mutex_lock(&stream->lock);
+        stream->stop = 1;
+        ast_cond_signal(&stream->cond);
+        ast_mutex_unlock(&stream->lock);
+    }
+
+    for (i = 0; i < voise_info->num_streams; ++i)
+    {
+        struct voise_stream *stream = &voise_info->streams[i];
+
+        if (stream->thread != AST_PTHREADT_NULL)
+            pthread_join(stream->thread, NULL);
+
+        if (stream->dropped > 0)
+            ast_log(LOG_WARNING, "Stream of grammar '%s' dropped %d audio chunks\n", stream->active->name, stream->dropped);
+
+        /* Audio not sent because of an error */
+        while (stream->count > 0)
+        {
+            ao2_ref(stream->queue[stream->head], -1);
+            stream->head = (stream->head + 1) % VOISE_STREAM_QUEUE_LEN;
+            stream->count--;
+        }
+
+        ast_mutex_destroy(&stream->lock);
+        ast_cond_destroy(&stream->cond);
+    }
+}
+
+static void __voise_streams_free(struct voise_speech_info *voise_info)
+{
+    ast_free(voise_info->streams);
+    voise_info->streams = NULL;
+    voise_info->num_streams = 0;
+}
+
+/*! \brief Helper function. Drop the parallel streams of a recognition, if any */
+static void __voise_streams_abort(struct voise_speech_info *voise_info)
+{
+    if (voise_info->streams == NULL)
+        return;
+
+    __voise_streams_join(voise_info);
+    __voise_streams_free(voise_info);
+}
+
+/*! \brief Helper function. Start one stream per active grammar, in parallel */
+static int __voise_streams_start(struct voise_speech_info *voise_info, const char *lang, const char *asr_engine)
+{
+    int i;
+    int num_started = 0;
+
+    voise_info->streams = ast_calloc(voise_info->num_active_grammars, sizeof(struct voise_stream));
+
+    CHECK_NOT_NULL(voise_info->streams, "Could not alloc streams", -1);
+
+    voise_info->num_streams = voise_info->num_active_grammars;
+
+    for (i = 0; i < voise_info->num_streams; ++i)
+    {
+        struct voise_stream *stream = &voise_info->streams[i];
+
+        stream->active = &voise_info->active_grammars[i];
+        stream->lang = lang;
+        stream->asr_engine = asr_engine;
+        stream->verbose = voise_info->verbose;
+        stream->thread = AST_PTHREADT_NULL;
+
+        ast_mutex_init(&stream->lock);
+        ast_cond_init(&stream->cond, NULL);
+
+        if (i == 0)
+        {
+            stream->client = voise_info->client;
+            stream->stats = voise_info->stats;
+        }
+        else
+        {
+            /* Extra connections are opened on first use and kept for the session */
+            if (voise_info->fanout_clients[i] == NULL)
+            {
+                voise_client_t *client = ast_calloc(1, sizeof(voise_client_t));
+
+                if (client != NULL && __voise_connect(client, voise_info->serverip, &voise_info->fanout_stats[i]) < 0)
+                {
+                    ast_free(client);
+                    client = NULL;
+                }
+
+                voise_info->fanout_clients[i] = client;
+            }
+
+            stream->client = voise_info->fanout_clients[i];
+            stream->stats = voise_info->fanout_stats[i];
+        }
+
+        if (stream->client == NULL
+            || ast_pthread_create_background(&stream->thread, NULL, __voise_stream_thread, stream))
+        {
+            ast_log(LOG_ERROR, "Could not start stream of grammar '%s'\n", stream->active->name);
+
+            stream->thread = AST_PTHREADT_NULL;
+            stream->started = 1;
+            stream->error = 1;
+        }
+    }
+
+    for (i = 0; i < voise_info->num_streams; ++i)
+    {
+        struct voise_stream *stream = &voise_info->streams[i];
+
+        ast_mutex_lock(&stream->lock);
+
+        while (!stream->started)
+            ast_cond_wait(&stream->cond, &stream->lock);
+
+        if (!stream->error)
+            num_started++;
+
+        ast_mutex_unlock(&stream->lock);
+    }
+
+    if (num_started == 0)
+    {
+        __voise_streams_join(voise_info);
+        __voise_streams_free(voise_info);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*! \brief Helper function. Queue audio to every parallel stream */
+static int __voise_streams_write(struct voise_speech_info *voise_info, void *data, int len)
+{
+    int i;
+    int num_alive = 0;
+
+    struct voise_audio_chunk *chunk = ao2_alloc_options(sizeof(struct voise_audio_chunk) + len,
+        NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+    CHECK_NOT_NULL(chunk, "Could not alloc audio chunk", -1);
+
+    chunk->len = len;
+    memcpy(chunk->data, data, len);
+
+    for (i = 0; i < voise_info->num_streams; ++i)
+    {
+        struct voise_stream *stream = &voise_info->streams[i];
+
+        ast_mutex_lock(&stream->lock);
+
+        if (!stream->error)
+        {
+            num_alive++;
+
+            if (stream->count < VOISE_STREAM_QUEUE_LEN)
+            {
+                ao2_ref(chunk, +1);
+                stream->queue[(stream->head + stream->count) % VOISE_STREAM_QUEUE_LEN] = chunk;
+                stream->count++;
+
+                ast_cond_signal(&stream->cond);
+            }
+            else if (stream->dropped++ == 0)
+            {
+                /* Reported once here, and with the total when the stream stops */
+                ast_log(LOG_WARNING, "Stream of grammar '%s' is too late, dropping audio\n", stream->active->name);
+            }
+        }
+
+        ast_mutex_unlock(&stream->lock);
+    }
+
+    ao2_ref(chunk, -1);
+
+    return num_alive > 0 ? 0 : -1;
+}
+
+/*! \brief Helper function. Set the results of the parallel streams, best score first */
+static int __voise_streams_set_results(struct ast_speech *speech, struct voise_speech_info *voise_info)
+{
+    TRACE_FUNCTION();
+
+    int i;
+    struct ast_speech_result *results = NULL;
+
+    ast_speech_change_state(speech, AST_SPEECH_STATE_WAIT);
+
+    for (i = 0; i < voise_info->num_streams; ++i)
+    {
+        struct voise_stream *stream = &voise_info->streams[i];
+
+        if (stream->error)
+            continue;
+
+        struct ast_speech_result *result = ast_calloc(1, sizeof(struct ast_speech_result));
+
+        if (result == NULL)
+            break;
+
+        /* The grammar that produced the result, for the dialplan to tell them apart */
+        result->score = (int)(stream->response.confidence * stream->response.probability * 100);
+        result->text = ast_strdup(stream->response.utterance);
+        result->grammar = ast_strdup(stream->active->name);
+
+        __voise_stats_add(stream->stats, VOISE_STAT_BYTES_RECEIVED,
+            strlen(stream->response.utterance) + strlen(stream->response.intent));
+
+        if (voise_info->verbose)
+            ast_log(LOG_NOTICE, "Grammar '%s': '%s', intent '%s' (score %d)\n", result->grammar, result->text,
+                stream->response.intent, result->score);
+
+        /* Keep the list sorted by score */
+        struct ast_speech_result **pos = &results;
+
+        while (*pos != NULL && (*pos)->score >= result->score)
+            pos = &(*pos)->list.next;
+
+        result->list.next = *pos;
+        *pos = result;
+    }
+
+    if (results == NULL)
+        return -1;
+
+    struct ast_speech_result *result;
+    for (i = 0, result = results; result; result = result->list.next)
+        result->nbest_number = i++;
+
+    speech->results = results;
+    speech->flags = AST_SPEECH_HAVE_RESULTS;
+
+    ast_speech_change_state(speech, AST_SPEECH_STATE_DONE);
+
+    return 0;
+}
+
+/* ********************************* */
+/* ************ Warm-up ************ */
+/* ********************************* */
+
+/*! \brief Helper function. Run a short recognition of silence so the server loads the model */
+static int __voise_warmup_model(const char *server, const char *model_name, const char *lang, const char *asr_engine)
+{
+    TRACE_FUNCTION();
+
+    /* 20 ms of signed linear silence at 8 kHz */
+    short silence[160];
+    memset(silence, 0, sizeof(silence));
+
+    struct timeval start = ast_tvnow();
+
+    voise_client_t client;
+    int ret = voise_init(&client, server, VOISE_SERVER_PORT, 1, __voise_capture_error_cb);
+
+    if (ret < 0)
+    {
+        ast_log(LOG_WARNING, "Warm-up: could not connect to Voise server (%s).\n", server);
+        return -1;
+    }
+
+    voise_response_t response;
+    ret = voise_start_streaming_recognize(&client, &response, "LINEAR16", 8000, lang, NULL, model_name, asr_engine);
+
+    if (ret >= 0 && response.result_code != 201)
+    {
+        ast_log(LOG_WARNING, "Warm-up of '%s' not started on %s: %s\n", model_name, server, response.result_message);
+        ret = -1;
+    }
+
+    int sent;
+    for (sent = 0; ret >= 0 && sent < VOISE_WARMUP_AUDIO_MS; sent += 20)
+        ret = voise_data_streaming_recognize(&client, silence, sizeof(silence));
+
+    if (ret >= 0)
+        ret = voise_stop_streaming_recognize(&client, &response);
+
+    voise_close(&client);
+
+    if (ret < 0)
+        return -1;
+
+    return (int)ast_tvdiff_ms(ast_tvnow(), start);
+}
+
+static void __voise_free_warmup_results(struct voise_warmup_results *results)
+{
+    struct voise_warmup_result *result;
+
+    while ((result = AST_LIST_REMOVE_HEAD(results, list)))
+        ast_free(result);
+}
+
+/*! \brief Warm up every model of the [warmup] section on every server. Returns -1 if already running */
+static int __voise_warmup(void)
+{
+    TRACE_FUNCTION();
+
+    if (ast_mutex_trylock(&voise_warmup_lock))
+        return -1;
+
+    struct ast_config *vcfg = voise_load_asterisk_config();
+
+    if (!vcfg)
+    {
+        ast_log(LOG_ERROR, "Error opening configuration file %s\n", VOISE_CFG);
+        ast_mutex_unlock(&voise_warmup_lock);
+        return 0;
+    }
+
+    const char *vserverip;
+    if ( !(vserverip = ast_variable_retrieve(vcfg, "general", "serverip")) )
+        vserverip = VOISE_DEF_HOST;
+
+    const char *vlang;
+    if ( !(vlang = ast_variable_retrieve(vcfg, "general", "lang")))
+        vlang = VOISE_DEF_LANG;
+
+    const char *vasrengine;
+    if ( !(vasrengine = ast_variable_retrieve(vcfg, "general", "asr_engine")))
+        vasrengine = VOISE_DEF_ASR_ENGINE;
+
+    struct voise_warmup_results results;
+    AST_LIST_HEAD_INIT_NOLOCK(&results);
+
+    struct ast_variable *var;
+    for (var = ast_variable_browse(vcfg, "warmup"); var && !voise_warmup_stop; var = var->next)
+    {
+        if (strcasecmp(var->name, "model"))
+        {
+            ast_log(LOG_WARNING, "Unknown warm-up option %s\n", var->name);
+            continue;
+        }
+
+        /* model=name[,lang][,asr_engine]. Heap copies: the stack of the loop must not grow */
+        char *value = ast_strdup(var->value);
+        char *parse = value;
+        char *model_name = parse ? ast_strip(strsep(&parse, ",")) : NULL;
+        char *lang = parse ? ast_strip(strsep(&parse, ",")) : NULL;
+        char *asr_engine = parse ? ast_strip(parse) : NULL;
+
+        char *servers_copy = ast_strlen_zero(model_name) ? NULL : ast_strdup(vserverip);
+        char *servers = servers_copy;
+        char *server;
+
+        while (servers && !voise_warmup_stop && (server = strsep(&servers, ",")))
+        {
+            server = ast_strip(server);
+
+            if (ast_strlen_zero(server))
+                continue;
+
+            struct voise_warmup_result *result = ast_calloc(1, sizeof(struct voise_warmup_result));
+
+            if (result == NULL)
+                break;
+
+            ast_copy_string(result->server, server, sizeof(result->server));
+            ast_copy_string(result->model_name, model_name, sizeof(result->model_name));
+            ast_copy_string(result->lang, ast_strlen_zero(lang) ? vlang : lang, sizeof(result->lang));
+            ast_copy_string(result->asr_engine, ast_strlen_zero(asr_engine) ? vasrengine : asr_engine, sizeof(result->asr_engine));
+
+            result->elapsed = __voise_warmup_model(result->server, result->model_name, result->lang, result->asr_engine);
+
+            ast_log(LOG_NOTICE, "Warm-up of '%s' (%s, %s) on %s: %d ms\n",
+                result->model_name, result->lang, result->asr_engine, result->server, result->elapsed);
+
+            AST_LIST_INSERT_TAIL(&results, result, list);
+        }
+
+        ast_free(servers_copy);
+        ast_free(value);
+
+        if (voise_warmup_stop)
+            break;
+    }
+
+    ast_config_destroy(vcfg);
+
+    /* Publish the new results */
+    ast_mutex_lock(&voise_warmup_last_lock);
+
+    struct voise_warmup_results old = voise_warmup_last;
+    voise_warmup_last = results;
+
+    ast_mutex_unlock(&voise_warmup_last_lock);
+
+    __voise_free_warmup_results(&old);
+
+    ast_mutex_unlock(&voise_warmup_lock);
+
+    return 0;
+}
+
+static void* __voise_warmup_thread(void *data)
+{
+    __voise_warmup();
+
+    return NULL;
+}
+
+static void __voise_show_warmup(int fd)
+{
+    struct voise_warmup_result *result;
+
+    ast_cli(fd, "%-20s %-30s %-8s %-8s %s\n", "Server", "Model", "Lang", "Engine", "Time (ms)");
+
+    ast_mutex_lock(&voise_warmup_last_lock);
+
+    AST_LIST_TRAVERSE(&voise_warmup_last, result, list)
+    {
+        if (result->elapsed < 0)
+            ast_cli(fd, "%-20s %-30s %-8s %-8s %s\n", result->server, result->model_name, result->lang, result->asr_engine, "failed");
+        else
+            ast_cli(fd, "%-20s %-30s %-8s %-8s %d\n", result->server, result->model_name, result->lang, result->asr_engine, result->elapsed);
+    }
+
+    ast_mutex_unlock(&voise_warmup_last_lock);
+}
+
+static char* handle_cli_voise_warmup(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise warmup";
+        e->usage =
+            "Usage: voise warmup\n"
+            "       Load the models of the [warmup] section of voise.conf on every server.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 2)
+        return CLI_SHOWUSAGE;
+
+    if (__voise_warmup() < 0)
+    {
+        ast_cli(a->fd, "Warm-up already running\n");
+        return CLI_FAILURE;
+    }
+
+    __voise_show_warmup(a->fd);
+
+    return CLI_SUCCESS;
+}
+
+static char* handle_cli_voise_show_warmup(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show warmup";
+        e->usage =
+            "Usage: voise show warmup\n"
+            "       Show the time taken by the last warm-up of each model.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+
+    __voise_show_warmup(a->fd);
+
+    return CLI_SUCCESS;
+}
+
+static void __voise_show_stats_row(int fd, const char *server, const int64_t *counters)
+{
+    ast_cli(fd, "%-20s %8" PRId64 " %6" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64
+        " %12" PRId64 " %12" PRId64 "\n", server,
+        counters[VOISE_STAT_SESSIONS], counters[VOISE_STAT_CONNS_OPEN], counters[VOISE_STAT_RECOG_STARTED],
+        counters[VOISE_STAT_END_INITSIL], counters[VOISE_STAT_END_MAXSIL], counters[VOISE_STAT_END_ABS_TIMEOUT],
+        counters[VOISE_STAT_END_ERROR], counters[VOISE_STAT_BYTES_SENT], counters[VOISE_STAT_BYTES_RECEIVED]);
+}
+
+static char* handle_cli_voise_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show stats";
+        e->usage =
+            "Usage: voise show stats\n"
+            "       Show the recognition counters of each server: active sessions,\n"
+            "       open connections, recognitions started and how they ended, and\n"
+            "       bytes sent and received. The applications' syntheses are in\n"
+            "       'voise show tts stats'.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+
+    struct voise_stats *stats;
+    int64_t total[VOISE_STAT_MAX] = { 0 };
+    int64_t counters[VOISE_STAT_MAX];
+    int i;
+
+    ast_cli(a->fd, "%-20s %8s %6s %8s %8s %8s %8s %8s %12s %12s\n", "Server", "Sessions", "Conns",
+        "Started", "InitSil", "MaxSil", "AbsTime", "Error", "Sent", "Received");
+
+    AST_RWLIST_RDLOCK(&voise_stats_servers);
+
+    AST_RWLIST_TRAVERSE(&voise_stats_servers, stats, list)
+    {
+        for (i = 0; i < VOISE_STAT_MAX; ++i)
+        {
+            counters[i] = __voise_stats_get(stats, i);
+            total[i] += counters[i];
+        }
+
+        __voise_show_stats_row(a->fd, stats->server, counters);
+    }
+
+    AST_RWLIST_UNLOCK(&voise_stats_servers);
+
+    __voise_show_stats_row(a->fd, "Total", total);
+
+    return CLI_SUCCESS;
+}
+
+/*! \brief Helper function. Show the latency histograms, in milliseconds */
+static void __voise_show_latency(int fd)
+{
+    uint64_t buckets[VOISE_HIST_BUCKETS];
+    int i, j;
+
+    ast_cli(fd, "%-16s %10s %10s %10s %10s %10s %10s %10s\n", "Phase", "Count", "Mean", "p50", "p90", "p99", "p999", "Max");
+
+    for (i = 0; i < VOISE_HIST_MAX; ++i)
+    {
+        struct voise_histogram *h = &voise_histograms[i];
+        uint64_t count = 0;
+
+        for (j = 0; j < VOISE_HIST_BUCKETS; ++j)
+        {
+            buckets[j] = __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+            count += buckets[j];
+        }
+
+        uint64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+        ast_cli(fd, "%-16s %10" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", voise_hist_names[i], count,
+            count ? sum / 1000.0 / count : 0.0,
+            __voise_hist_percentile(buckets, count, 50) / 1000.0,
+            __voise_hist_percentile(buckets, count, 90) / 1000.0,
+            __voise_hist_percentile(buckets, count, 99) / 1000.0,
+            __voise_hist_percentile(buckets, count, 99.9) / 1000.0,
+            max / 1000.0);
+    }
+}
+
+static char* handle_cli_voise_show_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise show latency";
+        e->usage =
+            "Usage: voise show latency\n"
+            "       Show the latency percentiles (in milliseconds) of each phase of\n"
+            "       recognition: connection, stream start, voise_write(), result\n"
+            "       after the stream is stopped, and result after the end of speech.\n"
+            "       The applications' syntheses are in 'voise show tts latency'.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+
+    __voise_show_latency(a->fd);
+
+    return CLI_SUCCESS;
+}
+
+static char* handle_cli_voise_reset_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd)
+    {
+    case CLI_INIT:
+        e->command = "voise reset latency";
+        e->usage =
+            "Usage: voise reset latency\n"
+            "       Clear the recognition latency histograms.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+
+    int i, j;
+
+    /* Latencies recorded meanwhile may be half cleared: good enough for a reset */
+    for (i = 0; i < VOISE_HIST_MAX; ++i)
+    {
+        struct voise_histogram *h = &voise_histograms[i];
+
+        for (j = 0; j < VOISE_HIST_BUCKETS; ++j)
+            __atomic_store_n(&h->buckets[j], 0, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+    }
+
+    ast_cli(a->fd, "Latency histograms cleared\n");
+
+    return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry voise_cli[] = {
+    AST_CLI_DEFINE(handle_cli_voise_warmup, "Warm up Voise models"),
+    AST_CLI_DEFINE(handle_cli_voise_show_warmup, "Show Voise warm-up times"),
+    AST_CLI_DEFINE(handle_cli_voise_show_stats, "Show Voise recognition counters"),
+    AST_CLI_DEFINE(handle_cli_voise_show_latency, "Show Voise recognition latencies"),
+    AST_CLI_DEFINE(handle_cli_voise_reset_latency, "Clear Voise recognition latencies"),
+};
+
+/* ******************************************** */
+/* ********* Speech API implementation ******** */
+/* ******************************************** */
+
+/*! \brief Find a speech recognition engine of specified name, if NULL then use the default one */
+static int voise_create(struct ast_speech *speech, int format)
+{
+    TRACE_FUNCTION();
+
+    CHECK_NOT_NULL(speech, "Speech is NULL", -1);
+
+    if (speech->data == NULL)
+    {
+        speech->data = __voise_speech_info_alloc();
+
+        CHECK_NOT_NULL(speech->data, "Voise info is NULL", -1);
     }
 
     struct ast_config *vcfg = voise_load_asterisk_config();
@@ -523,6 +2046,8 @@ static int voise_create(struct ast_speech *speech, int format)
     if (!vcfg)
     {
         ast_log(LOG_ERROR, "Error opening configuration file %s\n", VOISE_CFG);
+        __voise_speech_info_release(speech->data);
+        speech->data = NULL;
         return -1;
     }
 
@@ -539,16 +2064,16 @@ static int voise_create(struct ast_speech *speech, int format)
     if ( !(vlang = ast_variable_retrieve(vcfg, "general", "lang")))
         vlang = VOISE_DEF_LANG;
 
-    if (vlang != NULL)
-        __voise_set_lang(speech, vlang);
+    if (vlang == NULL || __voise_set_lang(speech, vlang) < 0)
+        __voise_set_lang(speech, VOISE_DEF_LANG);
 
     /* Default ASR engine */
     const char *vasrengine;
     if ( !(vasrengine = ast_variable_retrieve(vcfg, "general", "asr_engine")))
         vasrengine = VOISE_DEF_ASR_ENGINE;
 
-    if (vasrengine != NULL)
-        __voise_set_asr_engine(speech, vasrengine);
+    if (vasrengine == NULL || __voise_set_asr_engine(speech, vasrengine) < 0)
+        __voise_set_asr_engine(speech, VOISE_DEF_ASR_ENGINE);
 
     /* Default max initial silence */
     const char *vinitsil;
@@ -582,68 +2107,194 @@ static int voise_create(struct ast_speech *speech, int format)
     struct voise_speech_info *voise_info;
     voise_info = (struct voise_speech_info *)speech->data;
 
-    CHECK_NOT_NULL(voise_info, "Voise info is NULL", -1);
+    CHECK_NOT_NULL(voise_info, "Voise info is NULL", -1);
+
+    /* Multi-model streams */
+    const char *vmultimodel;
+    if ( (vmultimodel = ast_variable_retrieve(vcfg, "general", "multi_model")) )
+        voise_info->multi_model = ast_true(vmultimodel);
+
+    voise_info->serverip = ast_strdup(vserverip);
+
+    voise_info->client = ast_calloc( 1, sizeof( voise_client_t ) );
+
+    struct timeval connect_start = ast_tvnow();
+
+    int ret = __voise_connect(voise_info->client, vserverip, &voise_info->stats);
+
+    voise_info->connect_ms = (int)ast_tvdiff_ms(ast_tvnow(), connect_start);
+
+    if (ret < 0)
+    {
+        ast_log(LOG_ERROR, "Could not connect to Voise server (%s).\n", vserverip);
+        ast_config_destroy(vcfg);
+        __voise_speech_info_release(voise_info);
+        speech->data = NULL;
+        return -1;
+    }
+
+    __voise_stats_add(voise_info->stats, VOISE_STAT_SESSIONS, 1);
+
+    ast_config_destroy(vcfg);
+
+    ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+
+    return 0;
+}
+
+/*! \brief  Destroy connection to engine. */
+static int voise_destroy(struct ast_speech *speech)
+{
+    TRACE_FUNCTION();
+
+    CHECK_NOT_NULL(speech, "Speech is NULL", -1);
+
+    int verbose = __voise_get_verbose(speech);
+
+    struct voise_speech_info *voise_info;
+    voise_info = (struct voise_speech_info *)speech->data;
+
+    CHECK_NOT_NULL(voise_info, "Voise info is NULL", -1);
+
+    if (verbose)
+        ast_log(LOG_NOTICE, "Closing connection to Voise server.\n");
+
+    __voise_streams_abort(voise_info);
+
+    __voise_disconnect(voise_info->client, voise_info->stats);
+
+    __voise_stats_add(voise_info->stats, VOISE_STAT_SESSIONS, -1);
+
+    int i;
+    for (i = 0; i < VOISE_MAX_ACTIVE_GRAMMARS; ++i)
+    {
+        if (voise_info->fanout_clients[i] != NULL)
+        {
+            __voise_disconnect(voise_info->fanout_clients[i], voise_info->fanout_stats[i]);
+            ast_free(voise_info->fanout_clients[i]);
+        }
+    }
+
+    while (voise_info->num_active_grammars > 0)
+        __voise_remove_active_grammar(voise_info, voise_info->num_active_grammars - 1);
+
+    struct voise_loaded_grammar *loaded;
+    while ((loaded = AST_LIST_REMOVE_HEAD(&voise_info->loaded_grammars, list)))
+        __voise_free_loaded_grammar(loaded);
+
+    __voise_speech_info_release(voise_info);
+    speech->data = NULL;
+
+    return 0;
+}
+
+/*! \brief Load a local grammar on a speech structure */
+static int voise_load_grammar(struct ast_speech *speech, char *grammar_name, char *grammar)
+{
+    TRACE_FUNCTION();
+
+    CHECK_NOT_NULL(speech, "Speech is NULL", -1);
+
+    struct voise_speech_info *voise_info;
+    voise_info = (struct voise_speech_info *)speech->data;
+
+    CHECK_NOT_NULL(voise_info, "Voise info is NULL", -1);
+
+    int verbose = __voise_get_verbose(speech);
+
+    if (ast_strlen_zero(grammar_name) || ast_strlen_zero(grammar))
+    {
+        ast_log(LOG_ERROR, "Grammar name and path are required\n");
+        return -1;
+    }
+
+    if (!__voise_valid_model_name(grammar_name) || !(grammar_name = (char *)__voise_intern(grammar_name)))
+    {
+        ast_log(LOG_ERROR, "Invalid grammar name\n");
+        return -1;
+    }
+
+    if (__voise_find_loaded_grammar(voise_info, grammar_name) != NULL)
+    {
+        ast_log(LOG_WARNING, "Grammar '%s' already loaded\n", grammar_name);
+        __voise_unintern(grammar_name);
+        return 0;
+    }
+
+    char *content = ast_read_textfile(grammar);
+
+    if (content == NULL)
+    {
+        ast_log(LOG_ERROR, "Could not read grammar file %s\n", grammar);
+        __voise_unintern(grammar_name);
+        return -1;
+    }
+
+    struct voise_loaded_grammar *loaded = ast_calloc(1, sizeof(struct voise_loaded_grammar));
+
+    if (loaded == NULL)
+    {
+        ast_free(content);
+        __voise_unintern(grammar_name);
+        return -1;
+    }
+
+    loaded->name = grammar_name;
 
-    voise_info->client = ast_calloc( 1, sizeof( voise_client_t ) );
+    loaded->grammar = __voise_grammar_acquire(content);
 
-    int ret = voise_init(voise_info->client, vserverip, 8102, 1, __voise_capture_error_cb);
+    ast_free(content);
 
-    if (ret < 0)
+    if (loaded->grammar == NULL)
     {
-        ast_log(LOG_ERROR, "Could not connect to Voise server (%s).\n", vserverip);
-        ast_config_destroy(vcfg);
+        ast_log(LOG_ERROR, "Could not load grammar '%s'\n", grammar_name);
+        __voise_unintern(grammar_name);
+        ast_free(loaded);
         return -1;
     }
 
-    ast_config_destroy(vcfg);
+    AST_LIST_INSERT_TAIL(&voise_info->loaded_grammars, loaded, list);
 
-    ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+    if (verbose > 0)
+        ast_log(LOG_NOTICE, "Grammar '%s' loaded as %s\n", grammar_name, loaded->grammar->model_id);
 
     return 0;
 }
 
-/*! \brief  Destroy connection to engine. */
-static int voise_destroy(struct ast_speech *speech)
+/*! \brief Unload a local grammar from a speech structure */
+static int voise_unload_grammar(struct ast_speech *speech, char *grammar_name)
 {
     TRACE_FUNCTION();
 
     CHECK_NOT_NULL(speech, "Speech is NULL", -1);
 
-    int verbose = __voise_get_verbose(speech);
-
     struct voise_speech_info *voise_info;
     voise_info = (struct voise_speech_info *)speech->data;
 
     CHECK_NOT_NULL(voise_info, "Voise info is NULL", -1);
 
-    if (verbose)
-        ast_log(LOG_NOTICE, "Closing connection to Voise server.\n");
-
-    voise_close( voise_info->client );
-
-    ast_free(voise_info->client);
+    const char *name = __voise_lookup_interned(grammar_name);
+    struct voise_loaded_grammar *loaded = name ? __voise_find_loaded_grammar(voise_info, name) : NULL;
 
-    ast_free(voise_info);
-    voise_info = NULL;
+    if (loaded == NULL)
+    {
+        ast_log(LOG_WARNING, "Grammar '%s' is not loaded\n", grammar_name);
+        return -1;
+    }
 
-    return 0;
-}
+    AST_LIST_REMOVE(&voise_info->loaded_grammars, loaded, list);
 
-/*! \brief Load a local grammar on a speech structure */
-static int voise_load_grammar(struct ast_speech *speech, char *grammar_name, char *grammar)
-{
-    TRACE_FUNCTION();
+    int index = __voise_find_active_grammar(voise_info, name);
 
-    // Do nothing
-    return 0;
-}
+    if (index >= 0)
+    {
+        /* Streams reference the active grammars */
+        __voise_streams_abort(voise_info);
+        __voise_remove_active_grammar(voise_info, index);
+    }
 
-/*! \brief Unload a local grammar from a speech structure */
-static int voise_unload_grammar(struct ast_speech *speech, char *grammar_name)
-{
-    TRACE_FUNCTION();
+    __voise_free_loaded_grammar(loaded);
 
-    // Do nothing
     return 0;
 }
 
@@ -654,12 +2305,39 @@ static int voise_activate_grammar(struct ast_speech *speech, char *grammar_name)
 
     CHECK_NOT_NULL(speech, "Speech is NULL", -1);
 
+    struct voise_speech_info *voise_info;
+    voise_info = (struct voise_speech_info *)speech->data;
+
+    CHECK_NOT_NULL(voise_info, "Voise info is NULL", -1);
+
     int verbose = __voise_get_verbose(speech);
 
     if (verbose > 0)
         ast_log(LOG_NOTICE, "Activating grammar '%s'\n", grammar_name);
 
-    return __voise_set_model(speech, grammar_name);
+    if (ast_strlen_zero(grammar_name) || !__voise_valid_model_name(grammar_name))
+    {
+        ast_log(LOG_ERROR, "Invalid grammar name\n");
+        return -1;
+    }
+
+    const char *name = __voise_intern(grammar_name);
+
+    CHECK_NOT_NULL(name, "Could not activate grammar", -1);
+
+    /* A grammar loaded with SpeechLoadGrammar is referenced by its id,
+     * otherwise the name is a model known by the server */
+    struct voise_loaded_grammar *loaded = __voise_find_loaded_grammar(voise_info, name);
+    int ret;
+
+    if (loaded != NULL)
+        ret = __voise_add_active_grammar(voise_info, name, loaded->grammar->model_id, loaded->grammar);
+    else
+        ret = __voise_add_active_grammar(voise_info, name, name, NULL);
+
+    __voise_unintern(name);
+
+    return ret;
 }
 
 /*! \brief Deactivate a loaded grammar on a speech structure */
@@ -669,16 +2347,126 @@ static int voise_deactivate_grammar(struct ast_speech *speech, char *grammar_nam
 
     CHECK_NOT_NULL(speech, "Speech is NULL", -1);
 
+    struct voise_speech_info *voise_info;
+    voise_info = (struct voise_speech_info *)speech->data;
+
+    CHECK_NOT_NULL(voise_info, "Voise info is NULL", -1);
+
     int verbose = __voise_get_verbose(speech);
 
     if (verbose > 0)
         ast_log(LOG_NOTICE, "Deactivating grammar '%s'\n", grammar_name);
 
-    return __voise_set_model(speech, "");
+    const char *name = __voise_lookup_interned(grammar_name);
+    int index = name ? __voise_find_active_grammar(voise_info, name) : -1;
+
+    if (index < 0)
+    {
+        ast_log(LOG_WARNING, "Grammar '%s' is not active\n", grammar_name);
+        return -1;
+    }
+
+    /* Streams reference the active grammars */
+    __voise_streams_abort(voise_info);
+    __voise_remove_active_grammar(voise_info, index);
+
+    return 0;
 }
 
-/*! \brief Write in signed linear audio to be recognized */
-static int voise_write(struct ast_speech *speech, void *data, int len)
+/*! \brief Helper function. Keep the latencies of the recognition that ended,
+ * for VOISE_LATENCY() */
+static void __voise_save_call_latency(struct voise_speech_info *voise_info, enum voise_stat reason,
+    int endpoint_ms, int result_ms)
+{
+    struct voise_call_latency *latency = ast_threadstorage_get(&voise_call_latency_buf, sizeof(*latency));
+
+    if (latency == NULL)
+        return;
+
+    latency->ended = 1;
+    latency->connect_ms = voise_info->connect_ms;
+    latency->start_ms = voise_info->start_ms;
+    latency->onset_ms = voise_info->onset_ms;
+    latency->endpoint_ms = endpoint_ms;
+    latency->result_ms = result_ms;
+    latency->reason = reason;
+}
+
+/*! \brief Helper function. Record the latency of a result, stopped at start */
+static void __voise_record_result(struct timeval start, int speech_end_ms)
+{
+    int64_t elapsed = ast_tvdiff_us(ast_tvnow(), start);
+
+    __voise_hist_add(VOISE_HIST_RESULT, elapsed);
+
+    if (speech_end_ms >= 0)
+        __voise_hist_add(VOISE_HIST_END_OF_SPEECH, (int64_t)speech_end_ms * 1000 + elapsed);
+}
+
+/*! \brief Helper function. Stop the recognition and set its results
+ * \param reason counter of the end reason, counted when a result was set
+ * \param speech_end_ms time since the end of speech, -1 if speech did not end */
+static int __voise_stop_recognition(struct ast_speech *speech, struct voise_speech_info *voise_info,
+    enum voise_stat reason, int speech_end_ms)
+{
+    TRACE_FUNCTION();
+
+    struct timeval start = ast_tvnow();
+
+    if (voise_info->streams != NULL)
+    {
+        __voise_streams_join(voise_info);
+
+        int ret = __voise_streams_set_results(speech, voise_info);
+
+        __voise_streams_free(voise_info);
+
+        if (ret < 0)
+        {
+            ast_log(LOG_ERROR, "No stream got a result\n");
+            ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+
+            __voise_stats_add(voise_info->stats, VOISE_STAT_END_ERROR, 1);
+            __voise_save_call_latency(voise_info, VOISE_STAT_END_ERROR, speech_end_ms, -1);
+
+            return -1;
+        }
+
+        __voise_stats_add(voise_info->stats, reason, 1);
+        __voise_record_result(start, speech_end_ms);
+        __voise_save_call_latency(voise_info, reason, speech_end_ms, (int)ast_tvdiff_ms(ast_tvnow(), start));
+
+        return 0;
+    }
+
+    voise_response_t response;
+    int ret = voise_stop_streaming_recognize( voise_info->client, &response );
+
+    if (ret < 0)
+    {
+        ast_log(LOG_ERROR, "Streaming stop error: %d\n", ret);
+        ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+
+        __voise_stats_add(voise_info->stats, VOISE_STAT_END_ERROR, 1);
+        __voise_save_call_latency(voise_info, VOISE_STAT_END_ERROR, speech_end_ms, -1);
+
+        return -1;
+    }
+
+    __voise_stats_add(voise_info->stats, VOISE_STAT_BYTES_RECEIVED,
+        strlen(response.utterance) + strlen(response.intent));
+    __voise_stats_add(voise_info->stats, reason, 1);
+
+    __voise_set_result( speech, &response );
+
+    __voise_record_result(start, speech_end_ms);
+    __voise_save_call_latency(voise_info, reason, speech_end_ms, (int)ast_tvdiff_ms(ast_tvnow(), start));
+
+    return 0;
+}
+
+/*! \brief Helper function. Write in signed linear audio to be recognized */
+static int __voise_write(struct ast_speech *speech, void *data, int len)
 {
     TRACE_FUNCTION();
 
@@ -695,6 +2483,13 @@ static int voise_write(struct ast_speech *speech, void *data, int len)
     int maxsil = __voise_get_maxsilence(speech);
     int abs_timeout = __voise_get_abstimeout(speech);
 
+    /* Timeouts and speech onset count from the first audio */
+    if (voise_info->start_time == 0)
+    {
+        time(&voise_info->start_time);
+        voise_info->recog_start = ast_tvnow();
+    }
+
     /* The Voise system doesn't seem be helpful in detecting silence and determing
      * the end of an utterance on its own, so here we use Asterisk's silence detection
      * DSP to fake sane behaviour.
@@ -726,6 +2521,7 @@ static int voise_write(struct ast_speech *speech, void *data, int len)
 
             voise_info->heardspeech = 1;
             voise_info->noiseframes = 0;
+            voise_info->onset_ms = (int)ast_tvdiff_ms(ast_tvnow(), voise_info->recog_start);
 
             /* Stop sound file stream */
             speech->flags |= AST_SPEECH_QUIET;
@@ -738,60 +2534,21 @@ static int voise_write(struct ast_speech *speech, void *data, int len)
         if (verbose)
             ast_log(LOG_NOTICE, "Maximum initial silence detected: %d.\n", totalsil);
 
-        voise_response_t response;
-        int ret = voise_stop_streaming_recognize( voise_info->client, &response );
-
-        if (ret < 0)
-        {
-            ast_log(LOG_ERROR, "Streaming stop error: %d\n", ret);
-            ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
-
-            return -1;
-        }
-
-        __voise_set_result( speech, &response );
-
-        return 0;
+        return __voise_stop_recognition(speech, voise_info, VOISE_STAT_END_INITSIL, -1);
     }
     else if (voise_info->heardspeech && silence && maxsil >= 0 && maxsil <= totalsil)
     {
         if (verbose)
             ast_log(LOG_NOTICE, "Maximum final silence detected: %d.\n", totalsil);
 
-        voise_response_t response;
-        int ret = voise_stop_streaming_recognize( voise_info->client, &response );
-
-        if (ret < 0)
-        {
-            ast_log(LOG_ERROR, "Streaming stop error: %d\n", ret);
-            ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
-
-            return -1;
-        }
-
-        __voise_set_result( speech, &response );
-
-        return 0;
+        return __voise_stop_recognition(speech, voise_info, VOISE_STAT_END_MAXSIL, totalsil);
     }
     else if (abs_timeout > 0 && abs_timeout <= (current_time - voise_info->start_time))
     {
         if (verbose)
             ast_log(LOG_NOTICE, "Absolute timeout reached [%d seconds].\n", (int)(current_time - voise_info->start_time));
 
-        voise_response_t response;
-        int ret = voise_stop_streaming_recognize( voise_info->client, &response );
-
-        if (ret < 0)
-        {
-            ast_log(LOG_ERROR, "Streaming stop error: %d\n", ret);
-            ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
-
-            return -1;
-        }
-
-        __voise_set_result( speech, &response );
-
-        return 0;
+        return __voise_stop_recognition(speech, voise_info, VOISE_STAT_END_ABS_TIMEOUT, -1);
     }
     else if (silence)
     {
@@ -802,19 +2559,46 @@ static int voise_write(struct ast_speech *speech, void *data, int len)
         ast_log(LOG_DEBUG, ">>>> heardspeech: %d | silence: %d | totalsil: %d | noiseframes: %d | <<<<\n", voise_info->heardspeech, silence, totalsil, voise_info->noiseframes);
 #endif
 
-    int ret = voise_data_streaming_recognize( voise_info->client, data, len );
+    int ret;
+
+    if (voise_info->streams != NULL)
+    {
+        ret = __voise_streams_write(voise_info, data, len);
+    }
+    else
+    {
+        ret = voise_data_streaming_recognize( voise_info->client, data, len );
+
+        if (ret >= 0)
+            __voise_stats_add(voise_info->stats, VOISE_STAT_BYTES_SENT, len);
+    }
 
     if (ret < 0)
     {
         ast_log(LOG_ERROR, "Streaming data error: %d\n", ret);
         ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
 
+        __voise_stats_add(voise_info->stats, VOISE_STAT_END_ERROR, 1);
+        __voise_save_call_latency(voise_info, VOISE_STAT_END_ERROR, -1, -1);
+
         return -1;
     }
 
     return 0;
 }
 
+/*! \brief Write in signed linear audio to be recognized */
+static int voise_write(struct ast_speech *speech, void *data, int len)
+{
+    struct timeval start = ast_tvnow();
+
+    int ret = __voise_write(speech, data, len);
+
+    __voise_hist_since(VOISE_HIST_WRITE, start);
+
+    return ret;
+}
+
 /*! \brief Signal to the engine that DTMF was received */
 static int voise_dtmf(struct ast_speech *speech, const char *dtmf)
 {
@@ -844,31 +2628,98 @@ static int voise_start(struct ast_speech *speech)
 
     const char *lang = __voise_get_lang(speech);
     const char *asr_engine = __voise_get_asr_engine(speech);
-    const char *model_name = __voise_get_model(speech);
+
+    /* Streams of a recognition that was never stopped */
+    __voise_streams_abort(voise_info);
+
+    int num_active = voise_info->num_active_grammars;
+    int i;
 
     if (verbose)
     {
-        ast_log(LOG_VERBOSE, "Start recognize:\n  Lang: %s\n  Model name: %s\n  ASR engine: %s\n",
-            lang, model_name, asr_engine);
+        ast_log(LOG_VERBOSE, "Start recognize:\n  Lang: %s\n  ASR engine: %s\n", lang, asr_engine);
+
+        for (i = 0; i < num_active; ++i)
+            ast_log(LOG_VERBOSE, "  Model name: %s\n", voise_info->active_grammars[i].model_name);
     }
 
-    voise_response_t response;
-    int ret = voise_start_streaming_recognize(
-        voise_info->client, &response, "LINEAR16", 8000, lang, NULL, model_name, asr_engine);
+    /* A multi-model stream can only reference grammars the server already has */
+    int all_uploaded = 1;
 
-    if (ret < 0)
+    for (i = 0; i < num_active; ++i)
     {
-        ast_log(LOG_ERROR, "Streaming start error: %d\n", ret);
-        return -1;
+        struct voise_grammar *grammar = voise_info->active_grammars[i].grammar;
+
+        if (grammar != NULL && !__voise_grammar_is_uploaded(grammar))
+            all_uploaded = 0;
     }
 
-    if (response.result_code != 201)
+    int ret;
+
+    struct timeval start = ast_tvnow();
+
+    if (num_active > 1 && voise_info->multi_model && all_uploaded)
     {
-        ast_log(LOG_ERROR, "Streaming not started: %s\n", response.result_message);
-        return -1;
+        struct ast_str *model_names = ast_str_create(256);
+
+        CHECK_NOT_NULL(model_names, "Could not alloc model names", -1);
+
+        for (i = 0; i < num_active; ++i)
+            ast_str_append(&model_names, 0, "%s%s", i ? "," : "", voise_info->active_grammars[i].model_name);
+
+        ret = __voise_start_stream(voise_info->client, voise_info->stats, lang, asr_engine, ast_str_buffer(model_names), NULL, verbose);
+
+        ast_free(model_names);
+
+        if (ret < 0)
+        {
+            /* The server may have lost grammars (e.g. restart): upload them again
+             * with one stream each. The next start is multi-model again */
+            if (verbose)
+                ast_log(LOG_NOTICE, "Multi-model start refused, starting one stream per grammar\n");
+
+            for (i = 0; i < num_active; ++i)
+            {
+                struct voise_grammar *grammar = voise_info->active_grammars[i].grammar;
+
+                if (grammar != NULL)
+                    __voise_grammar_set_uploaded(grammar, 0);
+            }
+
+            ret = __voise_streams_start(voise_info, lang, asr_engine);
+        }
+    }
+    else if (num_active > 1)
+    {
+        ret = __voise_streams_start(voise_info, lang, asr_engine);
+    }
+    else if (num_active == 1)
+    {
+        struct voise_active_grammar *active = &voise_info->active_grammars[0];
+
+        ret = __voise_start_stream(voise_info->client, voise_info->stats, lang, asr_engine, active->model_name, active->grammar, verbose);
+    }
+    else
+    {
+        ret = __voise_start_stream(voise_info->client, voise_info->stats, lang, asr_engine, "", NULL, verbose);
     }
 
-    time(&voise_info->start_time);
+    if (ret < 0)
+        return -1;
+
+    __voise_stats_add(voise_info->stats, VOISE_STAT_RECOG_STARTED, 1);
+
+    /* Audio may come later than the start: VoiseAsk starts the stream
+     * while its prompt plays */
+    voise_info->start_time = 0;
+    voise_info->start_ms = (int)ast_tvdiff_ms(ast_tvnow(), start);
+    voise_info->onset_ms = -1;
+
+    /* VOISE_LATENCY() is about this recognition from now on */
+    struct voise_call_latency *latency = ast_threadstorage_get(&voise_call_latency_buf, sizeof(*latency));
+
+    if (latency != NULL)
+        latency->ended = 0;
 
     /* Voise engine is ready to accept samples */
     ast_speech_change_state(speech, AST_SPEECH_STATE_READY);
@@ -957,6 +2808,55 @@ static struct ast_speech_result* voise_get(struct ast_speech *speech)
     return speech->results;
 }
 
+/*! \brief VOISE_LATENCY(name) dialplan function read callback */
+static int voise_latency_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+    struct voise_call_latency *latency = ast_threadstorage_get(&voise_call_latency_buf, sizeof(*latency));
+    int ms;
+
+    *buf = '\0';
+
+    if (ast_strlen_zero(data))
+    {
+        ast_log(LOG_WARNING, "%s requires an argument\n", cmd);
+        return -1;
+    }
+
+    if (latency == NULL || !latency->ended)
+        return 0;
+
+    if (!strcasecmp(data, "connect"))
+        ms = latency->connect_ms;
+    else if (!strcasecmp(data, "start"))
+        ms = latency->start_ms;
+    else if (!strcasecmp(data, "speech_onset"))
+        ms = latency->onset_ms;
+    else if (!strcasecmp(data, "endpoint"))
+        ms = latency->endpoint_ms;
+    else if (!strcasecmp(data, "result"))
+        ms = latency->result_ms;
+    else if (!strcasecmp(data, "end_reason"))
+    {
+        ast_copy_string(buf, voise_end_reasons[latency->reason], len);
+        return 0;
+    }
+    else
+    {
+        ast_log(LOG_WARNING, "%s: unknown latency '%s'\n", cmd, data);
+        return -1;
+    }
+
+    if (ms >= 0)
+        snprintf(buf, len, "%d", ms);
+
+    return 0;
+}
+
+static struct ast_custom_function voise_latency_function = {
+    .name = "VOISE_LATENCY",
+    .read = voise_latency_read,
+};
+
 static struct ast_speech_engine voise_engine = {
     .name = "voise",
     .create = voise_create,
@@ -979,6 +2879,24 @@ static int load_module(void)
 
     if (__init_voise_res_speech() == 1)
     {
+        voise_interned = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, VOISE_INTERNED_BUCKETS,
+            __voise_interned_hash_fn, NULL, __voise_interned_cmp_fn);
+
+        if (!voise_interned)
+        {
+            ast_log(LOG_ERROR, "Failed to alloc interned strings table\n");
+            return AST_MODULE_LOAD_FAILURE;
+        }
+
+        voise_grammars = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, VOISE_GRAMMAR_BUCKETS,
+            __voise_grammar_hash_fn, NULL, __voise_grammar_cmp_fn);
+
+        if (!voise_grammars)
+        {
+            ast_log(LOG_ERROR, "Failed to alloc grammar table\n");
+            return AST_MODULE_LOAD_FAILURE;
+        }
+
         voise_engine.formats = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
 
         if (!voise_engine.formats)
@@ -995,6 +2913,18 @@ static int load_module(void)
             return AST_MODULE_LOAD_FAILURE;
         }
 
+        ast_cli_register_multiple(voise_cli, ARRAY_LEN(voise_cli));
+        ast_custom_function_register(&voise_latency_function);
+
+        /* Do not hold Asterisk startup while the server loads the models */
+        voise_warmup_stop = 0;
+
+        if (ast_pthread_create_background(&voise_warmup_thread, NULL, __voise_warmup_thread, NULL))
+        {
+            ast_log(LOG_WARNING, "Failed to start Voise warm-up\n");
+            voise_warmup_thread = AST_PTHREADT_NULL;
+        }
+
         return AST_MODULE_LOAD_SUCCESS;
     }
     else
@@ -1008,7 +2938,43 @@ static int unload_module(void)
 {
     ast_log(LOG_NOTICE, "Unloading Voise resourse speech\n");
 
-    return ast_speech_unregister(voise_engine.name);
+    int res = ast_speech_unregister(voise_engine.name);
+
+    /* Sessions hold interned strings and slab slots: wait until they are gone */
+    if (__voise_speech_info_in_use() > 0)
+    {
+        ast_log(LOG_WARNING, "Voise sessions still in use, not unloading\n");
+
+        if (!res)
+            ast_speech_register(&voise_engine);
+
+        return -1;
+    }
+
+    ast_cli_unregister_multiple(voise_cli, ARRAY_LEN(voise_cli));
+    ast_custom_function_unregister(&voise_latency_function);
+
+    voise_warmup_stop = 1;
+
+    if (voise_warmup_thread != AST_PTHREADT_NULL)
+    {
+        pthread_join(voise_warmup_thread, NULL);
+        voise_warmup_thread = AST_PTHREADT_NULL;
+    }
+
+    __voise_free_warmup_results(&voise_warmup_last);
+
+    ao2_cleanup(voise_grammars);
+    voise_grammars = NULL;
+
+    __voise_speech_info_destroy_slab();
+
+    __voise_stats_free();
+
+    ao2_cleanup(voise_interned);
+    voise_interned = NULL;
+
+    return res;
 }
 
 AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Voise engine");
@@ -0,0 +1,221 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2016, Voise
+ *
+ * Voise <cirillor@lbv.org.br>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Voise runtime counters and latency histograms
+ *
+ * Shared by the Voise modules, each with tables of its own. A module includes
+ * it after its enum voise_stat and enum voise_hist, which end with
+ * VOISE_STAT_MAX and VOISE_HIST_MAX.
+ *
+ * \author Voise <cirillor@lbv.org.br>
+ */
+
+#ifndef _VOISE_STATS_H
+#define _VOISE_STATS_H
+
+#include <math.h>
+#include <sched.h>
+
+#include "asterisk/linkedlists.h"
+#include "asterisk/time.h"
+#include "asterisk/utils.h"
+
+/* Slots of the runtime counters, one per CPU (higher CPUs share them) */
+#define VOISE_STATS_SLOTS 64
+
+/* Latency histograms: every power of two of microseconds is split in
+ * 2^VOISE_HIST_SUB_BITS buckets (within 12.5%), up to 2^VOISE_HIST_MAX_BITS us */
+#define VOISE_HIST_SUB_BITS 3
+#define VOISE_HIST_SUB_BUCKETS (1 << VOISE_HIST_SUB_BITS)
+#define VOISE_HIST_MAX_BITS 36
+#define VOISE_HIST_BUCKETS ((VOISE_HIST_MAX_BITS - VOISE_HIST_SUB_BITS + 1) * VOISE_HIST_SUB_BUCKETS)
+
+/* Counters of one CPU, on cache lines of their own */
+struct voise_stats_slot
+{
+    int64_t counters[VOISE_STAT_MAX];
+} __attribute__((aligned(64)));
+
+/* Counters of one server. The hot path adds to the slot of the CPU it runs
+ * on, with a relaxed atomic and no lock; readers sum the slots */
+struct voise_stats
+{
+    struct voise_stats_slot slots[VOISE_STATS_SLOTS];
+    char server[256];
+
+    AST_RWLIST_ENTRY(voise_stats) list;
+};
+
+/* Counters of every server connected so far, kept until the module is unloaded */
+static AST_RWLIST_HEAD_STATIC(voise_stats_servers, voise_stats);
+
+/* Latency histogram, log-bucketed like an HDR histogram. Buckets are
+ * updated with atomic increments, without a lock */
+struct voise_histogram
+{
+    uint64_t buckets[VOISE_HIST_BUCKETS];
+    uint64_t sum;
+    uint64_t max;
+};
+
+static struct voise_histogram voise_histograms[VOISE_HIST_MAX];
+
+/*! \brief Helper function. Add to a counter, on the slot of the current CPU */
+static inline void __voise_stats_add(struct voise_stats *stats, enum voise_stat stat, int64_t value)
+{
+    if (stats == NULL)
+        return;
+
+    int cpu = sched_getcpu();
+
+    struct voise_stats_slot *slot = &stats->slots[(cpu < 0 ? 0 : cpu) % VOISE_STATS_SLOTS];
+
+    __atomic_fetch_add(&slot->counters[stat], value, __ATOMIC_RELAXED);
+}
+
+/*! \brief Helper function. Sum a counter over the CPU slots */
+static inline int64_t __voise_stats_get(struct voise_stats *stats, enum voise_stat stat)
+{
+    int64_t value = 0;
+    int i;
+
+    for (i = 0; i < VOISE_STATS_SLOTS; ++i)
+        value += __atomic_load_n(&stats->slots[i].counters[stat], __ATOMIC_RELAXED);
+
+    return value;
+}
+
+/*! \brief Helper function. Counters of a server, created on first use */
+static inline struct voise_stats* __voise_stats_server(const char *server)
+{
+    struct voise_stats *stats;
+
+    AST_RWLIST_RDLOCK(&voise_stats_servers);
+    AST_RWLIST_TRAVERSE(&voise_stats_servers, stats, list)
+    {
+        if (!strcmp(stats->server, server))
+            break;
+    }
+    AST_RWLIST_UNLOCK(&voise_stats_servers);
+
+    if (stats != NULL)
+        return stats;
+
+    AST_RWLIST_WRLOCK(&voise_stats_servers);
+
+    /* Added by another thread meanwhile */
+    AST_RWLIST_TRAVERSE(&voise_stats_servers, stats, list)
+    {
+        if (!strcmp(stats->server, server))
+            break;
+    }
+
+    if (stats == NULL && (stats = ast_calloc_cache_align(1, sizeof(*stats))))
+    {
+        ast_copy_string(stats->server, server, sizeof(stats->server));
+        AST_RWLIST_INSERT_TAIL(&voise_stats_servers, stats, list);
+    }
+
+    AST_RWLIST_UNLOCK(&voise_stats_servers);
+
+    return stats;
+}
+
+/*! \brief Helper function. Free the counters of every server */
+static inline void __voise_stats_free(void)
+{
+    struct voise_stats *stats;
+
+    AST_RWLIST_WRLOCK(&voise_stats_servers);
+
+    while ((stats = AST_RWLIST_REMOVE_HEAD(&voise_stats_servers, list)))
+        ast_free(stats);
+
+    AST_RWLIST_UNLOCK(&voise_stats_servers);
+}
+
+/*! \brief Helper function. Bucket of a latency, in microseconds */
+static inline int __voise_hist_bucket(uint64_t us)
+{
+    if (us < VOISE_HIST_SUB_BUCKETS)
+        return (int)us;
+
+    int msb = 63 - __builtin_clzll(us);
+
+    if (msb >= VOISE_HIST_MAX_BITS)
+        return VOISE_HIST_BUCKETS - 1;
+
+    int shift = msb - VOISE_HIST_SUB_BITS;
+
+    return (shift + 1) * VOISE_HIST_SUB_BUCKETS + (int)(us >> shift) - VOISE_HIST_SUB_BUCKETS;
+}
+
+/*! \brief Helper function. Highest latency of a bucket, in microseconds */
+static inline uint64_t __voise_hist_bucket_value(int bucket)
+{
+    if (bucket < VOISE_HIST_SUB_BUCKETS)
+        return bucket;
+
+    int shift = bucket / VOISE_HIST_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % VOISE_HIST_SUB_BUCKETS;
+
+    return ((VOISE_HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/*! \brief Helper function. Record a latency, in microseconds */
+static inline void __voise_hist_add(enum voise_hist hist, int64_t us)
+{
+    struct voise_histogram *h = &voise_histograms[hist];
+    uint64_t value = us > 0 ? (uint64_t)us : 0;
+
+    __atomic_fetch_add(&h->buckets[__voise_hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*! \brief Helper function. Record the latency since start */
+static inline void __voise_hist_since(enum voise_hist hist, struct timeval start)
+{
+    __voise_hist_add(hist, ast_tvdiff_us(ast_tvnow(), start));
+}
+
+/*! \brief Helper function. Latency of a percentile, from a copy of the buckets */
+static inline uint64_t __voise_hist_percentile(const uint64_t *buckets, uint64_t count, double percentile)
+{
+    uint64_t rank = (uint64_t)ceil(percentile / 100.0 * count);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < VOISE_HIST_BUCKETS; ++i)
+    {
+        seen += buckets[i];
+
+        if (seen >= rank && seen > 0)
+            return __voise_hist_bucket_value(i);
+    }
+
+    return 0;
+}
+
+#endif /* _VOISE_STATS_H */